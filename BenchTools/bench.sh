@@ -0,0 +1,178 @@
+#!/bin/sh
+
+# end-to-end benchmark of a mounted webfs: builds a test tree and its
+#  metadata file, serves it with httpstub.py, then for each webfs
+#  configuration mounts webfs and runs each workload of benchio (on a
+#  fresh mount each time).
+# results are printed and kept in <workdir>/results.txt, one line per
+#  configuration and workload. With -b, throughput is compared to a
+#  previous results file and regressions are reported (exit code 1).
+# to be run from this directory (webfs must be built in ..).
+
+
+WORK=/tmp/webfs-bench
+PORT=18090
+SIZE=256        # size of the big file (MB)
+NSMALL=2000     # number of small files
+CONFIGS=""      # webfs options, one configuration per line
+BASELINE=""
+RESULTS=""      # results file (default <workdir>/results.txt)
+SERVER_OPTS=""  # options of httpstub.py (network conditions)
+TOLERANCE=10    # % of throughput lost before reporting a regression
+WEBFS=../webfs
+
+usage() {
+  echo "Usage: $0 [options]"
+  echo "  -w <dir>      work directory (default $WORK)"
+  echo "  -p <port>     port of HTTP server (default $PORT)"
+  echo "  -s <MB>       size of the big file (default $SIZE)"
+  echo "  -n <N>        number of small files (default $NSMALL)"
+  echo "  -o <options>  webfs options of a configuration (can be repeated,"
+  echo "                default: '-s' and '-s --chunks=8')"
+  echo "  -S <options>  options of httpstub.py, i.e. '-P wan' (see httpstub.py -h)"
+  echo "  -r <file>     results file (default <workdir>/results.txt)"
+  echo "  -b <file>     previous results to compare with"
+  echo "  -t <percent>  tolerance for regressions (default $TOLERANCE)"
+  exit 1
+}
+
+while getopts "w:p:s:n:o:S:r:b:t:h" OPT
+do
+  case $OPT in
+    w) WORK="$OPTARG" ;;
+    p) PORT="$OPTARG" ;;
+    s) SIZE="$OPTARG" ;;
+    n) NSMALL="$OPTARG" ;;
+    o) CONFIGS="$CONFIGS$OPTARG
+" ;;
+    S) SERVER_OPTS="$OPTARG" ;;
+    r) RESULTS="$OPTARG" ;;
+    b) BASELINE="$OPTARG" ;;
+    t) TOLERANCE="$OPTARG" ;;
+    *) usage ;;
+  esac
+done
+if [ "$CONFIGS" = "" ]
+then
+  CONFIGS="-s
+-s --chunks=8
+"
+fi
+
+if [ ! -x "$WEBFS" ]
+then
+  echo "$WEBFS not found (run ../compil.sh first). Abort." >&2
+  exit 2
+fi
+./compil.sh benchio > /dev/null || exit 2
+
+WWW="$WORK/www"
+MNT="$WORK/mnt"
+[ "$RESULTS" = "" ] && RESULTS="$WORK/results.txt"
+mkdir -p "$WWW" "$MNT" || exit 2
+
+
+# test tree (kept between runs if same parameters)
+if [ "`cat $WORK/params 2> /dev/null`" != "$SIZE $NSMALL" ]
+then
+  echo "Building test tree in $WWW..."
+  rm -rf "$WWW"/*
+  dd if=/dev/urandom of="$WWW/big.bin" bs=1048576 count=$SIZE 2> /dev/null
+  N=0
+  while [ $N -lt $NSMALL ]
+  do
+    D="$WWW/small/d`expr $N / 100`"
+    [ -d "$D" ] || mkdir -p "$D"
+    head -c `expr 1024 + $N % 8 \* 1024` /dev/urandom > "$D/f$N"
+    N=`expr $N + 1`
+  done
+  echo "$SIZE $NSMALL" > $WORK/params
+fi
+
+# metadata file (see DescriptionFormat.txt)
+(cd "$WWW" && find . ! -name description.data -printf "%y %s %i %T@ %n %m\n%P\n") | awk -v NOW=`date +%s` '
+  NR % 2 == 1 { split($0, f, " "); next }
+  {
+    nb++
+    hdr[nb] = ((f[1] == "d")?0:1) " " f[2] " " f[3] " " int(f[4]) " " f[5] " " f[6]
+    name[nb] = ($0 == "")?".":$0
+  }
+  END {
+    print NOW
+    print nb
+    for(i=1; i<=nb; i++) {
+      print hdr[i]
+      print name[i]
+    }
+  }' > "$WWW/description.data"
+
+
+# HTTP server
+python3 ./httpstub.py -p $PORT $SERVER_OPTS "$WWW" 2> "$WORK/httpstub.log" &
+SERVER=$!
+trap 'fusermount -u "$MNT" 2> /dev/null; kill $SERVER 2> /dev/null' EXIT INT TERM
+sleep 1
+
+# mount webfs with given options, wait for the tree
+mount_webfs() {
+  $WEBFS --url=http://127.0.0.1:$PORT -r $1 "$MNT" > "$WORK/webfs.out" 2>&1 || return 1
+  I=0
+  while [ ! -f "$MNT/big.bin" ]
+  do
+    I=`expr $I + 1`
+    [ $I -gt 50 ] && return 1
+    sleep 0.2
+  done
+  return 0
+}
+
+# workloads: name and benchio arguments
+WORKLOADS="seq seq $MNT/big.bin
+rand -b 4096 -n 2000 rand $MNT/big.bin
+small small $MNT/small
+meta meta $MNT
+conc -t 8 -n 4000 conc $MNT/big.bin"
+
+: > "$RESULTS"
+echo "$CONFIGS" | while read CONF
+do
+  [ "$CONF" = "" ] && continue
+  # configuration name: its options without spaces
+  NAME=`echo "$CONF" | tr ' ' '_'`
+  echo "$WORKLOADS" | while read WL ARGS
+  do
+    if ! mount_webfs "$CONF"
+    then
+      echo "$NAME $WL failed to mount" | tee -a "$RESULTS"
+      fusermount -u "$MNT" 2> /dev/null
+      continue
+    fi
+    echo "$NAME `./benchio $ARGS`" | tee -a "$RESULTS"
+    fusermount -u "$MNT"
+    sleep 0.5
+  done
+done
+
+# compare with previous results: throughput (MB/s, or ops/s for meta)
+[ "$BASELINE" = "" ] && exit 0
+awk -v TOL=$TOLERANCE '
+  function value(line,    f, i, v) {
+    split(line, f, " ")
+    for(i=3; f[i] != ""; i++) {
+      split(f[i], v, "=")
+      if ((v[1] == "mbps")&&(f[2] != "meta")) return(v[2])
+      if ((v[1] == "opsps")&&(f[2] == "meta")) return(v[2])
+    }
+    return(-1)
+  }
+  FNR == NR { old[$1 " " $2] = value($0); next }
+  {
+    k = $1 " " $2
+    if (!(k in old) || (old[k] <= 0)) next
+    new = value($0)
+    if (new < old[k]*(100-TOL)/100) {
+      printf("REGRESSION %s: %.2f -> %.2f (%.1f%%)\n", k, old[k], new, (new-old[k])*100/old[k])
+      bad = 1
+    }
+  }
+  END { exit(bad) }' "$BASELINE" "$RESULTS"
@@ -0,0 +1,48 @@
+#!/bin/sh
+
+# runs the end-to-end benchmark (bench.sh) under several network
+#  conditions emulated by httpstub.py (see PROFILES in it). Results of
+#  each profile are kept in <dir>/results-<profile>.txt.
+# with -B <dir>, results are compared to the ones of a previous run
+#  in <dir> (same profile), and the exit code is 1 if one regressed.
+# other options are given to bench.sh (i.e. -o for webfs options).
+# to be run from this directory.
+
+
+PROFILES="lan wan xregion mobile flaky"
+WORK=/tmp/webfs-bench
+BASEDIR=""
+
+usage() {
+  echo "Usage: $0 [-P \"profile...\"] [-w <dir>] [-B <dir>] [bench.sh options]"
+  echo "  -P <list>  network profiles (default: $PROFILES)"
+  echo "  -w <dir>   work directory (default $WORK)"
+  echo "  -B <dir>   directory with results of a previous run to compare with"
+  exit 1
+}
+
+# our options first, the rest is for bench.sh
+while [ $# -gt 0 ]
+do
+  case "$1" in
+    -P) PROFILES="$2"; shift 2 ;;
+    -w) WORK="$2"; shift 2 ;;
+    -B) BASEDIR="$2"; shift 2 ;;
+    -h|--help) usage ;;
+    *) break ;;
+  esac
+done
+
+RET=0
+for P in $PROFILES
+do
+  echo "=== profile $P"
+  BASE=""
+  if [ "$BASEDIR" != "" -a -f "$BASEDIR/results-$P.txt" ]
+  then
+    BASE="-b $BASEDIR/results-$P.txt"
+  fi
+  ./bench.sh -w "$WORK" -S "-P $P" -r "$WORK/results-$P.txt" $BASE "$@" || RET=1
+  tail -1 "$WORK/httpstub.log"
+done
+exit $RET
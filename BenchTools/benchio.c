@@ -0,0 +1,263 @@
+/* workloads for end-to-end benchmarks on a mounted webfs (or any
+   directory): sequential and random reads of a file, small files,
+   metadata walk, concurrent readers. Each operation is timed and a
+   line is printed with throughput and latency percentiles:
+     <workload> ops=<N> bytes=<N> time=<s> mbps=<MB/s> opsps=<ops/s>
+                p50=<us> p99=<us> errors=<N> */
+
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+
+/* latencies of operations (us) */
+typedef struct {
+  unsigned int *lat;
+  unsigned long long nb, max;
+  unsigned long long bytes;
+  unsigned long long errors;
+}Sample;
+
+/* settings */
+unsigned int opt_bs = 65536;      /* size of reads */
+unsigned long long opt_count = 1000; /* number of random reads */
+int opt_threads = 4;
+char *opt_path = NULL;
+
+/* sample used by walk callbacks */
+Sample *walk_sample;
+int walk_read;
+char *walk_buf;
+
+
+static unsigned long long now_us() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((unsigned long long)ts.tv_sec*1000000ULL + ts.tv_nsec/1000);
+}
+
+static void sample_put(Sample *s, unsigned int lat) {
+  if (s->nb == s->max) {
+    s->max = s->max?s->max*2:4096;
+    s->lat = realloc(s->lat, s->max*sizeof(unsigned int));
+    if (s->lat == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(2);
+    }
+  }
+  s->lat[s->nb++] = lat;
+}
+
+static void sample_add(Sample *s, unsigned long long start, long bytes) {
+  sample_put(s, (unsigned int)(now_us()-start));
+  if (bytes < 0)
+    s->errors++;
+  else
+    s->bytes += bytes;
+}
+
+static int cmp_lat(const void *a, const void *b) {
+  unsigned int x=*(unsigned int*)a, y=*(unsigned int*)b;
+  return((x > y) - (x < y));
+}
+
+static void sample_print(const char *name, Sample *s, unsigned long long elapsed) {
+  unsigned int p50=0, p99=0;
+
+  if (elapsed == 0)
+    elapsed = 1;
+  if (s->nb > 0) {
+    qsort(s->lat, s->nb, sizeof(unsigned int), cmp_lat);
+    p50 = s->lat[s->nb/2];
+    p99 = s->lat[(s->nb*99)/100];
+  }
+  printf("%s ops=%llu bytes=%llu time=%.3f mbps=%.2f opsps=%.1f p50=%u p99=%u errors=%llu\n",
+         name, s->nb, s->bytes, elapsed/1000000.0,
+         s->bytes/(elapsed/1000000.0)/(1024*1024), s->nb*1000000.0/elapsed,
+         p50, p99, s->errors);
+}
+
+/* read a whole file sequentially */
+static void run_seq(Sample *s, const char *file, char *buf) {
+  unsigned long long start;
+  off_t off=0;
+  ssize_t r;
+  int fd;
+
+  fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    s->errors++;
+    return;
+  }
+  while(1) {
+    start = now_us();
+    r = pread(fd, buf, opt_bs, off);
+    if (r == 0)
+      break;  /* end of file */
+    sample_add(s, start, r);
+    if (r < 0)
+      break;
+    off += r;
+  }
+  close(fd);
+}
+
+/* random reads in a file. 'seed' for rand_r */
+static void run_rand(Sample *s, const char *file, char *buf,
+                     unsigned long long count, unsigned int *seed) {
+  unsigned long long start, i;
+  struct stat st;
+  off_t off;
+  int fd;
+
+  fd = open(file, O_RDONLY);
+  if ((fd < 0)||(fstat(fd, &st) < 0)||(st.st_size < opt_bs)) {
+    s->errors++;
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  for(i=0; i<count; i++) {
+    off = (off_t)(((double)rand_r(seed)/RAND_MAX)*(st.st_size-opt_bs));
+    start = now_us();
+    sample_add(s, start, pread(fd, buf, opt_bs, off));
+  }
+  close(fd);
+}
+
+/* walk callback: stat (done by nftw) or open/read/close each file */
+static int walk_entry(const char *path, const struct stat *st, int flag,
+                      struct FTW *ftw) {
+  unsigned long long start;
+  struct stat tmp;
+  long total=0;
+  ssize_t r;
+  int fd;
+
+  if (!walk_read) {
+    /* metadata storm: stat of each entry (as ls -lR, nftw did the
+       readdir and a first stat) */
+    start = now_us();
+    sample_add(walk_sample, start, lstat(path, &tmp)?-1:0);
+    return(0);
+  }
+  if (flag != FTW_F)
+    return(0);
+  start = now_us();
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    sample_add(walk_sample, start, -1);
+    return(0);
+  }
+  while((r = read(fd, walk_buf, opt_bs)) > 0)
+    total += r;
+  close(fd);
+  sample_add(walk_sample, start, (r < 0)?-1:total);
+  return(0);
+}
+
+/* concurrent readers */
+typedef struct {
+  Sample s;
+  char *buf;
+  unsigned int seed;
+}Reader;
+
+static void *reader(void *data) {
+  Reader *r = data;
+
+  run_rand(&(r->s), opt_path, r->buf, opt_count/opt_threads, &(r->seed));
+  return(NULL);
+}
+
+static void run_conc(Sample *s) {
+  pthread_t th[opt_threads];
+  Reader rd[opt_threads];
+  unsigned long long i;
+  int t;
+
+  for(t=0; t<opt_threads; t++) {
+    memset(&(rd[t]), 0, sizeof(Reader));
+    rd[t].seed = t+1;
+    rd[t].buf = malloc(opt_bs);
+    pthread_create(&(th[t]), NULL, reader, &(rd[t]));
+  }
+  for(t=0; t<opt_threads; t++) {
+    pthread_join(th[t], NULL);
+    /* merge samples */
+    for(i=0; i<rd[t].s.nb; i++)
+      sample_put(s, rd[t].s.lat[i]);
+    s->bytes += rd[t].s.bytes;
+    s->errors += rd[t].s.errors;
+    free(rd[t].s.lat);
+    free(rd[t].buf);
+  }
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [options] <workload> <path>\n"
+    "   workloads: seq <file>, rand <file>, small <dir>, meta <dir>,\n"
+    "              conc <file> (random reads from several threads)\n"
+    "   -b <size>  size of reads (default 65536)\n"
+    "   -n <N>     number of random reads (default 1000)\n"
+    "   -t <N>     threads for conc (default 4)\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long long start;
+  unsigned int seed=1;
+  Sample s;
+  char *buf;
+  int opt;
+
+  while((opt = getopt(argc, argv, "b:n:t:")) != -1) {
+    switch(opt) {
+      case 'b': opt_bs = atoi(optarg); break;
+      case 'n': opt_count = strtoull(optarg, NULL, 10); break;
+      case 't': opt_threads = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if ((optind+2 != argc)||(opt_bs == 0)||(opt_threads <= 0))
+    usage(argv[0]);
+  opt_path = argv[optind+1];
+  buf = malloc(opt_bs);
+  if (buf == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(2);
+  }
+  memset(&s, 0, sizeof(s));
+  walk_sample = &s;
+  walk_buf = buf;
+
+  start = now_us();
+  if (strcmp(argv[optind], "seq") == 0)
+    run_seq(&s, opt_path, buf);
+  else if (strcmp(argv[optind], "rand") == 0)
+    run_rand(&s, opt_path, buf, opt_count, &seed);
+  else if (strcmp(argv[optind], "small") == 0) {
+    walk_read = 1;
+    nftw(opt_path, walk_entry, 64, FTW_PHYS);
+  } else if (strcmp(argv[optind], "meta") == 0) {
+    walk_read = 0;
+    nftw(opt_path, walk_entry, 64, FTW_PHYS);
+  } else if (strcmp(argv[optind], "conc") == 0)
+    run_conc(&s);
+  else
+    usage(argv[0]);
+  sample_print(argv[optind], &s, now_us()-start);
+
+  free(s.lat);
+  free(buf);
+  return(s.errors?3:0);
+}
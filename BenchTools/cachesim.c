@@ -0,0 +1,484 @@
+/* cache simulator: replays the reads of an access trace (recorded by
+   webfs --trace) on a model of the webfs block cache, for a grid of
+   settings (chunk size, number of chunks, budgets, eviction policy,
+   readahead), and reports hit ratio and origin requests/bytes.
+   as in webfs a file has a cache from open to release, with a
+   firstblock loaded at open and never evicted.
+   no data is moved, so a whole grid runs in seconds.
+   file sizes are not in the trace: the size of a file is the largest
+   offset+result seen for it */
+
+#include "tree.h"
+#include "cache.h"
+#include "record.h"
+#include "tools.h"
+
+
+/* needed by webfs internals */
+char *url_path = NULL;
+int opt_exec_files = 0;
+
+
+/* limits of the model */
+#define SIM_MAX_CHUNK 64  /* chunks per file */
+#define SIM_MAX_GRID  16  /* values per parameter */
+
+/* eviction policies */
+#define POL_OFFSET 0  /* smallest offset (what webfs does) */
+#define POL_LRU    1  /* least recently used */
+#define POL_FIFO   2  /* oldest loaded */
+char *pol_names[] = { "offset", "lru", "fifo", NULL };
+
+/* an operation of the trace (only those used by the model) */
+typedef struct {
+  int op;          /* REC_OPEN, REC_READ, REC_RELEASE */
+  int file;        /* index in files */
+  unsigned int offset, size;
+}SimOp;
+
+/* a chunk in the model */
+typedef struct {
+  unsigned int start, end;  /* [start, end[ */
+  unsigned long long used;  /* last use (clock) */
+  unsigned long long loaded;
+}SimChunk;
+
+/* a file of the trace, with its cache */
+typedef struct {
+  char *name;
+  unsigned int size;
+  int open;          /* has a cache */
+  unsigned long long used;
+  unsigned int first;  /* size of firstblock (loaded at open, kept) */
+  int nb;            /* chunks */
+  SimChunk chunks[SIM_MAX_CHUNK];
+  unsigned int chunksize;  /* adaptive size */
+  unsigned int next_off;
+  int score;
+}SimFile;
+
+/* a configuration of the grid */
+typedef struct {
+  unsigned int chunksize;
+  int chunks;
+  int policy;
+  unsigned int readahead;  /* bytes read ahead on sequential reads */
+  unsigned long long budget;  /* max bytes in all caches (0: no limit) */
+  int adaptive;
+  int files;               /* max simultaneous caches */
+}SimConf;
+
+/* results for a configuration */
+typedef struct {
+  unsigned long long reads, hits, partial, misses;
+  unsigned long long requests, prefetch;  /* origin requests */
+  unsigned long long obytes, abytes;      /* origin / application bytes */
+  unsigned long long evict;
+}SimRes;
+
+/* trace content */
+SimOp *ops = NULL;
+int nb_ops = 0;
+SimFile *files = NULL;
+int nb_files = 0;
+
+/* model state */
+unsigned long long sim_clock = 0;
+unsigned long long sim_mem = 0;  /* bytes in all caches */
+
+
+/* index of file for given name (added if new) */
+static int sim_file(const char *name) {
+  int i;
+
+  for(i=nb_files-1; i>=0; i--)
+    if (strcmp(files[i].name, name) == 0)
+      return(i);
+  if ((nb_files % 256) == 0)
+    files = realloc(files, sizeof(SimFile)*(nb_files+256));
+  if (files == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(2);
+  }
+  memset(&(files[nb_files]), 0, sizeof(SimFile));
+  files[nb_files].name = strdup(name);
+  return(nb_files++);
+}
+
+/* load the operations of a trace */
+static int sim_load(const char *file) {
+  char path[MAX_NAME];
+  RecEntry rec;
+  SimOp *op;
+  FILE *f;
+  int n;
+
+  f = record_open(file);
+  if (f == NULL)
+    return(0);
+  while(record_read(f, &rec, path)) {
+    if ((rec.op != REC_OPEN)&&(rec.op != REC_READ)&&(rec.op != REC_RELEASE))
+      continue;
+    if ((rec.op == REC_READ)&&(rec.result <= 0))
+      continue;
+    if ((nb_ops % 4096) == 0)
+      ops = realloc(ops, sizeof(SimOp)*(nb_ops+4096));
+    if (ops == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(2);
+    }
+    n = sim_file(path);
+    op = &(ops[nb_ops++]);
+    op->op = rec.op;
+    op->file = n;
+    op->offset = rec.offset;
+    op->size = (rec.op == REC_READ)?(unsigned int)rec.result:0;
+    /* size of file: at least what was read */
+    if ((rec.op == REC_READ)&&(rec.offset+op->size > files[n].size))
+      files[n].size = rec.offset+op->size;
+  }
+  fclose(f);
+  return(1);
+}
+
+/* drop a chunk of a file */
+static void sim_drop(SimFile *sf, int c) {
+  sim_mem -= sf->chunks[c].end - sf->chunks[c].start;
+  sf->chunks[c] = sf->chunks[--sf->nb];
+}
+
+/* drop the cache of a file */
+static void sim_close(SimFile *sf) {
+  while(sf->nb > 0)
+    sim_drop(sf, 0);
+  sim_mem -= sf->first;
+  sf->first = 0;
+  sf->open = 0;
+}
+
+/* chunk of a file to evict, with given policy */
+static int sim_victim(SimFile *sf, int policy) {
+  int i, v=0;
+
+  for(i=1; i<sf->nb; i++) {
+    if (((policy == POL_OFFSET)&&(sf->chunks[i].start < sf->chunks[v].start))||
+        ((policy == POL_LRU)&&(sf->chunks[i].used < sf->chunks[v].used))||
+        ((policy == POL_FIFO)&&(sf->chunks[i].loaded < sf->chunks[v].loaded)))
+      v = i;
+  }
+  return(v);
+}
+
+/* evict chunks (least recently used over all files) until 'need'
+   more bytes fit in budget */
+static void sim_budget(SimConf *conf, unsigned int need, SimRes *res) {
+  int i, c, vf, vc;
+
+  while((conf->budget > 0)&&(sim_mem+need > conf->budget)) {
+    vf = vc = -1;
+    for(i=0; i<nb_files; i++) {
+      if (files[i].nb == 0)
+        continue;
+      c = sim_victim(&(files[i]), POL_LRU);
+      if ((vf < 0)||(files[i].chunks[c].used < files[vf].chunks[vc].used)) {
+        vf = i;
+        vc = c;
+      }
+    }
+    if (vf < 0)
+      return;
+    sim_drop(&(files[vf]), vc);
+    res->evict++;
+  }
+}
+
+/* open the cache of a file (dropping the oldest one if too many),
+   which loads its firstblock */
+static void sim_open(SimConf *conf, SimFile *sf, SimRes *res) {
+  int i, nb=0, old=-1;
+
+  if (sf->open)
+    return;
+  for(i=0; i<nb_files; i++) {
+    if (!files[i].open)
+      continue;
+    nb++;
+    if ((old < 0)||(files[i].used < files[old].used))
+      old = i;
+  }
+  if ((nb >= conf->files)&&(old >= 0))
+    sim_close(&(files[old]));
+  sf->open = 1;
+  sf->used = sim_clock;
+  sf->chunksize = conf->chunksize;
+  sf->next_off = 0;
+  sf->score = 0;
+  sf->first = MIN(conf->chunksize, sf->size);
+  if (sf->first > 0) {
+    sim_budget(conf, sf->first, res);
+    sim_mem += sf->first;
+    res->requests++;
+    res->obytes += sf->first;
+  }
+}
+
+/* access pattern and chunk size (as cache_pattern/cache_adapt) */
+static void sim_pattern(SimFile *sf, unsigned int offset) {
+  if (offset == sf->next_off) {
+    if (sf->score < 2*CACHE_ADAPT_SCORE)
+      sf->score++;
+  } else {
+    if (sf->score > -2*CACHE_ADAPT_SCORE)
+      sf->score--;
+  }
+}
+
+static void sim_adapt(SimFile *sf) {
+  if (sf->score >= CACHE_ADAPT_SCORE) {
+    sf->chunksize = MIN(sf->chunksize*2, CACHE_CHUNK_MAX);
+  } else if (sf->score <= -CACHE_ADAPT_SCORE) {
+    sf->chunksize /= 2;
+    if (sf->chunksize < CACHE_CHUNK_MIN)
+      sf->chunksize = CACHE_CHUNK_MIN;
+  }
+}
+
+/* load a chunk at given offset. returns its index */
+static int sim_fetch(SimConf *conf, SimFile *sf, unsigned int offset,
+                     SimRes *res) {
+  unsigned int size;
+  int c;
+
+  if (conf->adaptive)
+    sim_adapt(sf);
+  size = MIN(sf->chunksize, sf->size-offset);
+  if (sf->nb >= conf->chunks) {
+    sim_drop(sf, sim_victim(sf, conf->policy));
+    res->evict++;
+  }
+  sim_budget(conf, size, res);
+  c = sf->nb++;
+  sf->chunks[c].start = offset;
+  sf->chunks[c].end = offset+size;
+  sf->chunks[c].used = sf->chunks[c].loaded = sim_clock;
+  sim_mem += size;
+  res->requests++;
+  res->obytes += size;
+  return(c);
+}
+
+/* chunk containing offset, or -1 */
+static int sim_search(SimFile *sf, unsigned int offset) {
+  int i;
+
+  for(i=0; i<sf->nb; i++)
+    if ((offset >= sf->chunks[i].start)&&(offset < sf->chunks[i].end))
+      return(i);
+  return(-1);
+}
+
+/* a read from the application */
+static void sim_read(SimConf *conf, SimFile *sf, unsigned int offset,
+                     unsigned int size, SimRes *res) {
+  unsigned int cur=offset, end=offset+size, ra;
+  int c, missed=0, found=0;
+
+  sim_open(conf, sf, res);
+  sf->used = sim_clock;
+  res->reads++;
+  res->abytes += size;
+  if (conf->adaptive)
+    sim_pattern(sf, offset);
+  while(cur < end) {
+    if (cur < sf->first) {
+      found = 1;
+      cur = sf->first;
+      continue;
+    }
+    c = sim_search(sf, cur);
+    if (c < 0) {
+      c = sim_fetch(conf, sf, cur, res);
+      missed = 1;
+    } else {
+      found = 1;
+    }
+    sf->chunks[c].used = sim_clock;
+    cur = sf->chunks[c].end;
+  }
+  if (!missed)
+    res->hits++;
+  else if (found)
+    res->partial++;
+  else
+    res->misses++;
+
+  /* sequential read: load what follows, up to the readahead window */
+  if ((conf->readahead > 0)&&(offset == sf->next_off)) {
+    ra = MIN(end+conf->readahead, sf->size);
+    cur = end;
+    if (cur < sf->first)
+      cur = sf->first;
+    while(cur < ra) {
+      c = sim_search(sf, cur);
+      if (c < 0) {
+        /* never evict what this read uses */
+        if ((sf->nb >= conf->chunks)&&
+            (sf->chunks[sim_victim(sf, conf->policy)].used == sim_clock))
+          break;
+        c = sim_fetch(conf, sf, cur, res);
+        res->prefetch++;
+      }
+      sf->chunks[c].used = sim_clock;
+      cur = sf->chunks[c].end;
+    }
+  }
+  sf->next_off = end;
+}
+
+/* run the whole trace with a configuration */
+static void sim_run(SimConf *conf, SimRes *res) {
+  int i;
+
+  memset(res, 0, sizeof(SimRes));
+  for(i=0; i<nb_files; i++) {
+    files[i].nb = 0;
+    files[i].first = 0;
+    files[i].open = 0;
+  }
+  sim_mem = 0;
+  sim_clock = 0;
+  for(i=0; i<nb_ops; i++) {
+    sim_clock++;
+    switch(ops[i].op) {
+      case REC_OPEN:
+        sim_open(conf, &(files[ops[i].file]), res);
+        break;
+      case REC_READ:
+        if (files[ops[i].file].size > 0)
+          sim_read(conf, &(files[ops[i].file]), ops[i].offset, ops[i].size, res);
+        break;
+      case REC_RELEASE:
+        /* webfs drops the cache of a file when it is closed */
+        sim_close(&(files[ops[i].file]));
+        break;
+    }
+  }
+}
+
+/* parse a list of values ("a,b,c", with k/M suffixes). returns count */
+static int parse_list(char *str, unsigned long long *vals) {
+  char *tok, *end;
+  int nb=0;
+
+  for(tok=strtok(str, ","); (tok != NULL)&&(nb < SIM_MAX_GRID);
+      tok=strtok(NULL, ",")) {
+    vals[nb] = strtoull(tok, &end, 10);
+    if ((*end == 'k')||(*end == 'K'))
+      vals[nb] *= 1024;
+    else if ((*end == 'm')||(*end == 'M'))
+      vals[nb] *= 1024*1024;
+    nb++;
+  }
+  return(nb);
+}
+
+/* parse a list of policies. returns count */
+static int parse_policies(char *str, unsigned long long *vals) {
+  char *tok;
+  int nb=0, i;
+
+  for(tok=strtok(str, ","); (tok != NULL)&&(nb < SIM_MAX_GRID);
+      tok=strtok(NULL, ",")) {
+    for(i=0; pol_names[i] != NULL; i++)
+      if (strcmp(tok, pol_names[i]) == 0)
+        break;
+    if (pol_names[i] == NULL) {
+      fprintf(stderr, "Unknown policy '%s'.\n", tok);
+      exit(1);
+    }
+    vals[nb++] = i;
+  }
+  return(nb);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [options] <trace file>\n"
+    "   lists of values (comma separated, k/M suffixes) give the grid:\n"
+    "   -s <sizes>     chunk sizes (default %d)\n"
+    "   -c <counts>    chunks per file (default 1, max %d)\n"
+    "   -e <policies>  eviction: offset (webfs), lru, fifo (default offset)\n"
+    "   -r <sizes>     readahead windows on sequential reads (default 0)\n"
+    "   -g <sizes>     global budget for all caches (default 0: none)\n"
+    "   -a <0|1,...>   adaptive chunk size (default 0)\n"
+    "   -f <N>         max simultaneous caches (default %d)\n",
+    prog, CACHE_BLOCK*8, SIM_MAX_CHUNK, CACHE_MAX);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long long sizes[SIM_MAX_GRID], counts[SIM_MAX_GRID];
+  unsigned long long pols[SIM_MAX_GRID], ras[SIM_MAX_GRID];
+  unsigned long long budgets[SIM_MAX_GRID], adapts[SIM_MAX_GRID];
+  int nsizes=1, ncounts=1, npols=1, nras=1, nbudgets=1, nadapts=1;
+  int is, ic, ip, ir, ib, ia, opt, maxfiles=CACHE_MAX;
+  SimConf conf;
+  SimRes res;
+
+  sizes[0] = CACHE_BLOCK*8;
+  counts[0] = 1;
+  pols[0] = POL_OFFSET;
+  ras[0] = budgets[0] = adapts[0] = 0;
+  while((opt = getopt(argc, argv, "s:c:e:r:g:a:f:")) != -1) {
+    switch(opt) {
+      case 's': nsizes = parse_list(optarg, sizes); break;
+      case 'c': ncounts = parse_list(optarg, counts); break;
+      case 'e': npols = parse_policies(optarg, pols); break;
+      case 'r': nras = parse_list(optarg, ras); break;
+      case 'g': nbudgets = parse_list(optarg, budgets); break;
+      case 'a': nadapts = parse_list(optarg, adapts); break;
+      case 'f': maxfiles = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if ((optind >= argc)||(maxfiles <= 0))
+    usage(argv[0]);
+  for(ic=0; ic<ncounts; ic++)
+    if ((counts[ic] == 0)||(counts[ic] > SIM_MAX_CHUNK))
+      usage(argv[0]);
+  for(is=0; is<nsizes; is++)
+    if (sizes[is] < 512)
+      usage(argv[0]);
+  if (!sim_load(argv[optind])) {
+    fprintf(stderr, "Can't read trace '%s'.\n", argv[optind]);
+    exit(1);
+  }
+  fprintf(stderr, "%d operations on %d files.\n", nb_ops, nb_files);
+
+  printf("# chunksize chunks policy readahead budget adaptive"
+         " reads hit%% partial%% miss%% requests prefetch origin_bytes"
+         " app_bytes amplification evictions\n");
+  conf.files = maxfiles;
+  for(is=0; is<nsizes; is++)
+   for(ic=0; ic<ncounts; ic++)
+    for(ip=0; ip<npols; ip++)
+     for(ir=0; ir<nras; ir++)
+      for(ib=0; ib<nbudgets; ib++)
+       for(ia=0; ia<nadapts; ia++) {
+    conf.chunksize = sizes[is];
+    conf.chunks = counts[ic];
+    conf.policy = pols[ip];
+    conf.readahead = ras[ir];
+    conf.budget = budgets[ib];
+    conf.adaptive = (adapts[ia] != 0);
+    sim_run(&conf, &res);
+    printf("%u %d %s %u %llu %d %llu %.2f %.2f %.2f %llu %llu %llu %llu %.3f %llu\n",
+           conf.chunksize, conf.chunks, pol_names[conf.policy],
+           conf.readahead, conf.budget, conf.adaptive, res.reads,
+           res.reads?100.0*res.hits/res.reads:0.0,
+           res.reads?100.0*res.partial/res.reads:0.0,
+           res.reads?100.0*res.misses/res.reads:0.0,
+           res.requests, res.prefetch, res.obytes, res.abytes,
+           res.abytes?(double)res.obytes/res.abytes:0.0, res.evict);
+  }
+  return(0);
+}
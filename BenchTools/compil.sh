@@ -0,0 +1,26 @@
+#!/bin/sh
+
+# builds benchmark tools. to be run from this directory
+
+SOURCE="../tree.c ../tools.c ../cache.c ../webget.c ../profile.c ../stats.c ../record.c ../fileget.c ../mirror.c ../sched.c ../pool.c ../ztier.c"
+FLAGS="-g -D_FILE_OFFSET_BITS=64 -O2 -Wall -I.."
+
+compil() {
+  case "$1" in
+    benchio) CMD="gcc $FLAGS -o $1 $1.c -lpthread" ;;  # not using webfs code
+    *) CMD="gcc $FLAGS -o $1 $1.c $SOURCE -lcurl -lpthread -lz" ;;
+  esac
+  echo "Exec: $CMD"
+  $CMD
+}
+
+if [ "$1" = "" ]
+then
+  compil replay || exit 1
+  compil cachesim || exit 1
+  compil benchio || exit 1
+  compil treebench || exit 1
+  exit 0
+fi
+
+compil $1
@@ -0,0 +1,338 @@
+#!/usr/bin/env python3
+
+# minimal HTTP server for benchmarks: serves a directory with what webfs
+#  needs (HEAD, GET with a single byte range, ETag/Last-Modified and
+#  conditional requests). Requests and bytes sent are printed on exit.
+# it can emulate network conditions (see -P and PROFILES): round trip
+#  time with jitter, per connection throughput with TCP-like slow start
+#  (restarted after idle), a link shared by all connections, stalls in
+#  the middle of responses, 5xx errors and connection resets.
+# with -c it serves HTTPS. Opening a connection costs one rtt (TCP),
+#  plus two for a full TLS handshake or one for a resumed session (as
+#  TLS 1.2 does).
+
+# usage: httpstub.py [-p port] [-b address] [-c cert.pem] [-P profile]
+#                    [-o name=value]... <directory>
+
+import email.utils
+import getopt
+import os
+import random
+import signal
+import socket
+import ssl
+import sys
+import threading
+import time
+import urllib.parse
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+ROOT = "."
+BLOCK = 65536
+TLS = None  # SSL context for HTTPS
+
+# network conditions. rtt/jitter/stall in ms, rate/link in bytes/s
+# (0: no limit), *_prob are probabilities per response
+NET = {
+    "rtt": 0,          # delay before each response
+    "jitter": 0,       # random extra delay (0-jitter)
+    "rate": 0,         # max throughput of a connection
+    "link": 0,         # max throughput of all connections
+    "slowstart": 0,    # initial window (bytes per rtt, doubled each rtt)
+    "stall_prob": 0,   # pause in the middle of a response
+    "stall": 0,        # duration of the pause
+    "error_prob": 0,   # reply 503
+    "reset_prob": 0,   # close connection in the middle of a response
+}
+
+# named sets of network conditions
+PROFILES = {
+    "lan": {},
+    "wan": {"rtt": 30, "jitter": 5, "rate": 12500000, "slowstart": 14600},
+    "xregion": {"rtt": 150, "jitter": 20, "rate": 6250000, "link": 12500000,
+                "slowstart": 14600, "stall_prob": 0.005, "stall": 1000,
+                "error_prob": 0.005},
+    "mobile": {"rtt": 80, "jitter": 60, "rate": 1250000, "link": 2500000,
+               "slowstart": 14600, "stall_prob": 0.02, "stall": 2000,
+               "error_prob": 0.01, "reset_prob": 0.005},
+    "flaky": {"rtt": 40, "jitter": 10, "rate": 12500000, "stall_prob": 0.05,
+              "stall": 3000, "error_prob": 0.05, "reset_prob": 0.02},
+}
+
+# counters (requests, bytes sent)
+lock = threading.Lock()
+counters = {"requests": 0, "bytes": 0, "ranges": 0, "notmodified": 0,
+            "errors": 0, "stalls": 0, "resets": 0, "connections": 0,
+            "resumed": 0}
+
+# date at which the shared link is free
+link_free = 0.0
+
+
+def count(name, val=1):
+    with lock:
+        counters[name] += val
+
+
+# wait until 'size' bytes went through the shared link
+def link_wait(size):
+    global link_free
+    if NET["link"] <= 0:
+        return
+    with lock:
+        now = time.monotonic()
+        link_free = max(link_free, now) + size / NET["link"]
+        wait = link_free - now
+    time.sleep(wait)
+
+
+class Reset(Exception):
+    pass
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, *args):
+        pass
+
+    # per connection state: congestion window (bytes per rtt) and time of
+    # last data sent (slow start again after 1 s idle)
+    def setup(self):
+        count("connections")
+        # headers and body are separate writes: no Nagle delay between
+        # them (as real servers)
+        self.request.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        rtts = 1
+        if TLS is not None:
+            self.request = TLS.wrap_socket(self.request, server_side=True)
+            if self.request.session_reused:
+                count("resumed")
+                rtts += 1
+            else:
+                rtts += 2
+        if NET["rtt"] > 0:
+            time.sleep(rtts * NET["rtt"] / 1000.0)
+        BaseHTTPRequestHandler.setup(self)
+        self.cwnd = NET["slowstart"]
+        self.last = 0.0
+
+    # delay and failures applied before each response. False if the
+    # request was answered with an error
+    def network(self):
+        delay = NET["rtt"] + random.uniform(0, NET["jitter"])
+        if delay > 0:
+            time.sleep(delay / 1000.0)
+        if random.random() < NET["error_prob"]:
+            count("errors")
+            self.error(503)
+            return False
+        if time.monotonic() - self.last > 1.0:
+            self.cwnd = NET["slowstart"]
+        # stall/reset of this response, at a random point
+        self.stall_at = self.reset_at = -1
+        if random.random() < NET["stall_prob"]:
+            self.stall_at = random.random()
+        if random.random() < NET["reset_prob"]:
+            self.reset_at = random.random()
+        return True
+
+    # local file for the request path, or None
+    def local_path(self):
+        path = urllib.parse.unquote(urllib.parse.urlsplit(self.path).path)
+        full = os.path.realpath(os.path.join(ROOT, path.lstrip("/")))
+        if not (full == ROOT or full.startswith(ROOT + os.sep)):
+            return None
+        if not os.path.isfile(full):
+            return None
+        return full
+
+    def error(self, code):
+        self.send_response(code)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    # requested range [start, end] for a file of given size. None: whole
+    # file, False: not satisfiable
+    def range(self, size):
+        hdr = self.headers.get("Range")
+        if hdr is None or not hdr.startswith("bytes=") or "," in hdr:
+            return None
+        first, _, last = hdr[6:].partition("-")
+        try:
+            if first == "":
+                start, end = max(size - int(last), 0), size - 1
+            else:
+                start = int(first)
+                end = min(int(last), size - 1) if last else size - 1
+        except ValueError:
+            return None
+        if start >= size or start > end:
+            return False
+        return (start, end)
+
+    # send headers (and returns what to send) for a file
+    def head(self):
+        path = self.local_path()
+        if path is None:
+            self.error(404)
+            return None
+        st = os.stat(path)
+        etag = '"%x-%x"' % (int(st.st_mtime), st.st_size)
+        modified = email.utils.formatdate(st.st_mtime, usegmt=True)
+        # conditional request
+        inm = self.headers.get("If-None-Match")
+        ims = self.headers.get("If-Modified-Since")
+        if (inm is not None and inm == etag) or (inm is None and ims is not None and
+            email.utils.parsedate_to_datetime(ims).timestamp() >= int(st.st_mtime)):
+            count("notmodified")
+            self.send_response(304)
+            self.send_header("ETag", etag)
+            self.end_headers()
+            return None
+        rng = self.range(st.st_size)
+        if rng is False:
+            self.send_response(416)
+            self.send_header("Content-Range", "bytes */%d" % st.st_size)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return None
+        if rng is None:
+            start, end = 0, st.st_size - 1
+            self.send_response(200)
+        else:
+            start, end = rng
+            count("ranges")
+            self.send_response(206)
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, st.st_size))
+        self.send_header("Content-Length", str(end - start + 1))
+        self.send_header("Accept-Ranges", "bytes")
+        self.send_header("ETag", etag)
+        self.send_header("Last-Modified", modified)
+        self.end_headers()
+        return (path, start, end - start + 1)
+
+    def do_HEAD(self):
+        count("requests")
+        if self.network():
+            self.head()
+
+    def do_GET(self):
+        count("requests")
+        if not self.network():
+            return
+        what = self.head()
+        if what is None:
+            return
+        path, offset, left = what
+        total = left
+        try:
+            with open(path, "rb") as f:
+                f.seek(offset)
+                while left > 0:
+                    data = f.read(min(self.block(), left))
+                    if not data:
+                        break
+                    self.events(1 - left / total, 1 - (left - len(data)) / total)
+                    self.send(data)
+                    left -= len(data)
+        except Reset:
+            count("resets")
+            self.connection.shutdown(socket.SHUT_RDWR)
+            self.close_connection = True
+            return
+        if left > 0:
+            # file changed: client must not keep the connection
+            self.close_connection = True
+
+    # size of next block: smaller blocks when throughput is limited
+    def block(self):
+        if NET["rate"] > 0 or NET["link"] > 0 or self.cwnd > 0:
+            return 16384
+        return BLOCK
+
+    # stall or reset when the response reaches their point
+    def events(self, start, end):
+        if start <= self.stall_at < end:
+            count("stalls")
+            time.sleep(NET["stall"] / 1000.0)
+        if start <= self.reset_at < end:
+            raise Reset()
+
+    # send data to client at the throughput of the connection
+    def send(self, data):
+        rate = NET["rate"]
+        rtt = max(NET["rtt"], 1) / 1000.0
+        if self.cwnd > 0:
+            # slow start: one window per rtt, window doubled each rtt
+            win = self.cwnd / rtt
+            rate = min(rate, win) if rate > 0 else win
+            self.cwnd += len(data)
+        start = time.monotonic()
+        self.wfile.write(data)
+        link_wait(len(data))
+        if rate > 0:
+            wait = len(data) / rate - (time.monotonic() - start)
+            if wait > 0:
+                time.sleep(wait)
+        self.last = time.monotonic()
+        count("bytes", len(data))
+
+
+def usage():
+    print("Usage: %s [-p port] [-b address] [-c cert.pem] [-P profile] [-o name=value]..."
+          " <directory>" % sys.argv[0], file=sys.stderr)
+    print("  cert.pem: certificate and key, to serve HTTPS", file=sys.stderr)
+    print("  profiles: " + " ".join(sorted(PROFILES)), file=sys.stderr)
+    print("  values (-o, override profile): " + " ".join(NET), file=sys.stderr)
+    sys.exit(1)
+
+
+def main():
+    global ROOT, TLS
+    port, addr = 8080, "127.0.0.1"
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], "p:b:c:P:o:h")
+    except getopt.GetoptError:
+        usage()
+    values = {}
+    for o, v in opts:
+        if o == "-p":
+            port = int(v)
+        elif o == "-b":
+            addr = v
+        elif o == "-c":
+            TLS = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+            TLS.load_cert_chain(v)
+        elif o == "-P":
+            if v not in PROFILES:
+                usage()
+            NET.update(PROFILES[v])
+        elif o == "-o":
+            name, _, val = v.partition("=")
+            if name not in NET:
+                usage()
+            values[name] = float(val)
+        else:
+            usage()
+    NET.update(values)
+    if len(args) != 1 or not os.path.isdir(args[0]):
+        usage()
+    ROOT = os.path.realpath(args[0])
+
+    server = ThreadingHTTPServer((addr, port), Handler)
+    server.daemon_threads = True
+    signal.signal(signal.SIGTERM, lambda s, f: sys.exit(0))
+    try:
+        server.serve_forever()
+    except (KeyboardInterrupt, SystemExit):
+        pass
+    print("httpstub: %(requests)d requests (%(ranges)d ranges, %(notmodified)d not modified),"
+          " %(bytes)d bytes sent, %(errors)d errors, %(stalls)d stalls, %(resets)d resets,"
+          " %(connections)d connections (%(resumed)d TLS resumed)"
+          % counters, file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,323 @@
+/* replay an access trace recorded by webfs (--trace) directly on the
+   webfs internals (tree, cache, backend), without FUSE.
+   reports throughput, latency and data fetched from the backend */
+
+#include <time.h>
+#include <errno.h>
+#include "tree.h"
+#include "cache.h"
+#include "webget.h"
+#include "stats.h"
+#include "record.h"
+#include "tools.h"
+#include "mirror.h"
+#include "sched.h"
+#include "pool.h"
+#include "ztier.h"
+
+
+/* needed by webfs internals */
+char *url_path = NULL;
+int opt_exec_files = 0;
+
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [options] <trace file>\n"
+    "   -u <URL>      base URL of files (file:///dir for local files)\n"
+    "   -M <URL,...>  mirrors of base URL\n"
+    "   -m <file>     metadata: path on server (starting with /, default\n"
+    "                 /description.data) or local file\n"
+    "   -c <N>        number of chunks per cache\n"
+    "   -s <size>     initial chunk size\n"
+    "   -L <us>       add a delay to each request (simulated network)\n"
+    "   -B <B/s>      limit bandwidth of requests (simulated network)\n"
+    "   -R <N>        retries of a failed request (default 2)\n"
+    "   -T <ms>       max duration of a request\n"
+    "   -D <ms>       max duration of a read, retries included\n"
+    "   -H            duplicate slow requests (hedging)\n"
+"   -A            readahead of sequential reads (all chunks but one)\n"
+"   -Q <B/s>      limit bandwidth of all transfers (scheduler)\n"
+"   -q <N>        limit requests per second (scheduler)\n"
+"   -w <N>        threads for readahead and prefetch (default 2)\n"
+"   -K <s>        keep idle connections open (default 60, 0: no reuse)\n"
+"   -W            resolve servers and open TLS sessions before replay\n"
+"   -1            don't use HTTP/2 on HTTPS\n"
+"   -k            don't check server certificates\n"
+"   -N <s>        opens of a failed file fail at once for that long\n"
+"                 (default 10, 0: never)\n"
+"   -g <MB>       max memory of all caches (default 0: no limit)\n"
+"   -P            use huge pages for caches\n"
+"   -z <MB>       keep dropped chunks compressed in memory (default 0: no)\n"
+    "   -t            keep trace timing (else replay as fast as possible)\n"
+    "   -p            print stats in Prometheus format\n", prog);
+  exit(1);
+}
+
+/* give a line of downloaded metadata to the tree parser */
+static int meta_line(char *line, void *data) {
+  return(tree_parse_line((TreeParser*)data, line));
+}
+
+/* build tree from metadata (on server or local) */
+static int load_tree(const char *meta) {
+  TreeParser parser;
+  FILE *f;
+  int ret;
+
+  tree_init();
+  if (meta[0] == '/') {
+    tree_parse_init(&parser, 0, 0, NULL);
+    ret = wget_meta(wget_encode(url_path, meta), NULL, meta_line, &parser);
+    ret = tree_parse_end(&parser, ret != WGET_META_FAIL);
+    if (ret >= 0)
+      ret = tree_parse_commit(&parser, NULL);
+    tree_parse_free(&parser);
+    return(ret);
+  }
+  f = fopen(meta, "r");
+  if (f == NULL)
+    return(-1);
+  ret = tree_create(f);
+  fclose(f);
+  return(ret);
+}
+
+/* read as FUSE read callback does (loop until size or EOF) */
+static int replay_read(Node *node, const char *path, unsigned int offset,
+                       unsigned int size, char *buf) {
+  unsigned int total=0;
+  int res;
+
+  if (node->special)
+    return(0);  /* generated content: not a cache access */
+  while(total < size) {
+    res = cache_read(node->size, path, offset+total, size-total, buf+total);
+    if (res <= 0)
+      return((total > 0)?(int)total:res);
+    total += res;
+  }
+  return(total);
+}
+
+/* negative cache of opens (s) */
+static int negttl = 10;
+
+/* replay one operation. returns its result */
+static int replay_op(RecEntry *rec, const char *path, char **buf,
+                     unsigned int *bsize) {
+  unsigned long long start = stats_now();
+  Node *node;
+  int ret = 0, i, err;
+  unsigned int sum = 0;
+
+  node = tree_search(path);
+  switch(rec->op) {
+    case REC_GETATTR:
+    case REC_STATFS:
+      ret = (node == NULL)?-ENOENT:0;
+      if (rec->op == REC_GETATTR)
+        stats_since(ST_GETATTR, start);
+      break;
+    case REC_READLINK:
+      if (node == NULL)
+        ret = -ENOENT;
+      else if (node->symlink == NULL)
+        ret = -EINVAL;
+      break;
+    case REC_ACCESS:
+      if (node == NULL)
+        ret = -ENOENT;
+      else if (rec->size & W_OK)
+        ret = -EROFS;
+      break;
+    case REC_READDIR:
+      if (node == NULL) {
+        ret = -ENOENT;
+        break;
+      }
+      /* what readdir does: get stat data of each entry */
+      for(i=0; i<node->nb_entries; i++)
+        sum += node->entries[i]->size + node->entries[i]->inode;
+      if (sum == 0)
+        mylog("replay: readdir(%s): empty\n", path);
+      stats_since(ST_READDIR, start);
+      break;
+    case REC_OPEN:
+      if (node == NULL) {
+        ret = -ENOENT;
+        break;
+      }
+      /* name for the backend kept in node, as webfs does */
+      if ((node->file)&&(node->target == NULL))
+        node->target = cache_target(path, &(node->target_lng));
+      if ((node->file)&&(!node->special)&&(node->size > 0)) {
+        if ((err = tree_failed(node, (unsigned int)time(NULL))) != 0) {
+          stats_add(SC_NEGATIVE, 1);
+          ret = -err;
+        } else if (cache_create(path, node->target, node->target_lng,
+                                node->size) == NULL) {
+          err = errno;
+          if ((negttl > 0)&&((err == ENOENT)||(err == EIO)))
+            tree_set_failed(node, (unsigned int)time(NULL)+negttl, err);
+          ret = -err;
+        }
+      }
+      stats_since(ST_OPEN, start);
+      break;
+    case REC_READ:
+      if (node == NULL) {
+        ret = -ENOENT;
+        break;
+      }
+      if (rec->size > *bsize) {
+        free(*buf);
+        *bsize = rec->size;
+        *buf = malloc(*bsize);
+        if (*buf == NULL) {
+          fprintf(stderr, "Out of memory.\n");
+          exit(2);
+        }
+      }
+      ret = replay_read(node, path, rec->offset, rec->size, *buf);
+      if (ret > 0)
+        stats_add(SC_DATA, ret);
+      stats_since(ST_READ, start);
+      break;
+    case REC_RELEASE:
+      cache_destroy(path);
+      stats_since(ST_RELEASE, start);
+      break;
+  }
+  return(ret);
+}
+
+int main(int argc, char *argv[]) {
+  char *meta = "/description.data", *mirrors=NULL, path[MAX_NAME], *buf, *out;
+  int opt, timing=0, format=STATS_TEXT, nb, ahead=0, warmup=0;
+  unsigned long long start, now, nops=0, ndiff=0, elapsed;
+  unsigned long long count[REC_MAX];
+  unsigned int bsize;
+  struct timespec ts;
+  RecEntry rec;
+  FILE *f;
+
+  while((opt = getopt(argc, argv, "u:M:m:c:s:L:B:R:T:D:HAQ:q:w:K:W1kN:g:Pz:tp")) != -1) {
+    switch(opt) {
+      case 'u': url_path = optarg; break;
+      case 'M': mirrors = optarg; break;
+      case 'm': meta = optarg; break;
+      case 'c': cache_chunks = atoi(optarg); break;
+      case 's': cache_chunksize = atoi(optarg); break;
+      case 'L': cache_latency = atoi(optarg); break;
+      case 'B': cache_bandwidth = atoi(optarg); break;
+      case 'R': wget_retries = atoi(optarg); break;
+      case 'T': wget_timeout = atoi(optarg); break;
+      case 'D': wget_deadline = atoi(optarg); break;
+      case 'H': wget_hedge = 1; break;
+      case 'A': ahead = 1; break;
+      case 'Q': sched_rate = atoi(optarg); break;
+      case 'q': sched_reqrate = atoi(optarg); break;
+      case 'w': sched_workers = atoi(optarg); break;
+      case 'K': wget_keepalive = atoi(optarg); break;
+      case 'W': warmup = 1; break;
+      case '1': wget_http2 = 0; break;
+      case 'k': wget_insecure = 1; break;
+      case 'N': negttl = atoi(optarg); break;
+      case 'g': pool_budget = strtoull(optarg, NULL, 10)*1024*1024; break;
+      case 'P': pool_huge = 1; break;
+      case 'z': ztier_budget = strtoull(optarg, NULL, 10)*1024*1024; break;
+      case 't': timing = 1; break;
+      case 'p': format = STATS_PROM; break;
+      default: usage(argv[0]);
+    }
+  }
+  if ((optind >= argc)||(url_path == NULL))
+    usage(argv[0]);
+  if ((cache_chunks <= 0)||(cache_chunks > CACHE_MAX_CHUNK)||
+      (cache_chunksize < 512)) {
+    fprintf(stderr, "Invalid chunks/chunk size.\n");
+    exit(1);
+  }
+  if (ahead)
+    cache_readahead = cache_chunks-1;
+  cache_chunksize_min = MIN(cache_chunksize_min, cache_chunksize);
+  if (cache_chunksize_max < cache_chunksize)
+    cache_chunksize_max = cache_chunksize;
+  if ((pool_budget > 0)&&(pool_budget < 3ULL*cache_chunksize_max)) {
+    fprintf(stderr, "Memory budget too small.\n");
+    exit(1);
+  }
+  if (!mirror_init(url_path, mirrors)) {
+    fprintf(stderr, "Invalid mirrors.\n");
+    exit(1);
+  }
+
+  f = record_open(argv[optind]);
+  if (f == NULL) {
+    fprintf(stderr, "Can't read trace '%s'.\n", argv[optind]);
+    exit(1);
+  }
+  if (!wget_init()||!cache_init()||!sched_start()) {
+    fprintf(stderr, "Failed to initialize cache/CURL/workers.\n");
+    exit(3);
+  }
+  nb = load_tree(meta);
+  if (nb <= 0) {
+    fprintf(stderr, "Failed to load metadata '%s'.\n", meta);
+    exit(4);
+  }
+  fprintf(stderr, "%d entries in tree.\n", nb);
+  if (warmup)
+    fprintf(stderr, "%d servers reached.\n", wget_warmup(url_path));
+
+  bsize = 65536;
+  buf = malloc(bsize);
+  memset(count, 0, sizeof(count));
+  start = stats_now();
+  while(record_read(f, &rec, path)) {
+    /* wait for the time of this operation in trace */
+    if (timing) {
+      now = stats_now() - start;
+      if (rec.stamp > now) {
+        ts.tv_sec = (rec.stamp-now)/1000000;
+        ts.tv_nsec = ((rec.stamp-now)%1000000)*1000;
+        nanosleep(&ts, NULL);
+      }
+    }
+    if (replay_op(&rec, path, &buf, &bsize) != rec.result)
+      ndiff++;
+    count[rec.op]++;
+    nops++;
+  }
+  elapsed = stats_now() - start;
+  fclose(f);
+  sched_fini();
+  cache_fini();
+
+  /* results */
+  if (elapsed == 0)
+    elapsed = 1;
+  printf("Replayed %llu operations in %.3f s: %.1f ops/s, %.2f MB/s read\n",
+         nops, elapsed/1000000.0, nops*1000000.0/elapsed,
+         stats_counter(SC_DATA)/(elapsed/1000000.0)/(1024*1024));
+  printf("Operations:");
+  for(opt=0; opt<REC_MAX; opt++)
+    printf(" %s=%llu", record_names[opt], count[opt]);
+  printf("\nResults different from trace: %llu\n", ndiff);
+  printf("Origin: %llu bytes fetched\n", stats_counter(SC_FETCH_DATA));
+  out = malloc(STATS_SIZE);
+  if (out != NULL) {
+    stats_print(out, STATS_SIZE, format);
+    printf("%s", out);
+    if ((format == STATS_TEXT)&&(mirror_count() > 1)) {
+      mirror_print(out, STATS_SIZE);
+      printf("%s", out);
+    }
+    free(out);
+  }
+  free(buf);
+  tree_free();
+  wget_fini();
+  mirror_fini();
+  return(0);
+}
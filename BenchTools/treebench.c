@@ -0,0 +1,294 @@
+/* tree microbenchmark: generates synthetic metadata (given number of
+   entries, depth, fan-out and name length), then measures tree_create,
+   memory, tree_search (hits and misses), tree_search_inode, readdir
+   iteration and tree_free. One line of results per number of entries
+   (space separated, first line '#' gives the columns), to compare
+   changes of tree.c */
+
+#include "tree.h"
+#include "tools.h"
+#include "stats.h"
+
+
+/* needed by webfs internals */
+char *url_path = NULL;
+int opt_exec_files = 0;
+
+
+/* settings */
+int opt_depth = 3;       /* levels of directories */
+int opt_fanout = 16;     /* sub-directories per directory */
+int opt_namelen = 12;    /* length of names */
+unsigned int opt_lookups = 1000000;  /* max lookups per measure */
+#define MEASURE_MAX 1000000  /* and max duration of a measure (us) */
+
+/* leaf directories (files are spread over them, "" for /) */
+char **leaves = NULL;
+int nb_leaves = 0;
+unsigned int nb_files = 0;
+
+
+/* name of entry #n with given prefix, padded to opt_namelen */
+static void make_name(char *dest, char prefix, unsigned int n) {
+  int l;
+
+  l = sprintf(dest, "%c%u", prefix, n);
+  while(l < opt_namelen)
+    dest[l++] = 'x';
+  dest[l] = '\0';
+}
+
+/* full path (without initial /) of file #n */
+static void file_path(char *dest, unsigned int n) {
+  char *leaf = leaves[n % nb_leaves];
+  int l;
+
+  l = sprintf(dest, "%s%s", leaf, (leaf[0] != '\0')?"/":"");
+  make_name(dest+l, 'f', n);
+}
+
+/* memory of the process (kB): current and peak */
+static void memory(unsigned long *rss, unsigned long *hwm) {
+  char line[256];
+  FILE *f;
+
+  *rss = *hwm = 0;
+  f = fopen("/proc/self/status", "r");
+  if (f == NULL)
+    return;
+  while(fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, "VmRSS:", 6) == 0)
+      *rss = strtoul(line+6, NULL, 10);
+    else if (strncmp(line, "VmHWM:", 6) == 0)
+      *hwm = strtoul(line+6, NULL, 10);
+  }
+  fclose(f);
+}
+
+/* write metadata for 'nb' entries (with /) in a temporary file:
+   directories level by level (at most a tenth of entries), then files
+   spread over the last level */
+static FILE *generate(unsigned int nb) {
+  char path[MAX_NAME], name[256];
+  char **level=NULL, **next;
+  unsigned int inode=1, nb_dirs=0, i, f;
+  int nlevel=0, nnext, d, k;
+  FILE *out;
+
+  out = tmpfile();
+  if (out == NULL)
+    return(NULL);
+  fprintf(out, "%u\n%u\n", (unsigned int)time(NULL), nb);
+  fprintf(out, "0 4096 %u 0 2 755\n.\n", inode++);
+  nb--;
+
+  /* directories */
+  for(d=0; d<opt_depth; d++) {
+    nnext = 0;
+    next = NULL;
+    for(i=0; (i < (unsigned int)(nlevel?nlevel:1)); i++) {
+      for(k=0; k<opt_fanout; k++) {
+        if ((nb_dirs+1)*10 > nb+1)
+          break;
+        make_name(name, 'd', nb_dirs);
+        if (nlevel)
+          sprintf(path, "%s/%s", level[i], name);
+        else
+          strcpy(path, name);
+        fprintf(out, "0 4096 %u 0 2 755\n%s\n", inode++, path);
+        next = realloc(next, sizeof(char*)*(nnext+1));
+        next[nnext++] = strdup(path);
+        nb_dirs++;
+      }
+    }
+    if (nnext == 0)
+      break;
+    /* only the last level is kept */
+    for(i=0; i<(unsigned int)nlevel; i++)
+      free(level[i]);
+    free(level);
+    level = next;
+    nlevel = nnext;
+  }
+  leaves = level;
+  nb_leaves = nlevel;
+  if (nb_leaves == 0) {
+    /* no room for dirs: files at root */
+    leaves = malloc(sizeof(char*));
+    leaves[0] = strdup("");
+    nb_leaves = 1;
+  }
+
+  /* files */
+  nb_files = nb-nb_dirs;
+  for(f=0; f<nb_files; f++) {
+    file_path(path, f);
+    fprintf(out, "1 %u %u 0 1 644\n%s\n", f, inode++, path);
+  }
+  rewind(out);
+  return(out);
+}
+
+/* count entries of all directories (as readdir) */
+static unsigned long long walk(Node *node) {
+  unsigned long long nb=0;
+  int i;
+
+  nb = node->nb_entries;
+  for(i=0; i<node->nb_entries; i++) {
+    if (!node->entries[i]->file)
+      nb += walk(node->entries[i]);
+  }
+  return(nb);
+}
+
+/* true while a measure started at 'start' can go on ('i' done) */
+static int measure(unsigned int i, unsigned long long start) {
+  if (i >= opt_lookups)
+    return(0);
+  if ((i % 64) != 0)
+    return(1);
+  return(stats_now()-start < MEASURE_MAX);
+}
+
+/* rate (ops per second) */
+static double rate(unsigned long long nb, unsigned long long us) {
+  return(nb*1000000.0/(us?us:1));
+}
+
+/* run benchmark for 'nb' entries, and print results */
+static int bench(unsigned int nb) {
+  unsigned long long start, tcreate, thit, tmiss, tinode, twalk, tfree;
+  unsigned long rss0, rss, hwm, dummy;
+  unsigned int i, seed=1, hits=0, nhit, nmiss, ninode;
+  char path[MAX_NAME+1];
+  FILE *f;
+  int n;
+
+  f = generate(nb);
+  if (f == NULL) {
+    fprintf(stderr, "Can't create temporary file.\n");
+    return(0);
+  }
+  memory(&rss0, &dummy);
+
+  /* build */
+  tree_init();
+  start = stats_now();
+  n = tree_create(f);
+  tcreate = stats_now()-start;
+  fclose(f);
+  if (n <= 0) {
+    fprintf(stderr, "tree_create failed (%d).\n", n);
+    return(0);
+  }
+  memory(&rss, &hwm);
+
+  /* lookups of existing files */
+  path[0] = '/';
+  start = stats_now();
+  for(i=0; measure(i, start); i++) {
+    file_path(path+1, rand_r(&seed) % (nb_files?nb_files:1));
+    hits += (tree_search(path) != NULL);
+  }
+  thit = stats_now()-start;
+  nhit = i;
+  if (nb_files && (hits != nhit))
+    fprintf(stderr, "Warning: %u/%u lookups found.\n", hits, nhit);
+
+  /* lookups of missing files (in existing directories) */
+  start = stats_now();
+  for(i=0; measure(i, start); i++) {
+    sprintf(path, "/%s%smissing%u", leaves[i % nb_leaves],
+            (leaves[i % nb_leaves][0] != '\0')?"/":"", i);
+    hits += (tree_search(path) != NULL);
+  }
+  tmiss = stats_now()-start;
+  nmiss = i;
+
+  /* lookups by inode */
+  start = stats_now();
+  for(i=0; measure(i, start); i++)
+    tree_search_inode(1 + rand_r(&seed) % nb);
+  tinode = stats_now()-start;
+  ninode = i;
+
+  /* readdir of whole tree */
+  start = stats_now();
+  walk(tree_search("/"));
+  twalk = stats_now()-start;
+
+  /* free */
+  start = stats_now();
+  tree_free();
+  tfree = stats_now()-start;
+
+  printf("%u %d %d %d %.3f %.0f %lu %lu %.0f %.0f %.0f %.0f %.3f\n",
+         nb, opt_depth, opt_fanout, opt_namelen, tcreate/1000000.0,
+         rate(nb, tcreate), rss-rss0, hwm, rate(nhit, thit),
+         rate(nmiss, tmiss), rate(ninode, tinode),
+         rate(nb, twalk), tfree/1000000.0);
+  fflush(stdout);
+
+  for(i=0; i<(unsigned int)nb_leaves; i++)
+    free(leaves[i]);
+  free(leaves);
+  leaves = NULL;
+  nb_leaves = 0;
+  return(1);
+}
+
+/* number with k/M suffix */
+static unsigned int number(const char *str) {
+  char *end;
+  unsigned int n;
+
+  n = strtoul(str, &end, 10);
+  if ((*end == 'k')||(*end == 'K'))
+    n *= 1000;
+  else if ((*end == 'm')||(*end == 'M'))
+    n *= 1000000;
+  return(n);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [options] [entries...]\n"
+    "   entries: numbers of entries (k/M suffixes, default 10k 100k 1M)\n"
+    "   -d <N>   depth of directories (default %d)\n"
+    "   -f <N>   fan-out of directories (default %d)\n"
+    "   -l <N>   length of names (default %d)\n"
+    "   -q <N>   max lookups per measure (default %u, max 1 s)\n",
+    prog, opt_depth, opt_fanout, opt_namelen, opt_lookups);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned int sizes[] = { 10000, 100000, 1000000 };
+  int opt, i;
+
+  while((opt = getopt(argc, argv, "d:f:l:q:")) != -1) {
+    switch(opt) {
+      case 'd': opt_depth = atoi(optarg); break;
+      case 'f': opt_fanout = atoi(optarg); break;
+      case 'l': opt_namelen = atoi(optarg); break;
+      case 'q': opt_lookups = number(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if ((opt_depth < 0)||(opt_fanout <= 0)||(opt_namelen <= 0)||
+      (opt_namelen > 200)||(opt_lookups == 0)||
+      ((opt_depth+1)*(opt_namelen+12) >= MAX_NAME))
+    usage(argv[0]);
+
+  printf("# entries depth fanout namelen create_s create_eps rss_kb hwm_kb"
+         " hit_ops miss_ops inode_ops readdir_eps free_s\n");
+  if (optind >= argc) {
+    for(i=0; i<3; i++)
+      if (!bench(sizes[i]))
+        return(2);
+  }
+  for(i=optind; i<argc; i++)
+    if ((number(argv[i]) < 2)||!bench(number(argv[i])))
+      return(2);
+  return(0);
+}
@@ -0,0 +1,88 @@
+#!/bin/sh
+
+# this script builds a WebFS delta file (changes between two metadata
+#  files, see DescriptionFormat.txt) on standard output.
+# the old file is the one webfs clients may have, the new one is the
+#  current one.
+
+
+# usage: $1 old metadata file, $2 new metadata file
+
+if [ "$1" = "" -o "$2" = "" -o "$1" = "-h" -o "$1" = "--help" ]
+then
+  echo "Usage: $0 <old metadata file> <new metadata file>"
+  exit 1
+fi
+
+if [ ! -r "$1" -o ! -r "$2" ]
+then
+  echo "Can't read '$1' or '$2'. Abort." >&2
+  exit 2
+fi
+
+awk -v OLD="$1" -v NEW="$2" '
+# read a metadata file. entries (but /) are stored by name: entry
+# line in hdr[], symlink target in tgt[], and order in ord[].
+# the update timestamp is put in STAMP. returns the number of entries
+function load(file, hdr, tgt, ord,    n, h, nm, t, f) {
+  n = 0
+  if ((getline STAMP < file) <= 0)
+    return(-1)
+  getline h < file
+  while ((getline h < file) > 0) {
+    if ((getline nm < file) <= 0)
+      break
+    t = ""
+    split(h, f, " ")
+    if (f[1] == 2)
+      getline t < file
+    n++
+    # first entry is /. never in delta
+    if (n == 1)
+      continue
+    hdr[nm] = h
+    tgt[nm] = t
+    ord[n-1] = nm
+  }
+  close(file)
+  return(n-1)
+}
+
+# print an entry block with given operation
+function entry(op, h, nm, t) {
+  print op " " h
+  print nm
+  if (t != "")
+    print t
+}
+
+BEGIN {
+  nold = load(OLD, ohdr, otgt, oord)
+  ostamp = STAMP
+  nnew = load(NEW, nhdr, ntgt, nord)
+  nstamp = STAMP
+  if ((nold < 0)||(nnew < 0)) {
+    print "Bad metadata file." > "/dev/stderr"
+    exit(3)
+  }
+
+  print ostamp
+  print nstamp
+  # added or changed entries, in the order of new file (a dir is
+  # always given before its content)
+  for(i=1; i<=nnew; i++) {
+    nm = nord[i]
+    if (!(nm in ohdr))
+      entry("+", nhdr[nm], nm, ntgt[nm])
+    else if ((ohdr[nm] != nhdr[nm])||(otgt[nm] != ntgt[nm]))
+      entry("~", nhdr[nm], nm, ntgt[nm])
+  }
+  # removed entries, content before its dir
+  for(i=nold; i>=1; i--) {
+    nm = oord[i]
+    if (!(nm in nhdr)) {
+      print "-"
+      print nm
+    }
+  }
+}'
@@ -5,10 +5,19 @@
 
 
 # usage: $1 base URL
+# with '--delta <old metadata file>' first, a delta file (changes
+#  since this old file) is also generated
+
+DELTA=""
+if [ "$1" = "--delta" ]
+then
+  DELTA="$2"
+  shift 2
+fi
 
 if [ "$1" = "" -o "$2" = "" -o "$1" = "-h" -o "$1" = "--help" ]
 then
-  echo "Usage: $0 <site> <base path>"
+  echo "Usage: $0 [--delta <old metadata file>] <site> <base path>"
   exit 1
 fi
 
@@ -139,6 +148,8 @@ treat_url "$URL" "/"
 
 INODE=10100
 # now generate content
+# update timestamp
+date +%s >>"$OUTPUT"
 # check number of entries
 NBE=`cat "$FILES" | wc -l`
 # +1 for /
@@ -182,5 +193,11 @@ _EOF_
 
 cp "$OUTPUT" ./temp.metadata
 
+# changes since old metadata file
+if [ ! "$DELTA" = "" ]
+then
+  `dirname "$0"`/metadata_delta.sh "$DELTA" ./temp.metadata >./temp.delta
+fi
+
 # cleanup stuff
 cleanup
@@ -0,0 +1,86 @@
+#!/bin/sh
+
+# this script splits a WebFS metadata file in sharded files (see
+#  DescriptionFormat.txt): the root file describes / and its content,
+#  each top-level directory has its own file.
+# files are created in the output dir, which must be exported on the
+#  web server under the given path (default: /shards).
+
+
+# usage: $1 metadata file, $2 output dir, $3 path of output dir on server
+
+if [ "$1" = "" -o "$2" = "" -o "$1" = "-h" -o "$1" = "--help" ]
+then
+  echo "Usage: $0 <metadata file> <output dir> [<path on server>]"
+  exit 1
+fi
+
+if [ ! -r "$1" -o ! -d "$2" ]
+then
+  echo "Can't read '$1' or '$2' is not a directory. Abort." >&2
+  exit 2
+fi
+
+SRV="$3"
+if [ "$SRV" = "" ]
+then
+  SRV="/shards"
+fi
+
+awk -v OUT="$2" -v SRV="$SRV" '
+# print an entry block in file
+function entry(file, h, nm, t) {
+  print h > file
+  print nm > file
+  if (t != "")
+    print t > file
+}
+
+NR == 1 { STAMP = $0; next }
+NR == 2 { next }
+{
+  h = $0
+  if ((getline nm) <= 0)
+    exit(3)
+  split(h, f, " ")
+  t = ""
+  if ((f[1] == 2)||(f[1] == 3))
+    getline t
+  n++
+  # top-level entry (or /): in root file. top-level dirs are sharded
+  if ((n == 1)||(index(nm, "/") == 0)) {
+    if ((n > 1)&&(f[1] == 0)) {
+      shard[nm] = ++nshard
+      sub(/^0/, "3", h)
+      t = SRV "/" nshard ".data"
+    }
+    rh[++nroot] = h
+    rn[nroot] = nm
+    rt[nroot] = t
+    next
+  }
+  # inside a top-level dir
+  top = substr(nm, 1, index(nm, "/")-1)
+  s = shard[top]
+  cnt[s]++
+  sh[s, cnt[s]] = h
+  sn[s, cnt[s]] = nm
+  st[s, cnt[s]] = t
+}
+
+END {
+  file = OUT "/description.data"
+  print STAMP > file
+  print nroot > file
+  for(i=1; i<=nroot; i++)
+    entry(file, rh[i], rn[i], rt[i])
+  close(file)
+  for(s=1; s<=nshard; s++) {
+    file = OUT "/" s ".data"
+    print STAMP > file
+    print cnt[s]+0 > file
+    for(i=1; i<=cnt[s]; i++)
+      entry(file, sh[s, i], sn[s, i], st[s, i])
+    close(file)
+  }
+}' "$1"
@@ -1,6 +1,13 @@
+#include <pthread.h>
+
 #include "cache.h"
 #include "tools.h"
 #include "webget.h"
+#include "fileget.h"
+#include "stats.h"
+#include "probe.h"
+#include "sched.h"
+#include "pool.h"
 
 
 /* URL for target */
@@ -10,10 +17,35 @@ extern char *url_path;
 
 /* table of cache(s). Unused one have name=NULL */
 Cache caches[CACHE_MAX];
+/* protects caches and chunks. Released during transfers */
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* signaled when the transfer of a chunk, or the set up of a cache,
+   is done */
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+/* set ups of caches started */
+static unsigned int cache_setups = 0;
 
 /* global settings for caches */
-int cache_chunksize=CACHE_BLOCK*8;  /* size of each chunk (max) */
+int cache_chunksize=CACHE_BLOCK*8;  /* initial size of each chunk */
 int cache_chunks=1;                 /* number of chunks per cache */
+int cache_chunksize_min=CACHE_CHUNK_MIN; /* bounds for adaptive size */
+int cache_chunksize_max=CACHE_CHUNK_MAX;
+int cache_latency=0;    /* delay added to each request (us) */
+int cache_bandwidth=0;  /* max bandwidth of all requests (bytes/s) */
+int cache_readahead=0;  /* chunks loaded ahead of sequential reads */
+
+/* max retries of a read when its cache was removed meanwhile */
+#define CACHE_TRIES 3
+
+/* a background load of a chunk */
+typedef struct {
+  Connection cnx;  /* copy of the connection of the cache */
+  Chunk *chunk;
+}CacheJob;
+
+/* date (us) at which the simulated link is free */
+static unsigned long long cache_link_free=0;
+static pthread_mutex_t cache_link_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 /* initialise cache without freeing */
@@ -30,12 +62,18 @@ void cache_zero(Cache *cache) {
   for(i=0; i<CACHE_MAX_CHUNK; i++) {
     cache->chunks[i] = NULL;
   }
+  cache->zchunks = NULL;
+  cache->setup = 0;
   /* cleanup cache itself */
   cache->name = NULL;
   cache->size = 0;
   cache->created = 0;
   cache->last_use = 0;
   cache->firstblock = NULL;
+  cache->nb_ranges = 0;
+  cache->chunksize = cache_chunksize;
+  cache->next_off = 0;
+  cache->score = 0;
 }
 
 /* to be called first */
@@ -53,35 +91,65 @@ int cache_init() {
 void cache_chunk_free(Chunk *chunk) {
   if (chunk == NULL)
     return;
-  if (chunk->data != NULL)
-    free(chunk->data);
+  pool_free(chunk->data);
   free(chunk);
 }
 
+/* simulate a slow network: wait until a request started at 'start'
+   and moving 'bytes' took at least the latency, plus the transfer
+   time on a link shared by all requests */
+void cache_throttle(unsigned int bytes, unsigned long long start) {
+  unsigned long long now, end;
+
+  if ((cache_latency <= 0)&&(cache_bandwidth <= 0))
+    return;
+  now = stats_now();
+  end = start + cache_latency;
+  if (cache_bandwidth > 0) {
+    pthread_mutex_lock(&cache_link_lock);
+    if (cache_link_free < now)
+      cache_link_free = now;
+    cache_link_free += (unsigned long long)bytes*1000000/cache_bandwidth;
+    if (cache_link_free > end)
+      end = cache_link_free;
+    pthread_mutex_unlock(&cache_link_lock);
+  }
+  if (end > now)
+    usleep(end-now);
+}
+
 /* close a connection */
 void cache_disconnect(Connection *cnx) {
-  /* remove CURL connection (do nothing) */
-  wget_disconnect(cnx);
+  /* close file or remove CURL connection (do nothing) */
+  if (cnx->type == CNX_FILE)
+    fget_disconnect(cnx);
+  else
+    wget_disconnect(cnx);
   
   cnx->data = NULL;
   cnx->idata = 0;
   cnx->type = CNX_NDEF;
 }
 
-/* freed content of a cache */
+/* freed content of a cache (lock held) */
 void cache_free(Cache *cache) {
   int i;
   mylog("cache_free(%p)\n", cache);
   /* cache itself */
   if (cache->name != NULL)
     free(cache->name);
-  if (cache->firstblock != NULL)
-    free(cache->firstblock);
-  /* chunks */
+  pool_free(cache->firstblock);
+  /* chunks. the ones being loaded are freed by their loader */
   for(i=0; i<CACHE_MAX_CHUNK; i++) {
-    cache_chunk_free(cache->chunks[i]);
+    if ((cache->chunks[i] != NULL)&&(cache->chunks[i]->state == CHUNK_PENDING)) {
+      cache->chunks[i]->state = CHUNK_ORPHAN;
+      __atomic_store_n(&(cache->chunks[i]->cancel), 1, __ATOMIC_RELAXED);
+    } else {
+      cache_chunk_free(cache->chunks[i]);
+    }
     cache->chunks[i] = NULL;
   }
+  ztier_drop(&(cache->zchunks));
   /* connection */
   cache_disconnect(&(cache->connection));
   if (cache->connection.target != NULL)
@@ -94,20 +162,22 @@ int cache_fini() {
   int i;
   
   mylog("cache_fini()\n");
+  pthread_mutex_lock(&cache_lock);
   for(i=0; i<CACHE_MAX; i++) {
     cache_free(&(caches[i]));
   }
+  pthread_mutex_unlock(&cache_lock);
 
   return(1);
 }
 
-/* search a cache by name */
+/* search a cache by name (not one being set up) */
 Cache *cache_search(const char *file) {
   int i;
   
   mylog("cache_search(%s)\n", file);
   for(i=0; i<CACHE_MAX; i++) {
-    if (caches[i].name == NULL)
+    if ((caches[i].name == NULL)||(caches[i].setup != 0))
       continue;
     if (strcmp(file, caches[i].name) == 0)
       return(&(caches[i]));
@@ -115,13 +185,24 @@ Cache *cache_search(const char *file) {
   return(NULL);
 }
 
-/* find oldest cache */
+/* true if a cache for file is being set up */
+static int cache_setting_up(const char *file) {
+  int i;
+
+  for(i=0; i<CACHE_MAX; i++)
+    if ((caches[i].name != NULL)&&(caches[i].setup != 0)&&
+        (strcmp(file, caches[i].name) == 0))
+      return(1);
+  return(0);
+}
+
+/* find oldest cache (not one being set up) */
 Cache *cache_oldest() {
   int i, target=-1;
   unsigned int small = (unsigned int)-1;
   
   for(i=0; i<CACHE_MAX; i++) {
-    if (caches[i].name != NULL) {
+    if ((caches[i].name != NULL)&&(caches[i].setup == 0)) {
       if (target == -1) {
         target = i;
 	small = caches[i].last_use;
@@ -138,42 +219,194 @@ Cache *cache_oldest() {
   return(&(caches[target]));
 }
 
-/* create a connection for given file/URL */
-int cache_connect(Connection *cnx, const char *file, const char *url,
-                  char *firstblock, unsigned int size) {
-
-  char buffer[4096], *cvt;
+/* a loaded chunk of 'cache' is dropped or re-used: keep its data
+   compressed (lock held, released while compressing: the chunk is then
+   pending, as if being loaded, and left so).
+   returns false if the cache was removed meanwhile (chunk freed) */
+static int cache_keep(Cache *cache, Chunk *chunk) {
+  ZChunk *z;
 
-  mylog("cache_connect(%p, %s, %s)\n", cnx, file, url);
-  cvt = wget_encode(url, file);
-  sprintf(buffer, "%s", cvt);
-  /* create CURL connection (checks validity) */
-  if (!wget_connect(buffer, cnx, firstblock, size)) {
-    mylog("cache_connect: wget_connect(%s, -) failed\n", buffer);
+  if (ztier_budget == 0)
+    return(1);
+  chunk->state = CHUNK_PENDING;
+  chunk->prio = SCHED_DEMAND;
+  chunk->job = NULL;
+  pthread_mutex_unlock(&cache_lock);
+  z = ztier_zip(chunk->off_start, chunk->data,
+                chunk->off_end-chunk->off_start+1);
+  pthread_mutex_lock(&cache_lock);
+  pthread_cond_broadcast(&cache_cond);
+  if (chunk->state == CHUNK_ORPHAN) {
+    if (z != NULL)
+      ztier_discard(z);
+    cache_chunk_free(chunk);
     return(0);
   }
-  mylog("cache_connect: wget_connect ok\n");
-  cnx->target = strdup(buffer);
-  if (cnx->target == NULL) {
-    mylog("cache_connect: failed to copy target name");
-    wget_disconnect(cnx); /* not needed, but... */
+  if (z != NULL)
+    ztier_link(&(cache->zchunks), z);
+  return(1);
+}
+
+/* drop data of an other cache than 'cache' to free memory (lock held,
+   maybe released meanwhile, see cache_keep): the loaded chunk with the
+   smallest offset of the least recently used cache, else the firstblock
+   of the least recently used one.
+   returns false if nothing can be dropped */
+static int cache_reclaim(Cache *cache) {
+  Cache *victim=NULL, *first=NULL;
+  Chunk *chunk;
+  int i, j, nb=-1, n;
+
+  for(i=0; i<CACHE_MAX; i++) {
+    if ((caches[i].name == NULL)||(&(caches[i]) == cache))
+      continue;
+    if ((caches[i].firstblock != NULL)&&
+        ((first == NULL)||(caches[i].last_use < first->last_use)))
+      first = &(caches[i]);
+    if ((victim != NULL)&&(caches[i].last_use >= victim->last_use))
+      continue;
+    n = -1;
+    for(j=0; j<CACHE_MAX_CHUNK; j++) {
+      chunk = caches[i].chunks[j];
+      if ((chunk != NULL)&&(chunk->state == CHUNK_READY)&&
+          ((n < 0)||(chunk->off_start < caches[i].chunks[n]->off_start)))
+        n = j;
+    }
+    if (n >= 0) {
+      victim = &(caches[i]);
+      nb = n;
+    }
+  }
+  if (victim != NULL) {
+    chunk = victim->chunks[nb];
+    mylog("cache_reclaim: chunk %u-%u of %s\n", chunk->off_start,
+          chunk->off_end, victim->name);
+    /* else freed with its cache */
+    if (cache_keep(victim, chunk)) {
+      cache_chunk_free(chunk);
+      victim->chunks[nb] = NULL;
+    }
+  } else if (first != NULL) {
+    mylog("cache_reclaim: firstblock of %s\n", first->name);
+    pool_free(first->firstblock);
+    first->firstblock = NULL;
+    first->firstblocksize = 0;
+  } else {
     return(0);
   }
+  stats_add(SC_POOL_EVICT, 1);
+  return(1);
+}
+
+/* make room in the memory budget for a buffer of 'size' bytes for
+   'cache' (lock held, maybe released meanwhile, see cache_reclaim),
+   dropping data of other caches if needed, but
+   not for background loads (priority 'prio'): these would only evict
+   data loaded ahead for other readers.
+   returns false if not possible */
+static int cache_room(Cache *cache, unsigned int size, int prio) {
+  while(!pool_fits(size))
+    if ((prio != SCHED_DEMAND)||(!cache_reclaim(cache)))
+      return(0);
+  return(1);
+}
+
+/* name of 'file' for the backend: path of the local file, or encoded
+   URL. returns a new string (length in 'lng'), or NULL if failed */
+char *cache_target(const char *file, unsigned int *lng) {
+  const char *base;
+  char *dest;
+  int n;
+
+  if (fget_is_local(url_path)) {
+    base = url_path+strlen(FGET_PREFIX);
+    n = strlen(base)+strlen(file);
+    dest = malloc(n+1);
+    if (dest == NULL)
+      return(NULL);
+    sprintf(dest, "%s%s", base, file);
+  } else {
+    n = wget_encode_to(NULL, 0, url_path, file);
+    dest = malloc(n+1);
+    if (dest == NULL)
+      return(NULL);
+    wget_encode_to(dest, n+1, url_path, file);
+  }
+  *lng = n;
+  return(dest);
+}
+
+/* create a connection for a file/URL 'target' (see cache_target),
+   which is then owned by the connection (freed if failed).
+   returns 1 if ok, 0 if failed (errno set, see wget_connect), -1 if
+   the file does not exist */
+int cache_connect(Connection *cnx, char *target, char *firstblock,
+                  unsigned int size) {
+  unsigned long long start;
+  int ret, err;
+
+  mylog("cache_connect(%p, %s)\n", cnx, target);
+  start = stats_now();
+  /* local file backend: plain path */
+  if (fget_is_local(url_path)) {
+    ret = fget_connect(target, cnx, firstblock, size);
+    if (ret <= 0) {
+      err = errno;
+      mylogl(MYLOG_WARN, "cache_connect: fget_connect(%s, -) failed\n", target);
+      free(target);
+      errno = err;
+      return(ret);
+    }
+    cnx->target = target;
+    cnx->type = CNX_FILE;
+    cnx->data = NULL;  /* not used */
+    cache_throttle((firstblock != NULL)?size:0, start);
+    return(1);
+  }
+  /* create CURL connection (checks validity) */
+  ret = wget_connect(target, cnx, firstblock, size);
+  if (ret <= 0) {
+    err = errno;
+    mylogl(MYLOG_WARN, "cache_connect: wget_connect(%s, -) %s\n", target,
+           (ret < 0)?"not found":"failed");
+    free(target);
+    errno = err;
+    return(ret);
+  }
+  mylog("cache_connect: wget_connect ok\n");
+  cnx->target = target;
   cnx->type = CNX_URL;
   cnx->data = NULL;  /* not used */
   cnx->idata = 0;    /* not used */
+  cache_throttle((firstblock != NULL)?size:0, start);
   
   return(1);
 }
 
-/* create a new cache for given file.
-   returns true if created, false else
-   can destroy an other one if no place available */
-Cache *cache_create(const char *file, unsigned int size) {
-  int i;
+/* create a new cache for given file (lock held, released while the
+   connection is opened). 'target' is its name for the backend (NULL:
+   computed) */
+static Cache *cache_new(const char *file, const char *target,
+                        unsigned int lng, unsigned int size) {
+  int i, ok, err;
+  unsigned int real, setup, fbsize;
   Cache *tmp=NULL;
+  Connection cnx;
+  char *tgt, *fb=NULL;
   
-  mylog("cache_create(%s, %u)\n", file, size);
+  mylog("cache_new(%s, %u)\n", file, size);
+  /* copy of the name for the backend */
+  if (target != NULL) {
+    tgt = malloc(lng+1);
+    if (tgt != NULL)
+      memcpy(tgt, target, lng+1);
+  } else {
+    tgt = cache_target(file, &lng);
+  }
+  if (tgt == NULL) {
+    errno = ENOMEM;
+    return(NULL);
+  }
   /* search a free cache */
   for(i=0; i<CACHE_MAX; i++) {
     if (caches[i].name == NULL) {
@@ -186,8 +419,13 @@ Cache *cache_create(const char *file, unsigned int size) {
     tmp = cache_oldest();
     if (tmp == NULL) {
       /* should not occur */
+      free(tgt);
+      errno = EBUSY;
       return(NULL);
     }
+    PROBE2(cache_evict, tmp->name, file);
+    cache_free(tmp);
+    stats_add(SC_EVICT, 1);
   }
   /* initialise common cache data */
   tmp->name = strdup(file);
@@ -195,26 +433,58 @@ Cache *cache_create(const char *file, unsigned int size) {
   tmp->firstblock = NULL;
   for(i=0; i<CACHE_MAX_CHUNK; i++)
     tmp->chunks[i] = NULL;
+  tmp->zchunks = NULL;
   tmp->size = size;
+  tmp->nb_ranges = 0;
+  tmp->chunksize = cache_chunksize;
+  tmp->next_off = 0;
+  tmp->score = 0;
+  /* being set up: others wait for it (see cache_read) */
+  if (++cache_setups == 0)
+    cache_setups = 1;
+  tmp->setup = setup = cache_setups;
   
   /* alocate 'firstblock' to cache_chunksize or size
-     if smaller (for dl at 'connect') */
-  tmp->firstblock = malloc(MIN(cache_chunksize, size));
-  if (tmp->firstblock != NULL) {
-     tmp->firstblocksize = MIN(cache_chunksize, size);
-  }
+     if smaller (for dl at 'connect'). Given to the cache once loaded */
+  fbsize = MIN(cache_chunksize, size);
+  if (cache_room(tmp, fbsize, SCHED_DEMAND))
+    fb = pool_alloc(fbsize, &real);
   /* just ignore if failed (NULL) as in this case
      fistblock will be ignored */
   
-  /* creation connection for this file */
+  /* creation connection for this file, without the lock (the server
+     may be slow to answer) */
   
-  mylog("cache_create: connextion cache %p (cnx=%p)\n", tmp, &(tmp->connection));
-  if (!cache_connect(&(tmp->connection), file,
-          url_path, tmp->firstblock, MIN(cache_chunksize, size))) {
+  mylog("cache_create: connextion cache %p\n", tmp);
+  memset(&cnx, 0, sizeof(Connection));
+  pthread_mutex_unlock(&cache_lock);
+  sched_acquire(SCHED_DEMAND, fbsize);
+  ok = cache_connect(&cnx, tgt, fb, fbsize);
+  err = (ok < 0)?ENOENT:errno;
+  sched_release(SCHED_DEMAND);
+  pthread_mutex_lock(&cache_lock);
+  pthread_cond_broadcast(&cache_cond);
+  /* removed meanwhile (changed by a delta, all caches destroyed) */
+  if (tmp->setup != setup) {
+    if (ok > 0) {
+      cache_disconnect(&cnx);
+      free(cnx.target);
+    }
+    pool_free(fb);
+    errno = EBUSY;
+    return(NULL);
+  }
+  if (ok <= 0) {
     /* destroy this cache... */
+    pool_free(fb);
     cache_free(tmp);
+    errno = err;
     return(NULL);
   }
+  tmp->connection = cnx;
+  tmp->firstblock = fb;
+  tmp->firstblocksize = (fb != NULL)?fbsize:0;
+  tmp->setup = 0;
   
   mylog("cache_create: %p->connection = { %s, %d, %p, %d}\n", tmp,
     tmp->connection.target, tmp->connection.type,
@@ -224,25 +494,45 @@ Cache *cache_create(const char *file, unsigned int size) {
   return(tmp);
 }
 
+/* create a new cache for given file. 'target' (length 'lng') is its
+   name for the backend (see cache_target), NULL to compute it.
+   returns the cache, or NULL if failed (errno ENOENT if the file does
+   not exist on server, EIO if the server failed, EAGAIN if it is down
+   and was not asked)
+   can destroy an other one if no place available */
+Cache *cache_create(const char *file, const char *target, unsigned int lng,
+                    unsigned int size) {
+  Cache *tmp;
+
+  mylog("cache_create(%s, %u)\n", file, size);
+  pthread_mutex_lock(&cache_lock);
+  tmp = cache_new(file, target, lng, size);
+  pthread_mutex_unlock(&cache_lock);
+  return(tmp);
+}
+
 /* destroy a cache */
 int cache_destroy(const char *file) {
   Cache *tmp;
   
+  pthread_mutex_lock(&cache_lock);
   tmp = cache_search(file);
-  if (tmp == NULL)
-    return(0);
-  cache_free(tmp);
-  return(1);
+  if (tmp != NULL)
+    cache_free(tmp);
+  pthread_mutex_unlock(&cache_lock);
+  return(tmp != NULL);
 }
 
 /* destroy all caches */
 int cache_destroy_all() {
   int i;
   
+  pthread_mutex_lock(&cache_lock);
   for(i=0; i<CACHE_MAX; i++) {
     if (caches[i].name != NULL)
-      cache_destroy(caches[i].name);
+      cache_free(&(caches[i]));
   }
+  pthread_mutex_unlock(&cache_lock);
 
   return(1);
 }
@@ -264,13 +554,14 @@ mylog("cache_search_data(%p, %u, %u, -)\n", cache, offset, size);
   if (cache->firstblock != NULL) {
     if (offset < cache->firstblocksize) {
       if (offset+size-1 < cache->firstblocksize) {
+        PROBE3(cache_hit, cache->name, offset, size);
         return(cache->firstblock+offset);
       }
     }
   }
   /* check in chunks */
   for(i=0; i<CACHE_MAX_CHUNK; i++) {
-    if (cache->chunks[i] != NULL) {
+    if ((cache->chunks[i] != NULL)&&(cache->chunks[i]->state == CHUNK_READY)) {
 mylog("cache_search_data: testing chunk #%d (%d-%d)\n", i,
   cache->chunks[i]->off_start, cache->chunks[i]->off_end);
       if ((offset >= cache->chunks[i]->off_start)&&
@@ -279,53 +570,145 @@ mylog("cache_search_data: %u+%u-1 (=%u) < %u\n", offset, size,
      offset+size-1, cache->chunks[i]->off_end);
         if (offset+size-1 < cache->chunks[i]->off_end) {
 	  /* return data */
+	  PROBE3(cache_hit, cache->name, offset, size);
 	  return(cache->chunks[i]->data + (offset-cache->chunks[i]->off_start));
 	} else {
 	  /* we have a *part* of the requested data. give it */
 	  /* real size */
 	  *rsize = cache->chunks[i]->off_end - offset + 1;
+	  PROBE3(cache_hit, cache->name, offset, *rsize);
 	  return(cache->chunks[i]->data + (offset-cache->chunks[i]->off_start));
 	}
       }
     }
   }
   /* not found */
+  PROBE3(cache_miss, cache->name, offset, size);
   return(NULL);
 }
 
 
-/* fill given chunk in given cache */
-int cache_do_read(Cache *cache, int nchunk) {
-  int ret;
-  
-  mylog("cache_do_read(%p, %d). My cnx=%p\n", cache, nchunk, &(cache->connection));
-
-  /*
-  ret = pread(fd, cache->chunks[nchunk]->data,
-              cache->chunks[nchunk]->off_end-cache->chunks[nchunk]->off_start+1,
-	      cache->chunks[nchunk]->off_start);
-  */
-  ret = wget_read(&(cache->connection),
-              cache->chunks[nchunk]->off_start,
-	      cache->chunks[nchunk]->off_end-cache->chunks[nchunk]->off_start+1,
-	      (void*)cache->chunks[nchunk]->data);
-
-  mylog("cache_do_read: wget_read(%d, %p, %u, %u) = %d\n", 0,
-     cache->chunks[nchunk]->data,
-     cache->chunks[nchunk]->off_end-cache->chunks[nchunk]->off_start+1,
-     cache->chunks[nchunk]->off_start, ret);
-  if (ret <= 0)
+/* chunk containing the given offset (loaded or not), NULL if none */
+Chunk *cache_chunk_at(Cache *cache, unsigned int offset) {
+  int i;
+
+  for(i=0; i<CACHE_MAX_CHUNK; i++) {
+    if ((cache->chunks[i] != NULL)&&(offset >= cache->chunks[i]->off_start)&&
+        (offset <= cache->chunks[i]->off_end))
+      return(cache->chunks[i]);
+  }
+  return(NULL);
+}
+
+/* copy of a connection, usable while the cache is unlocked (its own
+   target and file descriptor). returns false if failed */
+int cache_cnx_copy(Connection *dest, Connection *cnx) {
+  dest->type = cnx->type;
+  dest->data = NULL;
+  dest->idata = 0;
+  dest->target = strdup(cnx->target);
+  if (dest->target == NULL)
     return(0);
+  if (cnx->type == CNX_FILE) {
+    dest->idata = dup(cnx->idata);
+    if (dest->idata < 0) {
+      free(dest->target);
+      return(0);
+    }
+  }
   return(1);
 }
 
-/* fetch data from target, from given offset */
-int cache_fetch_data(Cache *cache, unsigned int offset) {
-  int i, nb=-1;
-  unsigned int min;
+/* free a copy of a connection */
+void cache_cnx_free(Connection *cnx) {
+  if ((cnx->type == CNX_FILE)&&(cnx->idata >= 0))
+    close(cnx->idata);
+  free(cnx->target);
+  cnx->target = NULL;
+}
 
+/* fill given chunk from the connection (lock not held).
+   waits for the scheduler before the transfer.
+   returns true if loaded */
+int cache_load(Connection *cnx, Chunk *chunk) {
+  unsigned long long start;
+  unsigned int size;
+  int ret, prio;
+  
+  mylog("cache_load(%p, %p)\n", cnx, chunk);
+
+  size = chunk->off_end-chunk->off_start+1;
+  /* a reader may wait for it meanwhile (see cache_urge) */
+  prio = sched_acquire_prio(&(chunk->prio), size);
+  start = stats_now();
+  if (__atomic_load_n(&(chunk->cancel), __ATOMIC_RELAXED)) {
+    ret = 0;  /* no more needed */
+  } else if (cnx->type == CNX_FILE) {
+    ret = fget_read(cnx, chunk->off_start, size, (void*)chunk->data);
+  } else {
+    wget_set_cancel(&(chunk->cancel));
+    ret = wget_read(cnx, chunk->off_start, size, (void*)chunk->data);
+    wget_set_cancel(NULL);
+  }
+  cache_throttle((ret > 0)?size:0, start);
+  sched_release(prio);
+
+  mylog("cache_load: read(%p, %u, %u) = %d\n", chunk->data, size,
+     chunk->off_start, ret);
+  return(ret > 0);
+}
+
+/* transfer of a chunk is done (lock held): the chunk is ready, or
+   dropped if failed or cancelled (freed if its cache was removed).
+   returns true if ready */
+int cache_loaded(Chunk *chunk, int ok) {
+  int i, j;
+
+  pthread_cond_broadcast(&cache_cond);
+  if (chunk->state == CHUNK_ORPHAN) {
+    cache_chunk_free(chunk);
+    return(0);
+  }
+  if ((ok)&&(!chunk->cancel)) {
+    chunk->state = CHUNK_READY;
+    return(1);
+  }
+  /* argl. this chunk is no more valid. destroy it */
+  for(i=0; i<CACHE_MAX; i++)
+    for(j=0; j<CACHE_MAX_CHUNK; j++)
+      if (caches[i].chunks[j] == chunk)
+        caches[i].chunks[j] = NULL;
+  cache_chunk_free(chunk);
+  return(0);
+}
+
+/* get a chunk slot for data at given offset and set its bounds.
+   a free slot is allocated if any (and if the memory budget allows it,
+   maybe dropping data of other caches), else the loaded chunk with the
+   smallest offset ending before 'reuse_below' is re-used. The chunk
+   is then being loaded, with priority 'prio', or ready if its data was
+   kept compressed (then it can start before 'offset'). The lock is
+   released while data is compressed or uncompressed, the chunk being
+   pending meanwhile.
+   returns the slot, -1 if failed, -2 if no slot can be used or -3 if
+   the cache was removed meanwhile */
+int cache_chunk_slot(Cache *cache, unsigned int offset,
+                     unsigned int reuse_below, int prio) {
+  int i, nb=-1, ok;
+  unsigned int need, real, wanted=offset;
+  Chunk *chunk=NULL;
+  ZChunk *z;
+  char *tmp;
+
+  /* size needed for this chunk: the one kept compressed, if any */
+  z = ztier_take(&(cache->zchunks), offset);
+  if (z != NULL) {
+    offset = z->off_start;
+    need = z->size;
+  } else {
+    need = MIN(cache->chunksize, cache->size-offset);
+  }
 
-  mylog("cache_fetch_data(%p, %u)\n", cache, offset);
   /* search for a free chunk */
   for(i=0; i<cache_chunks; i++) {
     if (cache->chunks[i] == NULL) {
@@ -335,59 +718,497 @@ int cache_fetch_data(Cache *cache, unsigned int offset) {
   }
   
   mylog("cache_fetch: found empty chunk slot %d\n", nb);
+  if (nb >= 0) {
+    /* allocate the chunk, pending (the lock may be released to make
+       room) */
+    chunk = malloc(sizeof(Chunk));
+    if (chunk == NULL) {
+      if (z != NULL)
+        ztier_back(&(cache->zchunks), z);
+      return(-1);
+    }
+    memset(chunk, 0, sizeof(Chunk));
+    chunk->off_start = offset;
+    chunk->off_end = offset + need - 1;
+    chunk->state = CHUNK_PENDING;
+    chunk->prio = prio;
+    cache->chunks[nb] = chunk;
+    ok = cache_room(cache, need, prio);
+    if (chunk->state == CHUNK_ORPHAN) {
+      cache_chunk_free(chunk);
+      if (z != NULL)
+        ztier_discard(z);
+      return(-3);
+    }
+    if (ok)
+      chunk->data = pool_alloc(need, &real);
+    if (chunk->data == NULL) {
+      /* no memory for a new one: re-use one */
+      cache->chunks[nb] = NULL;
+      free(chunk);
+      nb = -1;
+    } else {
+      chunk->size = real;
+  mylog("cache_fetch: chunk %d allocated (size=%u) [%p-%p[\n", nb, real,
+          chunk->data, chunk->data+real);
+    }
+  }
   
   if (nb < 0) {
-    /* none free? use the smallest offset (assume seq. read - should use older) */
-    min = cache->chunks[0]->off_start;
-    nb = 0;
-    for(i=1; i<cache_chunks; i++) {
-      if (cache->chunks[i]->off_start < min) {
-	min = cache->chunks[i]->off_start;
-	nb = i;
-      }
+    /* none free? use the smallest offset (assume seq. read - should use
+       older), not being loaded */
+    for(i=0; i<cache_chunks; i++) {
+      if ((cache->chunks[i] == NULL)||(cache->chunks[i]->state != CHUNK_READY)||
+          (cache->chunks[i]->off_end >= reuse_below))
+        continue;
+      if ((nb < 0)||(cache->chunks[i]->off_start < cache->chunks[nb]->off_start))
+        nb = i;
     }
-  } else {
-    /* allocate the chunk */
-    cache->chunks[nb] = malloc(sizeof(Chunk));
-    if (cache->chunks[nb] == NULL) {
-      return(0);
+    if (nb < 0) {
+      if (z != NULL)
+        ztier_back(&(cache->zchunks), z);
+      return(-2);
+    }
+    chunk = cache->chunks[nb];
+    stats_add(SC_CHUNK_EVICT, 1);
+    PROBE4(chunk_evict, cache->name, nb, chunk->off_start, offset);
+    if (!cache_keep(cache, chunk)) {
+      if (z != NULL)
+        ztier_discard(z);
+      return(-3);
+    }
+    chunk->state = CHUNK_PENDING;
+    chunk->prio = prio;
+    chunk->job = NULL;
+    chunk->cancel = 0;
+  }
+
+  /* re-used chunk with a different size: adjust it (too small, or
+     wasting more than half of its memory) */
+  if ((chunk->size < need)||(chunk->size/2 > need)) {
+    /* a smaller one always fits in place of the old one */
+    if (chunk->size > need) {
+      pool_free(chunk->data);
+      chunk->data = NULL;
     }
-    cache->chunks[nb]->off_start = 0;
-    cache->chunks[nb]->off_end = 0;
-    cache->chunks[nb]->data = malloc(cache_chunksize);
-    if (cache->chunks[nb]->data == NULL) {
-      free(cache->chunks[nb]);
+    tmp = NULL;
+    if ((chunk->data == NULL)||(cache_room(cache, need, prio)))
+      tmp = pool_alloc(need, &real);
+    if (chunk->state == CHUNK_ORPHAN) {
+      pool_free(tmp);
+      cache_chunk_free(chunk);
+      if (z != NULL)
+        ztier_discard(z);
+      return(-3);
+    }
+    if (tmp != NULL) {
+      pool_free(chunk->data);
+      chunk->data = tmp;
+      chunk->size = real;
+    } else if (chunk->data != NULL) {
+      /* keep the old one, with its size. Too small for the data kept
+         compressed: loaded from the offset asked, as usual */
+      if (z != NULL) {
+        ztier_back(&(cache->zchunks), z);
+        z = NULL;
+        offset = wanted;
+        need = MIN(cache->chunksize, cache->size-offset);
+      }
+      need = MIN(need, chunk->size);
+    } else {
+      free(chunk);
       cache->chunks[nb] = NULL;
-      return(0);
+      if (z != NULL)
+        ztier_back(&(cache->zchunks), z);
+      return(-1);
     }
-    
-  mylog("cache_fetch: chunk %d allocated (size=%d) [%p-%p[\n", nb, cache_chunksize,
-          cache->chunks[nb]->data, cache->chunks[nb]->data+cache_chunksize);
+  mylog("cache_fetch: chunk %d resized to %u\n", nb, chunk->size);
   }
   
   /* set new values */
-  cache->chunks[nb]->off_start = offset;
+  chunk->off_start = offset;
   mylog("cache_fetch: put start=%u\n", offset);
-  if (offset+cache_chunksize > cache->size) {
-    /* after end of file. reduce */
-    cache->chunks[nb]->off_end = cache->size - 1;
+  chunk->off_end = offset + need - 1;
+  mylog("cache_fetch: put end=%u\n", chunk->off_end);
+
+  /* data kept compressed: no transfer (else loaded as usual) */
+  if (z != NULL) {
+    pthread_mutex_unlock(&cache_lock);
+    ok = ztier_unzip(z, chunk->data);
+    pthread_mutex_lock(&cache_lock);
+    pthread_cond_broadcast(&cache_cond);
+    if (chunk->state == CHUNK_ORPHAN) {
+      cache_chunk_free(chunk);
+      return(-3);
+    }
+    if (ok)
+      chunk->state = CHUNK_READY;
+  }
+
+  return(nb);
+}
+
+/* update the access pattern of the cache with a new read (sequential
+   if it starts where the previous one ended) */
+void cache_pattern(Cache *cache, unsigned int offset) {
+  if (offset == cache->next_off) {
+    if (cache->score < 2*CACHE_ADAPT_SCORE)
+      cache->score++;
   } else {
-    cache->chunks[nb]->off_end = offset + cache_chunksize - 1;
+    if (cache->score > -2*CACHE_ADAPT_SCORE)
+      cache->score--;
+  }
+}
+
+/* adapt the size of the next chunks to the access pattern:
+   larger for sequential reads, smaller for random ones */
+void cache_adapt(Cache *cache) {
+  unsigned int old = cache->chunksize;
+
+  if (cache->score >= CACHE_ADAPT_SCORE) {
+    cache->chunksize = MIN(cache->chunksize*2, cache_chunksize_max);
+  } else if (cache->score <= -CACHE_ADAPT_SCORE) {
+    cache->chunksize /= 2;
+    if (cache->chunksize < cache_chunksize_min)
+      cache->chunksize = cache_chunksize_min;
+  }
+  if (old != cache->chunksize)
+    mylog("cache_adapt(%p): chunksize %u -> %u (score=%d)\n", cache, old,
+          cache->chunksize, cache->score);
+}
+
+/* fetch data from target, from given offset (lock held, released
+   during the transfer).
+   returns 1 if loaded, 0 if failed, -1 if all chunks are being loaded
+   (wait for one) or -2 if the cache was removed meanwhile */
+int cache_fetch_data(Cache *cache, unsigned int offset) {
+  Connection cnx;
+  Chunk *chunk;
+  int nb, ok, orphan;
+
+  mylog("cache_fetch_data(%p, %u)\n", cache, offset);
+  cache_adapt(cache);
+  nb = cache_chunk_slot(cache, offset, (unsigned int)-1, SCHED_DEMAND);
+  if (nb == -2)
+    return(-1);  /* all chunks being loaded */
+  if (nb == -3)
+    return(-2);  /* cache removed meanwhile */
+  if (nb < 0)
+    return(0);
+  chunk = cache->chunks[nb];
+  if (chunk->state == CHUNK_READY)
+    return(1);  /* was kept compressed */
+  if (!cache_cnx_copy(&cnx, &(cache->connection))) {
+    cache_loaded(chunk, 0);
+    return(0);
   }
-  mylog("cache_fetch: put end=%u\n", cache->chunks[nb]->off_end);
   
   /* perform read */
-  mylog("cache_fetch: performing do_read (%p, %d)\n", cache, nb);
-  if (!cache_do_read(cache, nb)) {
-    /* argl. this chunk is no more valid. destroy it */
-    cache_chunk_free(cache->chunks[nb]);
-    cache->chunks[nb] = NULL;
+  mylog("cache_fetch: performing load (%p, %d)\n", cache, nb);
+  pthread_mutex_unlock(&cache_lock);
+  ok = cache_load(&cnx, chunk);
+  cache_cnx_free(&cnx);
+  pthread_mutex_lock(&cache_lock);
+  orphan = (chunk->state == CHUNK_ORPHAN);
+  if (!cache_loaded(chunk, ok))
+    return(orphan?-2:0);
+  
+  return(1);
+}
+
+/* read a range straight in the buffer of the application, without
+   chunk (lock held, released during the transfer). For large random
+   reads: through a chunk they would only evict other data.
+   returns size read, or 0 if failed */
+int cache_direct(Cache *cache, unsigned int offset, unsigned int size,
+                 char *dest) {
+  Connection cnx;
+  Chunk direct;
+  int ok;
+
+  mylog("cache_direct(%p, %u, %u)\n", cache, offset, size);
+  if (!cache_cnx_copy(&cnx, &(cache->connection)))
     return(0);
+  memset(&direct, 0, sizeof(Chunk));
+  direct.off_start = offset;
+  direct.off_end = offset+size-1;
+  direct.data = dest;
+  direct.size = size;
+  direct.state = CHUNK_PENDING;
+  direct.prio = SCHED_DEMAND;
+  pthread_mutex_unlock(&cache_lock);
+  ok = cache_load(&cnx, &direct);
+  cache_cnx_free(&cnx);
+  pthread_mutex_lock(&cache_lock);
+  return(ok?(int)size:0);
+}
+
+/* background load of a chunk (scheduler job) */
+void cache_job(void *data, int stop) {
+  CacheJob *job = (CacheJob*)data;
+  int ok=0, cancel;
+
+  if (!stop)
+    ok = cache_load(&(job->cnx), job->chunk);
+  pthread_mutex_lock(&cache_lock);
+  cancel = (stop)||(job->chunk->cancel);
+  ok = cache_loaded(job->chunk, ok);
+  pthread_mutex_unlock(&cache_lock);
+  if (ok)
+    stats_add(SC_BG_FETCH, 1);
+  else if (cancel)
+    stats_add(SC_BG_CANCEL, 1);
+  cache_cnx_free(&(job->cnx));
+  free(job);
+}
+
+/* prepare the background load of a chunk being loaded (lock held).
+   returns the job, or NULL if failed (chunk dropped) */
+CacheJob *cache_job_new(Cache *cache, Chunk *chunk) {
+  CacheJob *job;
+
+  job = malloc(sizeof(CacheJob));
+  if ((job != NULL)&&(!cache_cnx_copy(&(job->cnx), &(cache->connection)))) {
+    free(job);
+    job = NULL;
   }
-  
+  if (job == NULL) {
+    cache_loaded(chunk, 0);
+    return(NULL);
+  }
+  job->chunk = chunk;
+  chunk->job = job;
+  return(job);
+}
+
+/* a reader waits for a chunk being loaded in background (lock held,
+   released if loaded here): its job is taken back from the queue and
+   run now, else its transfer gets the priority of a read.
+   returns true if loaded here */
+int cache_urge(Chunk *chunk) {
+  CacheJob *job = (CacheJob*)chunk->job;
+  int ok;
+
+  sched_raise(&(chunk->prio), SCHED_DEMAND);
+  if ((job == NULL)||(!sched_take(job)))
+    return(0);
+  mylog("cache_urge: load chunk %u-%u now\n", chunk->off_start, chunk->off_end);
+  chunk->job = NULL;
+  pthread_mutex_unlock(&cache_lock);
+  ok = cache_load(&(job->cnx), chunk);
+  cache_cnx_free(&(job->cnx));
+  free(job);
+  pthread_mutex_lock(&cache_lock);
+  cache_loaded(chunk, ok);
   return(1);
 }
 
+/* number of chunks being loaded in background */
+int cache_background(Cache *cache) {
+  int i, nb=0;
+
+  for(i=0; i<CACHE_MAX_CHUNK; i++)
+    if ((cache->chunks[i] != NULL)&&(cache->chunks[i]->state == CHUNK_PENDING)&&
+        (cache->chunks[i]->prio != SCHED_DEMAND))
+      nb++;
+  return(nb);
+}
+
+/* a read at 'offset' does not follow the previous one: cancel the
+   background loads (readahead, prefetch) of chunks out of the new
+   window */
+void cache_seek(Cache *cache, unsigned int offset) {
+  unsigned int end;
+  Chunk *c;
+  int i;
+
+  end = offset+(cache_readahead+1)*cache->chunksize;
+  for(i=0; i<CACHE_MAX_CHUNK; i++) {
+    c = cache->chunks[i];
+    if ((c == NULL)||(c->state != CHUNK_PENDING)||(c->prio == SCHED_DEMAND))
+      continue;
+    if ((c->off_end < offset)||(c->off_start >= end)) {
+      mylog("cache_seek(%p, %u): cancel %s %u-%u\n", cache, offset,
+            (c->prio == SCHED_READAHEAD)?"readahead":"prefetch",
+            c->off_start, c->off_end);
+      __atomic_store_n(&(c->cancel), 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* sequential reader: load in background the chunks following the read
+   at 'offset', up to cache_readahead chunks ahead (lock held) */
+void cache_ahead(Cache *cache, unsigned int offset) {
+  unsigned int off;
+  CacheJob *job;
+  Chunk *c;
+  int i, nb;
+
+  if ((cache_readahead <= 0)||(cache->score < CACHE_ADAPT_SCORE))
+    return;
+  off = cache->next_off;
+  for(i=0; (i<cache_readahead)&&(off < cache->size); i++) {
+    /* already there, or coming */
+    if ((cache->firstblock != NULL)&&(off < cache->firstblocksize)) {
+      off = cache->firstblocksize;
+      continue;
+    }
+    c = cache_chunk_at(cache, off);
+    if (c != NULL) {
+      off = c->off_end+1;
+      continue;
+    }
+    /* keep a chunk for the reader */
+    if (cache_background(cache) >= cache_chunks-1)
+      break;
+    cache_adapt(cache);
+    nb = cache_chunk_slot(cache, off, offset, SCHED_READAHEAD);
+    if (nb < 0)
+      break;
+    c = cache->chunks[nb];
+    off = c->off_end+1;
+    if (c->state == CHUNK_READY)
+      continue;  /* was kept compressed */
+    job = cache_job_new(cache, c);
+    if (job == NULL)
+      break;
+    if (!sched_queue(SCHED_READAHEAD, cache_job, job)) {
+      /* no workers */
+      cache_loaded(c, 0);
+      cache_cnx_free(&(job->cnx));
+      free(job);
+      break;
+    }
+  }
+}
+
+/* record a read range in the cache access profile. Ranges are kept
+   sorted and merged. If there are too many the two closest ones are
+   merged together */
+void cache_record(Cache *cache, unsigned int offset, unsigned int size) {
+  Range tmp[CACHE_MAX_RANGE+1];
+  unsigned int end, gap, bgap;
+  int i, j, nb, best;
+
+  if (size == 0)
+    return;
+  /* insert the new range at its place */
+  j = 0;
+  for(i=0; i<cache->nb_ranges; i++) {
+    if ((j == i)&&(cache->ranges[i].offset > offset)) {
+      tmp[j].offset = offset;
+      tmp[j++].size = size;
+    }
+    tmp[j++] = cache->ranges[i];
+  }
+  if (j == i) {
+    tmp[j].offset = offset;
+    tmp[j++].size = size;
+  }
+  /* merge overlapping or contiguous ranges */
+  nb = 0;
+  for(i=0; i<j; i++) {
+    if ((nb > 0)&&(tmp[i].offset <= tmp[nb-1].offset+tmp[nb-1].size)) {
+      end = tmp[i].offset+tmp[i].size;
+      if (end > tmp[nb-1].offset+tmp[nb-1].size)
+        tmp[nb-1].size = end-tmp[nb-1].offset;
+    } else {
+      tmp[nb++] = tmp[i];
+    }
+  }
+  /* too many: merge the two closest ones */
+  if (nb > CACHE_MAX_RANGE) {
+    best = 0;
+    bgap = (unsigned int)-1;
+    for(i=0; i<nb-1; i++) {
+      gap = tmp[i+1].offset-(tmp[i].offset+tmp[i].size);
+      if (gap < bgap) {
+        bgap = gap;
+	best = i;
+      }
+    }
+    tmp[best].size = tmp[best+1].offset+tmp[best+1].size-tmp[best].offset;
+    for(i=best+1; i<nb-1; i++)
+      tmp[i] = tmp[i+1];
+    nb--;
+  }
+  memcpy(cache->ranges, tmp, sizeof(Range)*nb);
+  cache->nb_ranges = nb;
+}
+
+/* copy the ranges read through the cache of a file (access profile)
+   in 'dest' (CACHE_MAX_RANGE max). returns their number (0: no cache) */
+int cache_ranges(const char *file, Range *dest) {
+  Cache *cache;
+  int nb=0;
+
+  pthread_mutex_lock(&cache_lock);
+  cache = cache_search(file);
+  if (cache != NULL) {
+    nb = cache->nb_ranges;
+    memcpy(dest, cache->ranges, sizeof(Range)*nb);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return(nb);
+}
+
+/* load chunks covering the given ranges of file in background (at
+   open, no wait). Limited by the number of chunks of the cache (one is
+   kept for reads). returns the number of chunks queued (0: no cache) */
+int cache_prefetch(const char *file, Range *ranges, int nb) {
+  CacheJob *jobs[CACHE_MAX_CHUNK];
+  Cache *cache;
+  unsigned int off, end;
+  int i, n=0, queued=0, slot=0, max;
+
+  mylog("cache_prefetch(%s, %p, %d)\n", file, ranges, nb);
+  if (nb <= 0)
+    return(0);
+  max = MAX(cache_chunks-1, 1);
+  pthread_mutex_lock(&cache_lock);
+  /* the cache may have been freed since the open */
+  cache = cache_search(file);
+  if (cache == NULL) {
+    pthread_mutex_unlock(&cache_lock);
+    return(0);
+  }
+  /* the cache may be removed while data is uncompressed (slot -3) */
+  for(i=0; (i<nb)&&(n<max)&&(slot != -3); i++) {
+    off = ranges[i].offset;
+    end = MIN(ranges[i].offset+ranges[i].size, cache->size);
+    /* skip what is in firstblock */
+    if ((cache->firstblock != NULL)&&(off < cache->firstblocksize))
+      off = cache->firstblocksize;
+    while((off < end)&&(n < max)) {
+      slot = cache_chunk_slot(cache, off, 0, SCHED_PREFETCH);
+      if (slot < 0)
+        break;
+      off = cache->chunks[slot]->off_end+1;
+      if (cache->chunks[slot]->state == CHUNK_READY)
+        continue;  /* was kept compressed */
+      jobs[n] = cache_job_new(cache, cache->chunks[slot]);
+      if (jobs[n] != NULL)
+        n++;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  /* no workers: dropped (not loaded here, the open would wait) */
+  for(i=0; i<n; i++) {
+    if (sched_queue(SCHED_PREFETCH, cache_job, jobs[i])) {
+      queued++;
+      continue;
+    }
+    pthread_mutex_lock(&cache_lock);
+    cache_loaded(jobs[i]->chunk, 0);
+    pthread_mutex_unlock(&cache_lock);
+    cache_cnx_free(&(jobs[i]->cnx));
+    free(jobs[i]);
+  }
+  mylog("cache_prefetch: %d chunks queued\n", queued);
+  return(queued);
+}
+
 /* read data for file in cache. data is directly put in 'dest', which
    *must* be allocated
    returns the number of bytes moved (can be less that requested in
@@ -395,8 +1216,10 @@ int cache_fetch_data(Cache *cache, unsigned int offset) {
 int cache_read(unsigned int fsize, const char *file, unsigned int offset,
                unsigned int size, char *dest) {
   Cache *cache;
+  Chunk *chunk;
   char *data;
   unsigned int rsize;
+  int res, ret=-EBUSY, first=1, tries=0;
   
   
   mylog("cache_read(%u, %s, %u, %u, %p)\n", fsize, file, offset, size, dest);
@@ -407,61 +1230,98 @@ int cache_read(unsigned int fsize, const char *file, unsigned int offset,
   if (offset >= fsize)
     return(0);  /* request is after end of file */
   
-  /* search cache */
-  cache = cache_search(file);
+  pthread_mutex_lock(&cache_lock);
+  while(1) {
+    /* search cache (again: it may be removed while loading) */
+    cache = cache_search(file);
   
-  mylog("cache_read: found (or not) cache %p for %s\n", cache, file);
-  if (cache == NULL) {
-    /* create one */
-    cache = cache_create(file, fsize);
-    
-  mylog("cache_read: created cache %p\n");
+    mylog("cache_read: found (or not) cache %p for %s\n", cache, file);
+    /* being created by another thread: wait for it */
+    if ((cache == NULL)&&(cache_setting_up(file))) {
+      pthread_cond_wait(&cache_cond, &cache_lock);
+      continue;
+    }
     if (cache == NULL) {
-      /* should not happen */
-      return(-EBUSY);
+      /* create one */
+      cache = cache_new(file, NULL, 0, fsize);
+    
+    mylog("cache_read: created cache %p\n", cache);
+      if (cache == NULL) {
+        /* should not happen */
+        break;
+      }
     }
-  }
   
-  /* update last access */
-  cache->last_use = (unsigned int)time(NULL);
+    /* update last access */
+    cache->last_use = (unsigned int)time(NULL);
   
-  /* cut size if too big */
-  if (offset+size > cache->size) {
-  mylog("cache_read: end after EOF. Trunking. %u + %u > %u\n", offset, size, cache->size);
-    size -= offset+size - cache->size;
-  }
+    /* cut size if too big */
+    if (offset+size > cache->size) {
+    mylog("cache_read: end after EOF. Trunking. %u + %u > %u\n", offset, size, cache->size);
+      size -= offset+size - cache->size;
+    }
   
-  /* check if data is in cache */
-  data = cache_search_data(cache, offset, size, &rsize);
-  mylog("cache_read: (1) cache_search_data(%p, %u, %u, -) returns %p (%u)\n",
-        cache, offset, size, data, rsize);
-  if (data != NULL) {
-    /* copy data */
+    if (first) {
+      /* access pattern, for chunk size and readahead */
+      if (offset != cache->next_off)
+        cache_seek(cache, offset);
+      cache_pattern(cache, offset);
+    }
+
+    /* check if data is in cache */
+    data = cache_search_data(cache, offset, size, &rsize);
+    mylog("cache_read: cache_search_data(%p, %u, %u, -) returns %p (%u)\n",
+          cache, offset, size, data, rsize);
+    if (data != NULL) {
+      if (first)
+        stats_add((rsize < size)?SC_PARTIAL:SC_HIT, 1);
+      /* copy data */
+    mylog("cache_read: memcpy(%p, %p, %u)\n", dest, data, rsize);
+      memcpy(dest, data, rsize);
+      cache_record(cache, offset, rsize);
+      cache->next_off = offset+rsize;
+      cache_ahead(cache, offset);
+      ret = rsize;
+      break;
+    }
     
-  mylog("cache_read: memcpy(%p, %p, %u)\n", dest, data, rsize);
-    memcpy(dest, data, rsize);
-    return(rsize);
-  }
-  
-  /* no match. we need to fetch data in cache before */
-  mylog("cache_read: cache_fetch(%p, %u)\n", cache, offset);
-  if (!cache_fetch_data(cache, offset)) {
-    mylog("cache_read: cache_fetch failed!\n");
-    return(-EBUSY);
-  }
-  
-  /* re-search for the data */
-  data = cache_search_data(cache, offset, size, &rsize);
-  mylog("cache_read: (2) cache_search_data(%p, %u, %u, -) returns %p (%u)\n",
-        cache, offset, size, data, rsize);
-  if (data != NULL) {
-    /* copy data */
-  mylog("cache_read: memcpy(%p, %p, %u)\n", dest, data, rsize);
-    memcpy(dest, data, rsize);
-    return(rsize);
+    /* no match. we need to fetch data in cache before */
+    if (first)
+      stats_add(SC_MISS, 1);
+    first = 0;
+    /* being loaded in background: wait for it */
+    chunk = cache_chunk_at(cache, offset);
+    if ((chunk != NULL)&&(chunk->state == CHUNK_PENDING)) {
+      /* loaded ahead: needed now */
+      if ((chunk->prio != SCHED_DEMAND)&&(cache_urge(chunk)))
+        continue;
+      mylog("cache_read: waiting for chunk %u-%u\n", chunk->off_start, chunk->off_end);
+      pthread_cond_wait(&cache_cond, &cache_lock);
+      continue;
+    }
+    /* large random read: no copy through a chunk (the cache may be
+       removed during the transfer, update it before) */
+    if ((chunk == NULL)&&(size >= cache->chunksize)&&(cache->score <= 0)) {
+      cache_record(cache, offset, size);
+      cache->next_off = offset+size;
+      res = cache_direct(cache, offset, size, dest);
+      if (res > 0) {
+        stats_add(SC_DIRECT, 1);
+        ret = res;
+      }
+      break;
+    }
+    mylog("cache_read: cache_fetch(%p, %u)\n", cache, offset);
+    res = cache_fetch_data(cache, offset);
+    if (res == -1) {
+      /* all chunks being loaded */
+      pthread_cond_wait(&cache_cond, &cache_lock);
+    } else if ((res == 0)||((res == -2)&&(++tries >= CACHE_TRIES))) {
+      mylogl(MYLOG_WARN, "cache_read: cache_fetch failed!\n");
+      break;
+    }
+    /* re-search for the data */
   }
-  /* hmmm... something is very bad... */
-  return(-EBUSY);
+  pthread_mutex_unlock(&cache_lock);
+  return(ret);
 }
-
-
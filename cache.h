@@ -14,7 +14,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
 
+#include "ztier.h"
 
 
 /* this size is the data-content of a HTTP download.
@@ -25,35 +27,73 @@
 
 /* global settings for caches */
 #define CACHE_MAX_CHUNK 8    /* number of chunk is <= to this value */
-extern int cache_chunksize;  /* size of each chunk (max) */
+extern int cache_chunksize;  /* initial size of each chunk */
 extern int cache_chunks;     /* number of chunks per cache */
 
+/* chunk size is adapted per cache to the access pattern (grows on
+   sequential reads, shrinks on random reads) within these bounds */
+#define CACHE_CHUNK_MIN (4096*4)
+#define CACHE_CHUNK_MAX (CACHE_BLOCK*8*16)
+extern int cache_chunksize_min;
+extern int cache_chunksize_max;
+/* simulated network (0: none): delay added to each request (us) and
+   max bandwidth shared by all requests (bytes/s) */
+extern int cache_latency;
+extern int cache_bandwidth;
+/* score (sequential reads minus random reads) needed to change size */
+#define CACHE_ADAPT_SCORE 2
+/* chunks loaded in background ahead of a sequential reader (0: none,
+   at most cache_chunks-1) */
+extern int cache_readahead;
+
 
 /* type of connection */
 #define CNX_NDEF 0
 #define CNX_URL  1
-#define CNX_FILE 2  /* this one is for test purpose */
+#define CNX_FILE 2  /* local file (file:// URL), for tests and benchmarks */
 
 /* structure of a "connection" (URL or FILE) */
 typedef struct {
   char *target;  /* file name (full) or URL */
   int type;      /* _URL or _FILE */
   void *data;    /* data for handler (i.e. CURL) */
-  int idata;     /* same */
+  int idata;     /* same (file descriptor for _FILE) */
 }Connection;
 
-/* TODO:
-   configuration should allow to deal with multiple webservers
-   so the cache and/or the main program should be aware of what
-   part of data are requested, and what URL should be used for
-   that (and maybe which CURL options...)
+/* several webservers with the same content (mirrors) are handled
+   by webget: 'target' is the URL on the base server, and each request
+   is sent to one of the mirrors (see mirror.h).
+   TODO: servers with different parts of data (what URL should be used
+   for what part, and maybe which CURL options...)
 */
 
+/* a byte range in a file */
+typedef struct {
+  unsigned int offset;
+  unsigned int size;
+}Range;
+
+/* max number of distinct ranges recorded for a cache (access profile) */
+#define CACHE_MAX_RANGE 16
+
+/* states of a chunk. Data of a chunk being loaded is not used, and
+   the chunk is not re-used, until its transfer is done */
+#define CHUNK_READY   0  /* data loaded */
+#define CHUNK_PENDING 1  /* being loaded (or its data compressed or
+                            uncompressed, lock released) */
+#define CHUNK_ORPHAN  2  /* being loaded for a removed cache (freed by
+                            its loader) */
+
 /* structure of a cache chunk */
 typedef struct {
   unsigned int off_start;  /* offset of 1st byte in cache */
   unsigned int off_end;    /* offset of last byte in cache */
   char *data;              /* data in cache, size=last-first+1 */
+  unsigned int size;       /* allocated size of data */
+  int state;               /* CHUNK_* */
+  int prio;                /* priority of its transfer (SCHED_*) */
+  void *job;               /* its background job, while maybe queued */
+  int cancel;              /* set to stop its transfer */
 }Chunk;
 
 /* structure of a cache */
@@ -71,13 +111,26 @@ typedef struct {
     (copy of chunk content) */
   unsigned int firstblocksize;
   Chunk *chunks[CACHE_MAX_CHUNK]; /* list of pointers to chunks (or NULL) */
+  ZChunk *zchunks;    /* dropped chunks kept compressed (see ztier.h) */
+  /* being set up (connection opened without the lock): number of this
+     set up, 0 when ready. Not used (nor found) until ready */
+  unsigned int setup;
+  /* access pattern, to adapt chunk size */
+  unsigned int chunksize; /* size of new chunks for this cache */
+  unsigned int next_off;  /* offset following the last read */
+  int score;              /* >0: sequential reads, <0: random reads */
+  /* byte ranges read through this cache (merged, sorted by offset) */
+  int nb_ranges;
+  Range ranges[CACHE_MAX_RANGE];
 }Cache;
 
 
 #define CACHE_MAX 16  /* max 16 simultaneous caches */
 
-/* table of cache(s). Unused one have name=NULL */
+/* table of cache(s). Unused one have name=NULL. Caches and chunks are
+   protected by a lock, released during transfers */
 extern Cache caches[CACHE_MAX];
+extern pthread_mutex_t cache_lock;
 
 
 
@@ -89,13 +142,24 @@ int cache_init();
 /* to be called last. destroy all caches */
 int cache_fini();
 
-/* freed content of a cache */
+/* freed content of a cache (lock held) */
 void cache_free(Cache *cache);
 
-/* create a new cache for given file.
-   returns true if created, false else
+/* name of 'file' for the backend: path of the local file, or encoded
+   URL. returns a new string (length in 'lng'), or NULL if failed */
+char *cache_target(const char *file, unsigned int *lng);
+
+/* create a new cache for given file. 'target' (length 'lng') is its
+   name for the backend (see cache_target), NULL to compute it.
+   returns the cache, or NULL if failed (errno ENOENT if the file does
+   not exist on server, EIO if the server failed, EAGAIN if it is down
+   and was not asked)
    can destroy an other one if no place available */
-Cache *cache_create(const char *file, unsigned int size);
+Cache *cache_create(const char *file, const char *target, unsigned int lng,
+                    unsigned int size);
+
+/* search a cache by name */
+Cache *cache_search(const char *file);
 
 /* destroy a cache */
 int cache_destroy(const char *file);
@@ -110,6 +174,19 @@ int cache_destroy_all();
 int cache_read(unsigned int fsize, const char *file, unsigned int offset,
                unsigned int size,  char *dest);
 
+/* wait so that a request started at 'start' (stats_now) and moving
+   'bytes' follows cache_latency and cache_bandwidth */
+void cache_throttle(unsigned int bytes, unsigned long long start);
+
+/* copy the ranges read through the cache of a file (access profile)
+   in 'dest' (CACHE_MAX_RANGE max). returns their number (0: no cache) */
+int cache_ranges(const char *file, Range *dest);
+
+/* load chunks covering the given ranges of file in background (at
+   open, no wait). Limited by the number of chunks of the cache.
+   returns the number of chunks queued (0: no cache or no workers) */
+int cache_prefetch(const char *file, Range *ranges, int nb);
+
 
 #endif /* __cache_h_ */
 
@@ -1,10 +1,17 @@
 #!/bin/sh
 
 BIN=webfs
-SOURCE="webfs.c tree.c tools.c cache.c webget.c"
+SOURCE="webfs.c tree.c tools.c cache.c webget.c profile.c stats.c record.c fileget.c mirror.c sched.c pool.c ztier.c"
+
+# static trace points, if available (see probe.h)
+FLAGS=""
+if [ -f /usr/include/sys/sdt.h ]
+then
+  FLAGS="-DHAVE_SDT"
+fi
 
 compil() {
-  CMD="gcc -g -D_FILE_OFFSET_BITS=64 -O2 -Wall -o $BIN $SOURCE -lfuse -lcurl"
+  CMD="gcc -g -D_FILE_OFFSET_BITS=64 -O2 -Wall $FLAGS -o $BIN $SOURCE -lfuse -lcurl -lpthread -lz"
   
   echo "Exec: $CMD"
   $CMD
@@ -0,0 +1,98 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "fileget.h"
+#include "tools.h"
+#include "stats.h"
+#include "probe.h"
+
+
+/* local file backend: the tree is read from a local directory with
+   pread(). Used to run webfs and benchmarks without HTTP server */
+
+
+/* true if URL is for the local file backend */
+int fget_is_local(const char *url) {
+  return(strncmp(url, FGET_PREFIX, strlen(FGET_PREFIX)) == 0);
+}
+
+/* read exactly 'size' bytes (or up to end of file). returns bytes
+   read or -errno */
+static int fget_pread(int fd, char *dest, unsigned int size,
+                      unsigned int offset) {
+  unsigned int done=0;
+  ssize_t r;
+
+  while(done < size) {
+    r = pread(fd, dest+done, size-done, (off_t)offset+done);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return(-errno);
+    }
+    if (r == 0)
+      break;
+    done += r;
+  }
+  return((int)done);
+}
+
+/* open the local file 'path' and read its first 'size' bytes in
+   'firstblock' (if not NULL). returns 1 if ok, 0 if failed (errno
+   set), -1 if the file does not exist */
+int fget_connect(char *path, Connection *cnx, char *firstblock, unsigned int size) {
+  unsigned long long start;
+  int fd, r;
+
+  mylog("fget_connect(%s, %p)\n", path, cnx);
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    mylog("fget_connect: open failed (%d)\n", errno);
+    return((errno == ENOENT)?-1:0);
+  }
+  if (firstblock != NULL) {
+    start = stats_now();
+    r = fget_pread(fd, firstblock, size, 0);
+    stats_since(ST_FETCH, start);
+    if (r < (int)size) {
+      stats_add(SC_FETCH_ERR, 1);
+      close(fd);
+      errno = (r < 0)?-r:EIO;
+      return(0);
+    }
+    stats_add(SC_FETCH_DATA, size);
+  }
+  cnx->idata = fd;
+  return(1);
+}
+
+/* close the file */
+int fget_disconnect(Connection *cnx) {
+  if (cnx->idata >= 0)
+    close(cnx->idata);
+  cnx->idata = -1;
+  return(1);
+}
+
+/* read data from the file */
+int fget_read(Connection *cnx, unsigned int offset, unsigned int size,
+              char *dest) {
+  unsigned long long start;
+  int r;
+
+  PROBE3(fetch_start, cnx->target, offset, size);
+  start = stats_now();
+  r = fget_pread(cnx->idata, dest, size, offset);
+  stats_since(ST_FETCH, start);
+  PROBE4(fetch_done, cnx->target, offset, (r > 0)?r:0, (r < 0)?-r:0);
+  mylog("fget_read(%s, %u, %u) = %d\n", cnx->target, offset, size, r);
+
+  /* as with HTTP, a short read is an error (file changed) */
+  if (r != (int)size) {
+    stats_add(SC_FETCH_ERR, 1);
+    return((r < 0)?r:-EIO);
+  }
+  stats_add(SC_FETCH_DATA, size);
+  return(r);
+}
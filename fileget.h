@@ -0,0 +1,32 @@
+#ifndef __fileget_h_
+#define __fileget_h_
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+
+/* prefix of URLs served by the local file backend. The rest of the
+   URL is a local directory used as the root of the tree */
+#define FGET_PREFIX "file://"
+
+
+/* true if URL is for the local file backend */
+int fget_is_local(const char *url);
+
+/* open the local file 'path' and read its first 'size' bytes in
+   'firstblock' (if not NULL). returns 1 if ok, 0 if failed (errno
+   set), -1 if the file does not exist */
+int fget_connect(char *path, Connection *cnx, char *firstblock, unsigned int size);
+
+/* close the file */
+int fget_disconnect(Connection *cnx);
+
+/* read data from the file */
+int fget_read(Connection *cnx, unsigned int offset, unsigned int size, char *dest);
+
+
+#endif /* __fileget_h_ */
@@ -0,0 +1,358 @@
+#include <pthread.h>
+
+#include "mirror.h"
+#include "tools.h"
+#include "stats.h"
+
+
+/* mirror selection: each mirror keeps an EWMA of its latency (time to
+   first byte) and throughput. A request goes to the best of two
+   mirrors taken at random (power of two choices), the cost being the
+   expected duration of the request times the requests in flight +1.
+   A mirror is ejected after MIRROR_FAILS failures in a row, or when
+   much slower than the best one. Once its ejection time is over, a
+   single request is sent to it as a probe: it comes back if the probe
+   succeeds, else it is ejected again for twice longer.
+   When all mirrors failed MIRROR_FAILS times in a row, the origin is
+   considered down (circuit breaker): requests fail at once without
+   being sent, and after a delay a single one is let through as a
+   probe, the delay doubling each time the probe fails */
+
+#define MIRROR_ALPHA  0.2      /* weight of a new sample in EWMAs */
+#define MIRROR_FAILS  3        /* failures in a row before ejection */
+#define MIRROR_SLOW   4        /* ejected if that slower than the best */
+#define MIRROR_SLOW_MIN 5000   /* ... and latency above this (us) */
+#define MIRROR_SAMPLES 10      /* ... and enough requests measured */
+#define MIRROR_EJECT  5000000ULL   /* first ejection (us) */
+#define MIRROR_EJECT_MAX 60000000ULL  /* max ejection (us) */
+#define MIRROR_BREAK  1000000ULL      /* first break of all requests (us) */
+#define MIRROR_BREAK_MAX 30000000ULL  /* max break (us) */
+
+typedef struct {
+  char *base;          /* base URL */
+  double lat;          /* EWMA of time to first byte (us) */
+  double rate;         /* EWMA of throughput (bytes/s, 0: unknown) */
+  unsigned int samples;   /* requests measured */
+  unsigned int inflight;  /* requests running */
+  unsigned int fails;     /* failures in a row */
+  unsigned int ejections; /* ejections in a row (probes failed) */
+  unsigned long long until;  /* ejected until (stats_now), 0: active */
+  int probing;            /* probe request running */
+  unsigned long long requests, errors;
+}Mirror;
+
+Mirror mirrors[MIRROR_MAX];
+int nb_mirrors = 0;
+static unsigned int mirror_seed = 1;
+static pthread_mutex_t mirror_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* circuit breaker: requests refused until 'break_until' (0: closed),
+   then a probe is sent (date in 'break_probe') */
+static unsigned long long break_until = 0;
+static unsigned long long break_probe = 0;
+static unsigned int break_trips = 0;  /* probes failed in a row +1 */
+
+
+/* add a mirror */
+static int mirror_add(const char *base, int lng) {
+  Mirror *m;
+
+  if (nb_mirrors >= MIRROR_MAX) {
+    mylogl(MYLOG_ERROR, "mirror_add: too many mirrors (max %d)\n", MIRROR_MAX);
+    return(0);
+  }
+  m = &(mirrors[nb_mirrors]);
+  memset(m, 0, sizeof(Mirror));
+  m->base = malloc(lng+1);
+  if (m->base == NULL)
+    return(0);
+  memcpy(m->base, base, lng);
+  m->base[lng] = '\0';
+  nb_mirrors++;
+  return(1);
+}
+
+/* set mirrors: 'base' (the base URL) and a comma separated list of
+   other base URLs (NULL if none) */
+int mirror_init(const char *base, const char *list) {
+  const char *end;
+
+  mirror_fini();
+  if (!mirror_add(base, strlen(base)))
+    return(0);
+  while((list != NULL)&&(*list != '\0')) {
+    end = strchr(list, ',');
+    if (end == NULL)
+      end = list+strlen(list);
+    if ((end > list)&&(!mirror_add(list, end-list)))
+      return(0);
+    list = (*end == ',')?end+1:end;
+  }
+  mirror_seed = (unsigned int)stats_now();
+  return(1);
+}
+
+/* remove mirrors */
+void mirror_fini() {
+  int i;
+
+  for(i=0; i<nb_mirrors; i++)
+    free(mirrors[i].base);
+  nb_mirrors = 0;
+}
+
+/* number of mirrors (0 if not initialised) */
+int mirror_count() {
+  return(nb_mirrors);
+}
+
+/* expected cost of a request of 'size' bytes on a mirror (0 if never
+   measured, so that new mirrors are tried first) */
+static double mirror_cost(Mirror *m, unsigned int size) {
+  double t;
+
+  if (m->samples == 0)
+    return(0);
+  t = m->lat;
+  if (m->rate > 0)
+    t += size*1000000.0/m->rate;
+  return(t*(m->inflight+1));
+}
+
+/* choose a mirror for a request of 'size' bytes, if possible not
+   'avoid' (-1: any). returns mirror number (-1 if no mirrors) */
+int mirror_pick(unsigned int size, int avoid) {
+  unsigned long long now;
+  int cand[MIRROR_MAX], nb=0, i, a, b, m=-1;
+
+  if (nb_mirrors == 0)
+    return(-1);
+  if (nb_mirrors == 1)
+    m = 0;
+  pthread_mutex_lock(&mirror_lock);
+  now = stats_now();
+  /* ejected mirror to probe */
+  for(i=0; (m < 0)&&(i<nb_mirrors); i++) {
+    if ((mirrors[i].until > 0)&&(!mirrors[i].probing)&&
+        (now >= mirrors[i].until)&&(i != avoid)) {
+      mirrors[i].probing = 1;
+      m = i;
+      mylogl(MYLOG_INFO, "mirror_pick: probing %s\n", mirrors[i].base);
+    }
+  }
+  if (m < 0) {
+    for(i=0; i<nb_mirrors; i++)
+      if ((mirrors[i].until == 0)&&(i != avoid))
+        cand[nb++] = i;
+    if (nb == 0) {
+      /* only 'avoid' or ejected ones: the first back in */
+      for(i=0; i<nb_mirrors; i++)
+        if ((mirrors[i].until == 0)||(m < 0)||
+            ((mirrors[m].until > 0)&&(mirrors[i].until < mirrors[m].until)))
+          m = i;
+    } else if (nb == 1) {
+      m = cand[0];
+    } else {
+      /* power of two choices */
+      a = rand_r(&mirror_seed) % nb;
+      b = rand_r(&mirror_seed) % (nb-1);
+      if (b >= a)
+        b++;
+      a = cand[a];
+      b = cand[b];
+      m = (mirror_cost(&(mirrors[b]), size) < mirror_cost(&(mirrors[a]), size))?b:a;
+    }
+  }
+  mirrors[m].inflight++;
+  mirrors[m].requests++;
+  pthread_mutex_unlock(&mirror_lock);
+  return(m);
+}
+
+/* URL of 'target' (an URL on the base URL) on mirror 'm'. returns dest */
+char *mirror_url(int m, const char *target, char *dest) {
+  int lng;
+
+  if ((m <= 0)||(m >= nb_mirrors)) {
+    snprintf(dest, MIRROR_URL, "%s", target);
+    return(dest);
+  }
+  lng = strlen(mirrors[0].base);
+  if (strncmp(target, mirrors[0].base, lng) != 0)
+    snprintf(dest, MIRROR_URL, "%s", target);
+  else
+    snprintf(dest, MIRROR_URL, "%s%s", mirrors[m].base, target+lng);
+  return(dest);
+}
+
+/* eject a mirror (lock held) */
+static void mirror_eject(Mirror *m, const char *why) {
+  unsigned long long delay;
+
+  delay = MIRROR_EJECT << MIN(m->ejections, 4);
+  if (delay > MIRROR_EJECT_MAX)
+    delay = MIRROR_EJECT_MAX;
+  m->ejections++;
+  m->until = stats_now()+delay;
+  m->probing = 0;
+  mylogl(MYLOG_WARN, "mirror %s ejected for %llu s (%s)\n", m->base,
+         delay/1000000, why);
+}
+
+/* open the circuit breaker if all mirrors are failing (lock held) */
+static void mirror_break() {
+  unsigned long long delay;
+  int i;
+
+  if ((break_until > 0)&&(break_probe == 0))
+    return;  /* already open, no probe running */
+  for(i=0; i<nb_mirrors; i++)
+    if (mirrors[i].fails < MIRROR_FAILS)
+      return;
+  delay = MIRROR_BREAK << MIN(break_trips, 5);
+  if (delay > MIRROR_BREAK_MAX)
+    delay = MIRROR_BREAK_MAX;
+  break_trips++;
+  __atomic_store_n(&break_until, stats_now()+delay, __ATOMIC_RELAXED);
+  break_probe = 0;
+  mylogl(MYLOG_WARN, "mirror_break: server down, requests refused for %llu ms\n",
+         delay/1000);
+}
+
+/* true if a request can be sent (circuit breaker closed, or the caller
+   sends the probe), false if it must fail at once */
+int mirror_allow() {
+  unsigned long long now;
+  int ok=1;
+
+  if (__atomic_load_n(&break_until, __ATOMIC_RELAXED) == 0)
+    return(1);
+  pthread_mutex_lock(&mirror_lock);
+  now = stats_now();
+  if (break_until > 0) {
+    /* time for a probe (another one if the previous got no answer) */
+    if ((now >= break_until)&&
+        ((break_probe == 0)||(now-break_probe > MIRROR_BREAK_MAX))) {
+      break_probe = now;
+      mylogl(MYLOG_INFO, "mirror_allow: probing server\n");
+    } else {
+      ok = 0;
+    }
+  }
+  pthread_mutex_unlock(&mirror_lock);
+  if (!ok)
+    stats_add(SC_BREAKER, 1);
+  return(ok);
+}
+
+/* true if 'm' is much slower than the best other active mirror */
+static int mirror_slow(Mirror *m) {
+  double best=-1;
+  int i;
+
+  if ((m->samples < MIRROR_SAMPLES)||(m->lat < MIRROR_SLOW_MIN))
+    return(0);
+  for(i=0; i<nb_mirrors; i++) {
+    if ((&(mirrors[i]) == m)||(mirrors[i].until > 0)||(mirrors[i].samples == 0))
+      continue;
+    if ((best < 0)||(mirrors[i].lat < best))
+      best = mirrors[i].lat;
+  }
+  return((best >= 0)&&(m->lat > best*MIRROR_SLOW));
+}
+
+/* result of a request on mirror 'm': time to first byte and total
+   duration (us), bytes received */
+void mirror_done(int m, int result, unsigned long long ttfb,
+                 unsigned long long total, unsigned int bytes) {
+  Mirror *mr;
+  double rate=0;
+
+  if ((m < 0)||(m >= nb_mirrors))
+    return;
+  mr = &(mirrors[m]);
+  pthread_mutex_lock(&mirror_lock);
+  if (mr->inflight > 0)
+    mr->inflight--;
+  /* the request was wrong, not the server: only a probe ends (another
+     one will be sent) */
+  if (result == MIRROR_ERROR) {
+    mr->errors++;
+    mr->probing = 0;
+    break_probe = 0;
+    pthread_mutex_unlock(&mirror_lock);
+    return;
+  }
+  if (result == MIRROR_FAIL) {
+    mr->errors++;
+    mr->fails++;
+    if ((nb_mirrors > 1)&&((mr->probing)||(mr->fails >= MIRROR_FAILS)))
+      mirror_eject(mr, mr->probing?"probe failed":"errors");
+    mirror_break();
+    pthread_mutex_unlock(&mirror_lock);
+    return;
+  }
+  /* an answer: origin is up */
+  if ((break_until > 0)&&(result == MIRROR_OK)) {
+    mylogl(MYLOG_WARN, "mirror_done: server answers again\n");
+    __atomic_store_n(&break_until, 0, __ATOMIC_RELAXED);
+    break_probe = 0;
+    break_trips = 0;
+  } else if (break_probe > 0) {
+    break_probe = 0;  /* probe cancelled: another one */
+  }
+  /* a cancelled request lasted at least 'total' */
+  if (result == MIRROR_CANCEL) {
+    if (total > mr->lat)
+      ttfb = total;
+    else
+      ttfb = (unsigned long long)mr->lat;
+    bytes = 0;
+  } else {
+    mr->fails = 0;
+  }
+  if ((bytes > 0)&&(total > ttfb))
+    rate = bytes*1000000.0/(total-ttfb);
+  if ((mr->samples == 0)||(mr->probing)) {
+    mr->lat = ttfb;
+    mr->rate = rate;
+  } else {
+    mr->lat += MIRROR_ALPHA*(ttfb-mr->lat);
+    if (rate > 0)
+      mr->rate = (mr->rate > 0)?mr->rate+MIRROR_ALPHA*(rate-mr->rate):rate;
+  }
+  mr->samples++;
+  if (mr->probing) {
+    if (result == MIRROR_CANCEL) {
+      mirror_eject(mr, "probe too slow");
+    } else {
+      mylogl(MYLOG_WARN, "mirror %s back in use\n", mr->base);
+      mr->until = 0;
+      mr->ejections = 0;
+      mr->probing = 0;
+      mr->samples = 1;
+    }
+  } else if ((mr->until == 0)&&(nb_mirrors > 1)&&(mirror_slow(mr))) {
+    mirror_eject(mr, "slow");
+  }
+  pthread_mutex_unlock(&mirror_lock);
+}
+
+/* print state of mirrors in 'dest' (max 'size' bytes). returns length */
+int mirror_print(char *dest, int size) {
+  unsigned long long now;
+  int i, lng=0;
+
+  pthread_mutex_lock(&mirror_lock);
+  now = stats_now();
+  for(i=0; (i<nb_mirrors)&&(lng < size); i++) {
+    lng += snprintf(dest+lng, size-lng,
+                    "Mirror %d: %s, latency %.0f us, %.0f kB/s, %llu requests"
+                    " (%llu failed)%s\n", i, mirrors[i].base, mirrors[i].lat,
+                    mirrors[i].rate/1024, mirrors[i].requests, mirrors[i].errors,
+                    (mirrors[i].until > now)?", ejected":
+                    ((mirrors[i].until > 0)?", probing":""));
+  }
+  pthread_mutex_unlock(&mirror_lock);
+  return(MIN(lng, size-1));
+}
@@ -0,0 +1,58 @@
+#ifndef __mirror_h_
+#define __mirror_h_
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* mirrors: other servers with the same content as the base URL.
+   Requests are spread over them by measured latency and throughput
+   (see mirror.c). Mirror 0 is the base URL */
+
+/* max number of mirrors (base URL included) */
+#define MIRROR_MAX 8
+
+/* max length of a URL built for a mirror */
+#define MIRROR_URL 8448
+
+/* results of a request (mirror_done) */
+#define MIRROR_FAIL   0  /* failed */
+#define MIRROR_OK     1  /* data received */
+#define MIRROR_CANCEL 2  /* cancelled (other request answered first) */
+#define MIRROR_ERROR  3  /* refused (client error, bad reply): health
+                            of the mirror unchanged */
+
+
+/* set mirrors: 'base' (the base URL) and a comma separated list of
+   other base URLs (NULL if none) */
+int mirror_init(const char *base, const char *list);
+
+/* remove mirrors */
+void mirror_fini();
+
+/* number of mirrors (0 if not initialised) */
+int mirror_count();
+
+/* choose a mirror for a request of 'size' bytes, if possible not
+   'avoid' (-1: any). returns mirror number (-1 if no mirrors) */
+int mirror_pick(unsigned int size, int avoid);
+
+/* true if a request can be sent, false if it must fail at once (all
+   mirrors failing: circuit breaker open, see mirror.c) */
+int mirror_allow();
+
+/* URL of 'target' (an URL on the base URL) on mirror 'm'. returns dest */
+char *mirror_url(int m, const char *target, char *dest);
+
+/* result of a request on mirror 'm': time to first byte and total
+   duration (us), bytes received */
+void mirror_done(int m, int result, unsigned long long ttfb,
+                 unsigned long long total, unsigned int bytes);
+
+/* print state of mirrors in 'dest' (max 'size' bytes). returns length */
+int mirror_print(char *dest, int size);
+
+
+#endif /* __mirror_h_ */
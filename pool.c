@@ -0,0 +1,242 @@
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+#include "tools.h"
+#include "stats.h"
+
+
+/* a slab is mapped aligned on POOL_SLAB, so the slab of a buffer is
+   found from its address. Buffers larger than half a slab get a slab
+   of their own (a multiple of POOL_SLAB). A slab that gets empty is
+   kept for its class (one per class) or unmapped. Slabs of other
+   classes are unmapped first when mapping a new one would exceed the
+   budget */
+
+#define POOL_SHIFT 21  /* log2(POOL_SLAB) */
+#define POOL_PAGE 4096
+#define POOL_BUFS (POOL_SLAB/POOL_PAGE)  /* max buffers in a slab */
+#define POOL_CLASSES 76   /* up to 4 GB */
+#define POOL_HASH 256
+
+/* settings */
+unsigned long long pool_budget = 0;
+int pool_huge = 0;
+
+typedef struct PoolSlab {
+  char *base;
+  unsigned long len;      /* mapped length */
+  unsigned int bsize;     /* size of buffers */
+  int cls;                /* size class */
+  int nb, nfree;          /* buffers, free ones */
+  unsigned long long free[POOL_BUFS/64];  /* set bits: free buffers */
+  struct PoolSlab *next;  /* in its class */
+  struct PoolSlab *hnext; /* in hash table */
+}PoolSlab;
+
+/* slabs of each class */
+static PoolSlab *pool_classes[POOL_CLASSES];
+/* slabs by address */
+static PoolSlab *pool_hash[POOL_HASH];
+static unsigned long long pool_inuse = 0;   /* bytes of buffers given */
+static unsigned long long pool_mapped = 0;  /* bytes of slabs */
+
+
+/* size class of 'size' bytes: pages up to 4, then 4 steps per power
+   of two. returns the class, and its buffer size in 'bsize' */
+static int pool_class(unsigned int size, unsigned long *bsize) {
+  unsigned long s, p=4*POOL_PAGE, step;
+  int cls=4;
+
+  s = ((unsigned long)size+POOL_PAGE-1) & ~(unsigned long)(POOL_PAGE-1);
+  if (s <= p) {
+    *bsize = (s == 0)?POOL_PAGE:s;
+    return((int)(*bsize/POOL_PAGE)-1);
+  }
+  while(s > p*2) {
+    p *= 2;
+    cls += 4;
+  }
+  step = p/4;
+  *bsize = p + (s-p+step-1)/step*step;
+  return(cls + (int)((*bsize-p)/step) - 1);
+}
+
+static unsigned int pool_key(const char *addr) {
+  return((unsigned int)(((uintptr_t)addr >> POOL_SHIFT) % POOL_HASH));
+}
+
+/* unlink a slab from its class list */
+static void pool_unlink(PoolSlab *slab) {
+  PoolSlab **p;
+
+  for(p=&(pool_classes[slab->cls]); *p!=NULL; p=&((*p)->next))
+    if (*p == slab) {
+      *p = slab->next;
+      return;
+    }
+}
+
+/* unmap an empty slab */
+static void pool_unmap(PoolSlab *slab) {
+  PoolSlab **p;
+
+  pool_unlink(slab);
+  for(p=&(pool_hash[pool_key(slab->base)]); *p!=NULL; p=&((*p)->hnext))
+    if (*p == slab) {
+      *p = slab->hnext;
+      break;
+    }
+  munmap(slab->base, slab->len);
+  pool_mapped -= slab->len;
+  stats_gauge(SG_POOL_MAPPED, -(long long)slab->len);
+  stats_add(SC_POOL_RELEASED, slab->len);
+  free(slab);
+}
+
+/* unmap empty slabs of other classes than 'cls' until 'len' more
+   bytes can be mapped within the budget */
+static void pool_trim(int cls, unsigned long len) {
+  PoolSlab *slab;
+  int i;
+
+  for(i=0; (i<POOL_CLASSES)&&(pool_mapped+len > pool_budget); i++) {
+    if (i == cls)
+      continue;
+    slab = pool_classes[i];
+    while((slab != NULL)&&(slab->nfree < slab->nb))
+      slab = slab->next;
+    if (slab != NULL) {
+      pool_unmap(slab);
+      i--;  /* maybe another one */
+    }
+  }
+}
+
+/* map a new slab for class 'cls' (buffers of 'bsize' bytes) */
+static PoolSlab *pool_map(int cls, unsigned long bsize) {
+  PoolSlab *slab;
+  unsigned long len, head;
+  char *addr;
+  int i;
+
+  len = (bsize > POOL_SLAB/2)?
+          (bsize+POOL_SLAB-1) & ~(unsigned long)(POOL_SLAB-1) : POOL_SLAB;
+  if (pool_budget > 0)
+    pool_trim(cls, len);
+  slab = malloc(sizeof(PoolSlab));
+  if (slab == NULL)
+    return(NULL);
+  /* map more, to keep an aligned part */
+  addr = mmap(NULL, len+POOL_SLAB, PROT_READ|PROT_WRITE,
+              MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    mylogl(MYLOG_WARN, "pool_map: can't map %lu bytes\n", len);
+    free(slab);
+    return(NULL);
+  }
+  head = (POOL_SLAB - ((uintptr_t)addr & (POOL_SLAB-1))) & (POOL_SLAB-1);
+  if (head > 0)
+    munmap(addr, head);
+  munmap(addr+head+len, POOL_SLAB-head);
+  slab->base = addr+head;
+#ifdef MADV_HUGEPAGE
+  if (pool_huge)
+    madvise(slab->base, len, MADV_HUGEPAGE);
+#endif
+  slab->len = len;
+  slab->bsize = bsize;
+  slab->cls = cls;
+  slab->nb = (bsize > POOL_SLAB/2)?1:(int)(POOL_SLAB/bsize);
+  slab->nfree = slab->nb;
+  memset(slab->free, 0, sizeof(slab->free));
+  for(i=0; i<slab->nb; i++)
+    slab->free[i/64] |= 1ULL << (i%64);
+  slab->next = pool_classes[cls];
+  pool_classes[cls] = slab;
+  slab->hnext = pool_hash[pool_key(slab->base)];
+  pool_hash[pool_key(slab->base)] = slab;
+  pool_mapped += len;
+  stats_gauge(SG_POOL_MAPPED, len);
+  mylog("pool_map: slab %p, %d buffers of %lu\n", slab->base, slab->nb, bsize);
+  return(slab);
+}
+
+/* true if a buffer of 'size' bytes fits in the budget */
+int pool_fits(unsigned int size) {
+  unsigned long bsize;
+
+  if ((pool_budget == 0)||(pool_inuse == 0))
+    return(1);
+  pool_class(size, &bsize);
+  return(pool_inuse+bsize <= pool_budget);
+}
+
+/* get a buffer of at least 'size' bytes */
+char *pool_alloc(unsigned int size, unsigned int *real) {
+  PoolSlab *slab;
+  unsigned long bsize;
+  int cls, i, b;
+
+  cls = pool_class(size, &bsize);
+  if (cls >= POOL_CLASSES)
+    return(NULL);
+  slab = pool_classes[cls];
+  while((slab != NULL)&&(slab->nfree == 0))
+    slab = slab->next;
+  if (slab == NULL) {
+    slab = pool_map(cls, bsize);
+    if (slab == NULL)
+      return(NULL);
+  }
+  for(i=0; slab->free[i]==0; i++);
+  b = i*64 + __builtin_ctzll(slab->free[i]);
+  slab->free[i] &= ~(1ULL << (b%64));
+  slab->nfree--;
+  pool_inuse += bsize;
+  stats_gauge(SG_POOL_USED, bsize);
+  *real = bsize;
+  return(slab->base + (unsigned long)b*bsize);
+}
+
+/* give back a buffer */
+void pool_free(char *buf) {
+  PoolSlab *slab, *p;
+  int b;
+
+  if (buf == NULL)
+    return;
+  slab = pool_hash[pool_key(buf)];
+  while((slab != NULL)&&
+        (slab->base != (char*)((uintptr_t)buf & ~(uintptr_t)(POOL_SLAB-1))))
+    slab = slab->hnext;
+  if (slab == NULL) {
+    mylogl(MYLOG_ERROR, "pool_free: %p not in pool\n", buf);
+    return;
+  }
+  b = (int)((buf - slab->base)/slab->bsize);
+  slab->free[b/64] |= 1ULL << (b%64);
+  slab->nfree++;
+  pool_inuse -= slab->bsize;
+  stats_gauge(SG_POOL_USED, -(long long)slab->bsize);
+
+  if (slab->nfree == slab->nb) {
+    /* empty: keep one per class */
+    for(p=pool_classes[slab->cls]; p!=NULL; p=p->next)
+      if ((p != slab)&&(p->nfree == p->nb))
+        break;
+    if ((p != NULL)||(slab->nb == 1)) {
+      pool_unmap(slab);
+      return;
+    }
+  }
+  /* its memory can be taken back by the system (not with huge pages:
+     they would be split) */
+  if (pool_huge)
+    return;
+#ifdef MADV_FREE
+  if (madvise(buf, slab->bsize, MADV_FREE) != 0)
+#endif
+    madvise(buf, slab->bsize, MADV_DONTNEED);
+  stats_add(SC_POOL_RELEASED, slab->bsize);
+}
@@ -0,0 +1,38 @@
+#ifndef __pool_h_
+#define __pool_h_
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* buffer pool for data of caches (chunks and firstblocks): buffers are
+   taken from slabs of POOL_SLAB bytes holding buffers of a single size
+   class (4 classes per power of two: at most 25% lost), with a global
+   budget for all buffers. Memory of freed buffers is given back to the
+   system only if it needs it (MADV_FREE), and re-used at once else.
+   Not thread-safe: called with cache_lock held */
+
+/* size of a slab (and alignment, for huge pages) */
+#define POOL_SLAB (2*1024*1024)
+
+/* settings */
+extern unsigned long long pool_budget;  /* max bytes of buffers (0: no limit) */
+extern int pool_huge;                   /* back slabs with huge pages */
+
+
+/* true if a buffer of 'size' bytes fits in the budget (always true if
+   no buffer is in use) */
+int pool_fits(unsigned int size);
+
+/* get a buffer of at least 'size' bytes (its real size in 'real').
+   returns NULL if out of memory. The budget is not checked (see
+   pool_fits) */
+char *pool_alloc(unsigned int size, unsigned int *real);
+
+/* give back a buffer (NULL: nothing) */
+void pool_free(char *buf);
+
+
+#endif /* __pool_h_ */
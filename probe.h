@@ -0,0 +1,33 @@
+#ifndef __probe_h_
+#define __probe_h_
+
+
+/* static trace points (USDT), for perf/bpftrace/systemtap:
+     bpftrace -e 'usdt:./webfs:webfs:fetch_done { ... }'
+   compiled in only if HAVE_SDT is set (needs <sys/sdt.h>, from
+   systemtap-sdt-dev). A probe is a 'nop' in code when not traced,
+   and nothing at all without HAVE_SDT.
+   provider is 'webfs'. probes and arguments are listed in Usage.txt */
+
+#ifdef HAVE_SDT
+
+#include <sys/sdt.h>
+
+#define PROBE0(name)             DTRACE_PROBE(webfs, name)
+#define PROBE1(name,a)           DTRACE_PROBE1(webfs, name, a)
+#define PROBE2(name,a,b)         DTRACE_PROBE2(webfs, name, a, b)
+#define PROBE3(name,a,b,c)       DTRACE_PROBE3(webfs, name, a, b, c)
+#define PROBE4(name,a,b,c,d)     DTRACE_PROBE4(webfs, name, a, b, c, d)
+
+#else
+
+#define PROBE0(name)             do {} while(0)
+#define PROBE1(name,a)           do {} while(0)
+#define PROBE2(name,a,b)         do {} while(0)
+#define PROBE3(name,a,b,c)       do {} while(0)
+#define PROBE4(name,a,b,c,d)     do {} while(0)
+
+#endif /* HAVE_SDT */
+
+
+#endif /* __probe_h_ */
@@ -0,0 +1,187 @@
+#include <pthread.h>
+
+#include "profile.h"
+#include "tools.h"
+
+
+/* name of the file used to keep profiles (NULL: feature disabled) */
+char *profile_file = NULL;
+
+/* table of profiles. Unused one have name=NULL */
+Profile profiles[PROFILE_MAX];
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* free a profile entry */
+void profile_free(Profile *prof) {
+  if (prof->name != NULL)
+    free(prof->name);
+  prof->name = NULL;
+  prof->hash = 0;
+  prof->stamp = 0;
+  prof->last_use = 0;
+  prof->nb_ranges = 0;
+}
+
+/* get a slot for a new profile: a free one or the least
+   recently used one */
+Profile *profile_slot() {
+  int i, target=0;
+
+  for(i=0; i<PROFILE_MAX; i++) {
+    if (profiles[i].name == NULL)
+      return(&(profiles[i]));
+    if (profiles[i].last_use < profiles[target].last_use)
+      target = i;
+  }
+  profile_free(&(profiles[target]));
+  return(&(profiles[target]));
+}
+
+/* search the profile of this version of the file, and copy its
+   ranges in 'dest' (CACHE_MAX_RANGE max). returns their number (0: no
+   profile) */
+int profile_search(const char *name, unsigned int stamp, Range *dest) {
+  unsigned int hash;
+  int i, nb=0;
+
+  if (profile_file == NULL)
+    return(0);
+  hash = str_hash(name);
+  pthread_mutex_lock(&profile_lock);
+  for(i=0; i<PROFILE_MAX; i++) {
+    if ((profiles[i].name == NULL)||(profiles[i].hash != hash))
+      continue;
+    if ((profiles[i].stamp == stamp)&&(strcmp(profiles[i].name, name) == 0)) {
+      profiles[i].last_use = (unsigned int)time(NULL);
+      nb = profiles[i].nb_ranges;
+      memcpy(dest, profiles[i].ranges, sizeof(Range)*nb);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&profile_lock);
+  return(nb);
+}
+
+/* store (replace) the profile for this version of the file */
+int profile_store(const char *name, unsigned int stamp,
+                  Range *ranges, int nb) {
+  unsigned int hash;
+  Profile *prof=NULL;
+  int i;
+
+  if ((profile_file == NULL)||(nb <= 0))
+    return(0);
+  mylog("profile_store(%s, %u, %d)\n", name, stamp, nb);
+  /* an older version of the file is useless: replace it */
+  hash = str_hash(name);
+  pthread_mutex_lock(&profile_lock);
+  for(i=0; i<PROFILE_MAX; i++) {
+    if ((profiles[i].name == NULL)||(profiles[i].hash != hash))
+      continue;
+    if (strcmp(profiles[i].name, name) == 0) {
+      prof = &(profiles[i]);
+      break;
+    }
+  }
+  if (prof == NULL) {
+    prof = profile_slot();
+    prof->name = strdup(name);
+    if (prof->name == NULL) {
+      pthread_mutex_unlock(&profile_lock);
+      return(0);
+    }
+    prof->hash = hash;
+  }
+  prof->stamp = stamp;
+  prof->last_use = (unsigned int)time(NULL);
+  prof->nb_ranges = MIN(nb, CACHE_MAX_RANGE);
+  memcpy(prof->ranges, ranges, sizeof(Range)*prof->nb_ranges);
+  pthread_mutex_unlock(&profile_lock);
+
+  return(1);
+}
+
+/* load profiles from given file (if any). to be called first
+   file format, one line per profile:
+   <stamp> <nb ranges> <offset>:<size> [...] <fullname> */
+int profile_init(const char *file) {
+  char line[PROFILE_LINE], *cur;
+  unsigned int stamp;
+  Range ranges[CACHE_MAX_RANGE];
+  int nb, i, n;
+  FILE *f;
+
+  for(i=0; i<PROFILE_MAX; i++) {
+    profiles[i].name = NULL;
+    profile_free(&(profiles[i]));
+  }
+  if (file == NULL)
+    return(1);
+  profile_file = strdup(file);
+  if (profile_file == NULL)
+    return(0);
+
+  /* no file yet is not an error */
+  f = fopen(profile_file, "r");
+  if (f == NULL)
+    return(1);
+  while(fgets(line, PROFILE_LINE, f) != NULL) {
+    if (line[strlen(line)-1] == '\n')
+      line[strlen(line)-1] = '\0';
+    if (sscanf(line, "%u%d%n", &stamp, &nb, &n) != 2)
+      continue;
+    if ((nb <= 0)||(nb > CACHE_MAX_RANGE))
+      continue;
+    cur = line+n;
+    for(i=0; i<nb; i++) {
+      if (sscanf(cur, "%u:%u%n", &(ranges[i].offset), &(ranges[i].size), &n) != 2)
+        break;
+      cur += n;
+    }
+    if ((i < nb)||(*cur != ' '))
+      continue;  /* bad line. ignore */
+    profile_store(cur+1, stamp, ranges, nb);
+  }
+  fclose(f);
+
+  return(1);
+}
+
+/* save all profiles to the profile file */
+int profile_save() {
+  int i, j;
+  FILE *f;
+
+  if (profile_file == NULL)
+    return(0);
+  f = fopen(profile_file, "w");
+  if (f == NULL) {
+    mylogl(MYLOG_WARN, "profile_save: failed to create '%s'\n", profile_file);
+    return(0);
+  }
+  for(i=0; i<PROFILE_MAX; i++) {
+    if (profiles[i].name == NULL)
+      continue;
+    fprintf(f, "%u %d", profiles[i].stamp, profiles[i].nb_ranges);
+    for(j=0; j<profiles[i].nb_ranges; j++)
+      fprintf(f, " %u:%u", profiles[i].ranges[j].offset,
+              profiles[i].ranges[j].size);
+    fprintf(f, " %s\n", profiles[i].name);
+  }
+  fclose(f);
+  return(1);
+}
+
+/* save profiles and free everything */
+int profile_fini() {
+  int i;
+
+  profile_save();
+  for(i=0; i<PROFILE_MAX; i++)
+    profile_free(&(profiles[i]));
+  if (profile_file != NULL)
+    free(profile_file);
+  profile_file = NULL;
+  return(1);
+}
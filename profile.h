@@ -0,0 +1,54 @@
+#ifndef __profile_h_
+#define __profile_h_
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+
+/* max number of profiles kept. The least recently used one is
+   dropped when a new one is needed */
+#define PROFILE_MAX 256
+
+/* max length of a line in the profile file */
+#define PROFILE_LINE 2048
+
+/* access profile of a file: byte ranges read during an
+   open/release cycle of a given version (stamp) of the file */
+typedef struct {
+  char *name;           /* fullname of the file (as in tree) */
+  unsigned int hash;    /* str_hash of name, to speed up search */
+  unsigned int stamp;   /* timestamp of the file when recorded */
+  unsigned int last_use;
+  int nb_ranges;
+  Range ranges[CACHE_MAX_RANGE];
+}Profile;
+
+
+/* name of the file used to keep profiles (NULL: feature disabled) */
+extern char *profile_file;
+
+
+/* load profiles from given file (if any). to be called first */
+int profile_init(const char *file);
+
+/* save profiles and free everything */
+int profile_fini();
+
+/* search the profile of this version of the file, and copy its
+   ranges in 'dest' (CACHE_MAX_RANGE max). returns their number (0: no
+   profile) */
+int profile_search(const char *name, unsigned int stamp, Range *dest);
+
+/* store (replace) the profile for this version of the file */
+int profile_store(const char *name, unsigned int stamp,
+                  Range *ranges, int nb);
+
+/* save all profiles to the profile file */
+int profile_save();
+
+
+#endif /* __profile_h_ */
@@ -0,0 +1,110 @@
+#include <pthread.h>
+#include "record.h"
+#include "stats.h"
+#include "tree.h"
+#include "tools.h"
+
+
+/* names of operations */
+char *record_names[REC_MAX] = { "getattr", "readlink", "readdir", "open",
+                                "read", "statfs", "release", "access" };
+
+/* true if a trace is being recorded */
+int record_on = 0;
+
+/* trace file. records are written under the lock (stdio buffered) */
+static FILE *record_file = NULL;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long record_start = 0;
+
+/* thread numbers */
+static __thread int record_thread = -1;
+static int record_threads = 0;
+
+
+/* start recording in given file */
+int record_init(const char *file) {
+  unsigned int version = REC_VERSION;
+
+  record_file = fopen(file, "w");
+  if (record_file == NULL)
+    return(0);
+  /* bigger buffer: fewer writes */
+  setvbuf(record_file, NULL, _IOFBF, 1024*1024);
+  fwrite(REC_MAGIC, 1, strlen(REC_MAGIC), record_file);
+  fwrite(&version, sizeof(version), 1, record_file);
+  record_start = stats_now();
+  record_on = 1;
+  return(1);
+}
+
+/* stop recording (flush file) */
+int record_fini() {
+  if (record_file == NULL)
+    return(1);
+  pthread_mutex_lock(&record_lock);
+  record_on = 0;
+  fclose(record_file);
+  record_file = NULL;
+  pthread_mutex_unlock(&record_lock);
+  return(1);
+}
+
+/* record an operation. 'start' is from stats_now() */
+void record_op(int op, const char *path, unsigned int offset,
+               unsigned int size, int result, unsigned long long start) {
+  RecEntry rec;
+
+  if (!record_on)
+    return;
+  if (record_thread < 0)
+    record_thread = __atomic_add_fetch(&record_threads, 1, __ATOMIC_RELAXED);
+  rec.stamp = start - record_start;
+  rec.duration = (unsigned int)(stats_now() - start);
+  rec.offset = offset;
+  rec.size = size;
+  rec.result = result;
+  rec.thread = (unsigned short)record_thread;
+  rec.op = (unsigned char)op;
+  rec.pad = 0;
+  rec.plen = (unsigned short)MIN(strlen(path), MAX_NAME-1);
+
+  pthread_mutex_lock(&record_lock);
+  if (record_file != NULL) {
+    fwrite(&rec, sizeof(rec), 1, record_file);
+    fwrite(path, 1, rec.plen, record_file);
+  }
+  pthread_mutex_unlock(&record_lock);
+}
+
+/* open a trace for reading (checks header). returns NULL on error */
+FILE *record_open(const char *file) {
+  char magic[16];
+  unsigned int version;
+  FILE *f;
+
+  f = fopen(file, "r");
+  if (f == NULL)
+    return(NULL);
+  if ((fread(magic, 1, strlen(REC_MAGIC), f) != strlen(REC_MAGIC))||
+      (strncmp(magic, REC_MAGIC, strlen(REC_MAGIC)) != 0)||
+      (fread(&version, sizeof(version), 1, f) != 1)||
+      (version != REC_VERSION)) {
+    fclose(f);
+    return(NULL);
+  }
+  return(f);
+}
+
+/* read next record (path in 'path', size MAX_NAME)
+   returns 0 at end of trace */
+int record_read(FILE *f, RecEntry *rec, char *path) {
+  if (fread(rec, sizeof(RecEntry), 1, f) != 1)
+    return(0);
+  if ((rec->plen >= MAX_NAME)||(rec->op >= REC_MAX))
+    return(0);  /* bad trace */
+  if (fread(path, 1, rec->plen, f) != rec->plen)
+    return(0);
+  path[rec->plen] = '\0';
+  return(1);
+}
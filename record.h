@@ -0,0 +1,67 @@
+#ifndef __record_h_
+#define __record_h_
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* access trace: every FUSE operation is recorded in a binary file,
+   to be replayed later (see BenchTools/replay.c) */
+
+/* recorded operations */
+#define REC_GETATTR  0
+#define REC_READLINK 1
+#define REC_READDIR  2
+#define REC_OPEN     3
+#define REC_READ     4
+#define REC_STATFS   5
+#define REC_RELEASE  6
+#define REC_ACCESS   7
+#define REC_MAX      8
+
+/* file header: magic and version */
+#define REC_MAGIC   "WFSTRACE"
+#define REC_VERSION 1
+
+/* one record, followed by the path ('plen' bytes, no \0). Values
+   are in host byte order (trace is read on the same kind of host) */
+typedef struct {
+  unsigned long long stamp;  /* us since start of trace */
+  unsigned int duration;     /* us */
+  unsigned int offset;       /* read: offset, readdir: offset */
+  unsigned int size;         /* read: size, open: flags, access: mode */
+  int result;                /* returned value */
+  unsigned short thread;     /* thread number */
+  unsigned char op;          /* REC_* */
+  unsigned char pad;
+  unsigned short plen;       /* length of path */
+}__attribute__((packed)) RecEntry;
+
+/* names of operations */
+extern char *record_names[REC_MAX];
+
+/* true if a trace is being recorded */
+extern int record_on;
+
+
+/* start recording in given file */
+int record_init(const char *file);
+
+/* stop recording (flush file) */
+int record_fini();
+
+/* record an operation. 'start' is from stats_now() */
+void record_op(int op, const char *path, unsigned int offset,
+               unsigned int size, int result, unsigned long long start);
+
+/* open a trace for reading (checks header). returns NULL on error */
+FILE *record_open(const char *file);
+
+/* read next record (path in 'path', size MAX_NAME)
+   returns 0 at end of trace */
+int record_read(FILE *f, RecEntry *rec, char *path);
+
+
+#endif /* __record_h_ */
@@ -0,0 +1,464 @@
+#include <pthread.h>
+#include <time.h>
+
+#include "sched.h"
+#include "tools.h"
+#include "stats.h"
+
+
+/* budget: token buckets for bytes and requests, refilled at sched_rate
+   and sched_reqrate, holding at most one second of budget. A demand
+   transfer starts as soon as the buckets are not in debt (and then
+   takes its share, maybe leaving a debt). A background one waits for
+   its full share, and for no demand transfer waiting or running.
+   Demand transfers wait in order of their virtual finish time (weighted
+   fair queuing): each client process has a virtual clock advanced by
+   bytes/weight at each transfer, starting from the global virtual time
+   (the start time of the last transfer given a slot) when idle */
+
+#define SCHED_MAX_WORKERS 16
+#define SCHED_POLL 50000  /* max wait (us) before checking budget again */
+#define SCHED_CLIENTS 64  /* processes known (least recently seen dropped) */
+#define SCHED_NAMES 16    /* processes given a weight */
+#define SCHED_NAME 16     /* max length of a process name (with \0) */
+
+/* settings */
+int sched_rate = 0;     /* max bytes/s of all transfers (0: no limit) */
+int sched_reqrate = 0;  /* max requests/s (0: no limit) */
+int sched_workers = 2;  /* threads for background transfers */
+int sched_slots = 4;    /* max demand transfers at once (0: no limit) */
+
+/* queued job */
+typedef struct SchedJob {
+  SchedFunc func;
+  void *data;
+  struct SchedJob *next;
+}SchedJob;
+
+/* queues (one per priority) */
+static SchedJob *sched_head[SCHED_PRIO], *sched_tail[SCHED_PRIO];
+
+/* a client process */
+typedef struct {
+  int pid;               /* 0: unused */
+  char name[SCHED_NAME];
+  int weight;
+  double finish;         /* virtual finish time of its last transfer */
+  int pending;           /* transfers waiting or running */
+  unsigned long long last;  /* last transfer (stats_now) */
+  unsigned long long transfers, bytes;
+}SchedClient;
+
+/* a demand transfer waiting for a slot (list sorted by tag) */
+typedef struct SchedWait {
+  double start, tag;     /* virtual start and finish times */
+  struct SchedWait *next;
+}SchedWait;
+
+/* the last one is shared by clients not fitting in others */
+static SchedClient sched_clients[SCHED_CLIENTS+1];
+static SchedWait *sched_waits = NULL;
+static double sched_vtime = 0;
+static __thread int sched_pid = 0;
+
+/* weights by process name */
+static char sched_wnames[SCHED_NAMES][SCHED_NAME];
+static int sched_wvalues[SCHED_NAMES];
+static int sched_nweights = 0;
+
+/* budget */
+static double sched_bytes = 0, sched_reqs = 0;
+static unsigned long long sched_last = 0;
+static int sched_waiting[SCHED_PRIO];  /* transfers waiting for budget */
+static int sched_active[SCHED_PRIO];   /* transfers running */
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_work = PTHREAD_COND_INITIALIZER;    /* new job */
+static pthread_cond_t sched_budget = PTHREAD_COND_INITIALIZER;  /* transfer done */
+
+/* workers */
+static pthread_t sched_threads[SCHED_MAX_WORKERS];
+static int sched_nthreads = 0;
+static int sched_stop = 0;
+
+
+/* worker thread: run jobs, highest priority first */
+static void *sched_loop(void *arg) {
+  SchedJob *job;
+  int p;
+
+  (void)arg;
+  pthread_mutex_lock(&sched_lock);
+  while(!sched_stop) {
+    job = NULL;
+    for(p=0; (p<SCHED_PRIO)&&(job == NULL); p++) {
+      job = sched_head[p];
+      if (job != NULL) {
+        sched_head[p] = job->next;
+        if (sched_head[p] == NULL)
+          sched_tail[p] = NULL;
+      }
+    }
+    if (job == NULL) {
+      pthread_cond_wait(&sched_work, &sched_lock);
+      continue;
+    }
+    stats_gauge(SG_QUEUED, -1);
+    pthread_mutex_unlock(&sched_lock);
+    job->func(job->data, 0);
+    free(job);
+    pthread_mutex_lock(&sched_lock);
+  }
+  pthread_mutex_unlock(&sched_lock);
+  return(NULL);
+}
+
+/* start worker threads (after any fork) */
+int sched_start() {
+  int i;
+
+  if (sched_nthreads > 0)
+    return(1);
+  sched_stop = 0;
+  for(i=0; i<MIN(sched_workers, SCHED_MAX_WORKERS); i++) {
+    if (pthread_create(&(sched_threads[i]), NULL, sched_loop, NULL) != 0) {
+      mylogl(MYLOG_ERROR, "sched_start: can't create worker #%d\n", i);
+      break;
+    }
+    sched_nthreads++;
+  }
+  return((sched_nthreads > 0)||(sched_workers <= 0));
+}
+
+/* stop worker threads. jobs not run are called with 'stop' set */
+void sched_fini() {
+  SchedJob *job;
+  int i, p;
+
+  pthread_mutex_lock(&sched_lock);
+  sched_stop = 1;
+  pthread_cond_broadcast(&sched_work);
+  pthread_cond_broadcast(&sched_budget);
+  pthread_mutex_unlock(&sched_lock);
+  for(i=0; i<sched_nthreads; i++)
+    pthread_join(sched_threads[i], NULL);
+  sched_nthreads = 0;
+
+  for(p=0; p<SCHED_PRIO; p++) {
+    while((job = sched_head[p]) != NULL) {
+      sched_head[p] = job->next;
+      stats_gauge(SG_QUEUED, -1);
+      job->func(job->data, 1);
+      free(job);
+    }
+    sched_tail[p] = NULL;
+  }
+}
+
+/* queue a background job with given priority.
+   returns 0 if not queued (no workers) */
+int sched_queue(int prio, SchedFunc func, void *data) {
+  SchedJob *job;
+
+  if (sched_nthreads == 0)
+    return(0);
+  job = malloc(sizeof(SchedJob));
+  if (job == NULL)
+    return(0);
+  job->func = func;
+  job->data = data;
+  job->next = NULL;
+  pthread_mutex_lock(&sched_lock);
+  if (sched_stop) {
+    pthread_mutex_unlock(&sched_lock);
+    free(job);
+    return(0);
+  }
+  if (sched_tail[prio] != NULL)
+    sched_tail[prio]->next = job;
+  else
+    sched_head[prio] = job;
+  sched_tail[prio] = job;
+  stats_gauge(SG_QUEUED, 1);
+  pthread_cond_signal(&sched_work);
+  pthread_mutex_unlock(&sched_lock);
+  return(1);
+}
+
+/* take back a queued job with given 'data' (not run, its data is then
+   the caller's). returns 0 if not queued (running or done) */
+int sched_take(void *data) {
+  SchedJob *job, *prev;
+  int p;
+
+  pthread_mutex_lock(&sched_lock);
+  for(p=0; p<SCHED_PRIO; p++) {
+    prev = NULL;
+    for(job=sched_head[p]; (job != NULL)&&(job->data != data); job=job->next)
+      prev = job;
+    if (job == NULL)
+      continue;
+    if (prev != NULL)
+      prev->next = job->next;
+    else
+      sched_head[p] = job->next;
+    if (sched_tail[p] == job)
+      sched_tail[p] = prev;
+    stats_gauge(SG_QUEUED, -1);
+    pthread_mutex_unlock(&sched_lock);
+    free(job);
+    return(1);
+  }
+  pthread_mutex_unlock(&sched_lock);
+  return(0);
+}
+
+/* set weights of client processes by name, from a comma separated
+   list of name:weight (weight 1-1000). returns false if invalid */
+int sched_weights(const char *list) {
+  const char *end, *sep;
+  int lng;
+
+  sched_nweights = 0;
+  while((list != NULL)&&(*list != '\0')) {
+    end = strchr(list, ',');
+    if (end == NULL)
+      end = list+strlen(list);
+    sep = memchr(list, ':', end-list);
+    if ((sep == NULL)||(sep == list)||(sched_nweights >= SCHED_NAMES))
+      return(0);
+    lng = MIN(sep-list, SCHED_NAME-1);
+    memcpy(sched_wnames[sched_nweights], list, lng);
+    sched_wnames[sched_nweights][lng] = '\0';
+    sched_wvalues[sched_nweights] = atoi(sep+1);
+    if ((sched_wvalues[sched_nweights] < 1)||(sched_wvalues[sched_nweights] > 1000))
+      return(0);
+    sched_nweights++;
+    list = (*end == ',')?end+1:end;
+  }
+  return(1);
+}
+
+/* transfers of this thread are for process 'pid' (0: none) */
+void sched_client(int pid) {
+  sched_pid = pid;
+}
+
+/* get the entry of a client process (lock held). a new one takes its
+   weight from its name */
+static SchedClient *sched_get_client(int pid) {
+  SchedClient *c=NULL;
+  char buf[64];
+  FILE *f;
+  int i;
+
+  for(i=0; i<SCHED_CLIENTS; i++) {
+    if ((sched_clients[i].pid == pid)&&(sched_clients[i].last > 0))
+      return(&(sched_clients[i]));
+    if ((sched_clients[i].pending == 0)&&
+        ((c == NULL)||(sched_clients[i].last < c->last)))
+      c = &(sched_clients[i]);
+  }
+  if (c == NULL) {
+    /* all busy (more than SCHED_CLIENTS processes reading): the shared
+       one, never reset as it has transfers pending */
+    c = &(sched_clients[SCHED_CLIENTS]);
+    if (c->last == 0) {
+      c->pid = -1;
+      c->weight = SCHED_WEIGHT;
+      c->finish = sched_vtime;
+      strcpy(c->name, "others");
+    }
+    c->last = stats_now();
+    return(c);
+  }
+  memset(c, 0, sizeof(SchedClient));
+  c->pid = pid;
+  c->weight = SCHED_WEIGHT;
+  c->finish = sched_vtime;
+  c->last = stats_now();
+  strcpy(c->name, "-");
+  snprintf(buf, sizeof(buf), "/proc/%d/comm", pid);
+  if ((pid > 0)&&((f = fopen(buf, "r")) != NULL)) {
+    if (fgets(c->name, SCHED_NAME, f) != NULL)
+      c->name[strcspn(c->name, "\n")] = '\0';
+    fclose(f);
+  }
+  for(i=0; i<sched_nweights; i++)
+    if (strcmp(sched_wnames[i], c->name) == 0)
+      c->weight = sched_wvalues[i];
+  return(c);
+}
+
+/* print state of clients in 'dest' (max 'size' bytes). returns length */
+int sched_print(char *dest, int size) {
+  int i, lng=0;
+
+  pthread_mutex_lock(&sched_lock);
+  for(i=0; (i<=SCHED_CLIENTS)&&(lng < size); i++) {
+    if (sched_clients[i].last == 0)
+      continue;
+    lng += snprintf(dest+lng, size-lng, "Client %d (%s): weight %d, %llu reads,"
+                    " %llu bytes, %d waiting\n", sched_clients[i].pid,
+                    sched_clients[i].name, sched_clients[i].weight,
+                    sched_clients[i].transfers, sched_clients[i].bytes,
+                    sched_clients[i].pending);
+  }
+  pthread_mutex_unlock(&sched_lock);
+  return(MIN(lng, size-1));
+}
+
+/* add budget for the time elapsed (lock held) */
+static void sched_refill(unsigned long long now) {
+  double elapsed;
+
+  if (sched_last == 0) {
+    /* start with a full bucket */
+    sched_bytes = sched_rate;
+    sched_reqs = MAX(sched_reqrate, 1);
+  } else {
+    elapsed = (now-sched_last)/1000000.0;
+    sched_bytes = MIN(sched_bytes+elapsed*sched_rate, (double)sched_rate);
+    sched_reqs = MIN(sched_reqs+elapsed*sched_reqrate, (double)MAX(sched_reqrate, 1));
+  }
+  sched_last = now;
+}
+
+/* time (us) to wait before a transfer can start, 0 if now (lock held).
+   'me' is the slot request of a demand transfer */
+static unsigned long long sched_delay(int prio, unsigned int bytes,
+                                      SchedWait *me) {
+  unsigned long long wait=0, w;
+  double need;
+  int p;
+
+  if (prio == SCHED_DEMAND) {
+    /* its turn, and a free slot */
+    if ((sched_waits != me)||
+        ((sched_slots > 0)&&(sched_active[SCHED_DEMAND] >= sched_slots)))
+      return(SCHED_POLL);
+  } else {
+    for(p=0; p<prio; p++)
+      if (sched_waiting[p] > 0)
+        return(SCHED_POLL);
+    if (sched_active[SCHED_DEMAND] > 0)
+      return(SCHED_POLL);
+  }
+  if (sched_rate > 0) {
+    need = (prio == SCHED_DEMAND)?0:MIN((double)bytes, (double)sched_rate);
+    if (sched_bytes < need) {
+      w = (unsigned long long)((need-sched_bytes)*1000000.0/sched_rate)+1;
+      wait = MAX(wait, w);
+    }
+  }
+  if (sched_reqrate > 0) {
+    need = (prio == SCHED_DEMAND)?0:1;
+    if (sched_reqs < need) {
+      w = (unsigned long long)((need-sched_reqs)*1000000.0/sched_reqrate)+1;
+      wait = MAX(wait, w);
+    }
+  }
+  return(wait);
+}
+
+/* queue a demand transfer of 'bytes' for a slot (lock held): its
+   virtual times, in the list ordered by finish time.
+   returns its client */
+static SchedClient *sched_join(SchedWait *me, unsigned int bytes) {
+  SchedClient *c;
+  SchedWait **w;
+
+  c = sched_get_client(sched_pid);
+  me->start = MAX(sched_vtime, c->finish);
+  me->tag = me->start + (double)MAX(bytes, 1)/c->weight;
+  c->finish = me->tag;
+  c->pending++;
+  for(w=&sched_waits; (*w != NULL)&&((*w)->tag <= me->tag); w=&((*w)->next));
+  me->next = *w;
+  *w = me;
+  return(c);
+}
+
+/* wait until a transfer of 'bytes' with given priority can start */
+void sched_acquire(int prio, unsigned int bytes) {
+  sched_acquire_prio(&prio, bytes);
+}
+
+/* same, with the priority in '*prio', which sched_raise may change
+   while waiting. returns the priority it started with (for
+   sched_release) */
+int sched_acquire_prio(int *prio, unsigned int bytes) {
+  unsigned long long wait;
+  struct timespec ts;
+  SchedClient *c=NULL;
+  SchedWait me, **w;
+  int delayed=0, cur;
+
+  pthread_mutex_lock(&sched_lock);
+  cur = *prio;
+  sched_waiting[cur]++;
+  if (cur == SCHED_DEMAND)
+    c = sched_join(&me, bytes);
+  while(!sched_stop) {
+    /* raised meanwhile: a reader waits for this transfer. A raised
+       background transfer is a demand of the worker (no client) */
+    if (*prio != cur) {
+      sched_waiting[cur]--;
+      cur = *prio;
+      sched_waiting[cur]++;
+      if ((cur == SCHED_DEMAND)&&(c == NULL))
+        c = sched_join(&me, bytes);
+    }
+    sched_refill(stats_now());
+    wait = sched_delay(cur, bytes, &me);
+    if (wait == 0)
+      break;
+    delayed = 1;
+    wait = MIN(wait, SCHED_POLL);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += (ts.tv_nsec+wait*1000)/1000000000;
+    ts.tv_nsec = (ts.tv_nsec+wait*1000)%1000000000;
+    pthread_cond_timedwait(&sched_budget, &sched_lock, &ts);
+  }
+  if (c != NULL) {
+    for(w=&sched_waits; *w != &me; w=&((*w)->next));
+    *w = me.next;
+    sched_vtime = MAX(sched_vtime, me.start);
+    c->pending--;
+    c->transfers++;
+    c->bytes += bytes;
+    c->last = stats_now();
+    /* next one may start too */
+    if (sched_waits != NULL)
+      pthread_cond_broadcast(&sched_budget);
+  }
+  sched_waiting[cur]--;
+  sched_active[cur]++;
+  if (sched_rate > 0)
+    sched_bytes -= bytes;
+  if (sched_reqrate > 0)
+    sched_reqs -= 1;
+  pthread_mutex_unlock(&sched_lock);
+  if (delayed)
+    stats_add(SC_THROTTLED, 1);
+  return(cur);
+}
+
+/* raise the priority '*prio' of a transfer waiting in (or not yet in)
+   sched_acquire_prio to 'to' */
+void sched_raise(int *prio, int to) {
+  pthread_mutex_lock(&sched_lock);
+  if (to < *prio) {
+    *prio = to;
+    pthread_cond_broadcast(&sched_budget);
+  }
+  pthread_mutex_unlock(&sched_lock);
+}
+
+/* a transfer started by sched_acquire is done */
+void sched_release(int prio) {
+  pthread_mutex_lock(&sched_lock);
+  sched_active[prio]--;
+  pthread_cond_broadcast(&sched_budget);
+  pthread_mutex_unlock(&sched_lock);
+}
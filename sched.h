@@ -0,0 +1,79 @@
+#ifndef __sched_h_
+#define __sched_h_
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* transfer scheduler: all data transfers take their share of a global
+   budget (bytes/s and requests/s, token bucket) before starting, the
+   reads applications are waiting for before the others. Background
+   transfers (readahead, prefetch) are run by worker threads, in order
+   of priority, and only when no demand transfer is running.
+   Demand transfers get at most sched_slots transfer slots, shared by
+   client processes with weighted fair queuing: a process reading a lot
+   does not delay the reads of the others */
+
+/* priorities (lower first) */
+#define SCHED_DEMAND    0  /* read of an application */
+#define SCHED_READAHEAD 1  /* next chunks of a sequential reader */
+#define SCHED_PREFETCH  2  /* access profile at open */
+#define SCHED_PRIO      3
+
+/* weight of processes not given in sched_weights() */
+#define SCHED_WEIGHT 4
+
+/* a background job. called with 'stop' set if the job must not be
+   run (scheduler stopping), only to free its data */
+typedef void (*SchedFunc)(void *data, int stop);
+
+/* settings */
+extern int sched_rate;     /* max bytes/s of all transfers (0: no limit) */
+extern int sched_reqrate;  /* max requests/s (0: no limit) */
+extern int sched_workers;  /* threads for background transfers */
+extern int sched_slots;    /* max demand transfers at once (0: no limit) */
+
+
+/* start worker threads (after any fork) */
+int sched_start();
+
+/* stop worker threads. jobs not run are called with 'stop' set */
+void sched_fini();
+
+/* queue a background job with given priority.
+   returns 0 if not queued (no workers) */
+int sched_queue(int prio, SchedFunc func, void *data);
+
+/* set weights of client processes by name, from a comma separated
+   list of name:weight (weight 1-1000). returns false if invalid */
+int sched_weights(const char *list);
+
+/* transfers of this thread are for process 'pid' (0: none) */
+void sched_client(int pid);
+
+/* print state of clients in 'dest' (max 'size' bytes). returns length */
+int sched_print(char *dest, int size);
+
+/* take back a queued job with given 'data' (not run, its data is then
+   the caller's). returns 0 if not queued (running or done) */
+int sched_take(void *data);
+
+/* wait until a transfer of 'bytes' with given priority can start */
+void sched_acquire(int prio, unsigned int bytes);
+
+/* same, with the priority in '*prio', which sched_raise may change
+   while waiting. returns the priority it started with (for
+   sched_release) */
+int sched_acquire_prio(int *prio, unsigned int bytes);
+
+/* raise the priority '*prio' of a transfer waiting in (or not yet in)
+   sched_acquire_prio to 'to' */
+void sched_raise(int *prio, int to);
+
+/* a transfer started by sched_acquire is done */
+void sched_release(int prio);
+
+
+#endif /* __sched_h_ */
@@ -0,0 +1,304 @@
+#include "stats.h"
+#include "tools.h"
+
+
+/* names of operations and counters (for output) */
+char *stats_op_name[ST_MAX] = { "getattr", "readdir", "open", "read",
+                                "release", "fetch" };
+
+/* shards of counters */
+StatsShard stats_shards[STATS_SHARDS];
+
+/* shard used by the current thread (-1: not set yet) */
+static __thread int stats_shard = -1;
+/* next shard to give to a thread */
+static int stats_next = 0;
+
+
+/* shard of the current thread */
+static StatsShard *stats_get() {
+  if (stats_shard < 0)
+    stats_shard = __atomic_fetch_add(&stats_next, 1, __ATOMIC_RELAXED) % STATS_SHARDS;
+  return(&(stats_shards[stats_shard]));
+}
+
+/* current time in us (monotonic), to compute durations */
+unsigned long long stats_now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((unsigned long long)ts.tv_sec*1000000ULL + ts.tv_nsec/1000);
+}
+
+/* add a duration (us) for an operation */
+void stats_time(int op, unsigned long long us) {
+  StatsShard *sh = stats_get();
+  int b = 0;
+
+  /* bucket: log2 of duration */
+  while((b < STATS_BUCKETS-1)&&((us >> (b+1)) != 0))
+    b++;
+  __atomic_fetch_add(&(sh->count[op]), 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(sh->sum[op]), us, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(sh->hist[op][b]), 1, __ATOMIC_RELAXED);
+}
+
+/* add the duration since 'start' (from stats_now) for an operation */
+void stats_since(int op, unsigned long long start) {
+  stats_time(op, stats_now()-start);
+}
+
+/* increase a counter */
+void stats_add(int counter, unsigned long long val) {
+  __atomic_fetch_add(&(stats_get()->counter[counter]), val, __ATOMIC_RELAXED);
+}
+
+/* change a gauge */
+void stats_gauge(int gauge, long long val) {
+  __atomic_fetch_add(&(stats_get()->gauge[gauge]), val, __ATOMIC_RELAXED);
+}
+
+/* current value of a counter (all shards) */
+unsigned long long stats_counter(int counter) {
+  unsigned long long val=0;
+  int i;
+
+  for(i=0; i<STATS_SHARDS; i++)
+    val += __atomic_load_n(&(stats_shards[i].counter[counter]), __ATOMIC_RELAXED);
+  return(val);
+}
+
+/* current value of a gauge (all shards) */
+long long stats_gauge_value(int gauge) {
+  long long val=0;
+  int i;
+
+  for(i=0; i<STATS_SHARDS; i++)
+    val += __atomic_load_n(&(stats_shards[i].gauge[gauge]), __ATOMIC_RELAXED);
+  return(val<0?0:val);
+}
+
+/* sum of all shards for an operation */
+static void stats_sum_op(int op, unsigned long long *count,
+                         unsigned long long *sum, unsigned long long *hist) {
+  int i, b;
+
+  *count = *sum = 0;
+  for(b=0; b<STATS_BUCKETS; b++)
+    hist[b] = 0;
+  for(i=0; i<STATS_SHARDS; i++) {
+    *count += __atomic_load_n(&(stats_shards[i].count[op]), __ATOMIC_RELAXED);
+    *sum += __atomic_load_n(&(stats_shards[i].sum[op]), __ATOMIC_RELAXED);
+    for(b=0; b<STATS_BUCKETS; b++)
+      hist[b] += __atomic_load_n(&(stats_shards[i].hist[op][b]), __ATOMIC_RELAXED);
+  }
+}
+
+/* upper bound (us) of the bucket containing the given percentile */
+static unsigned long long stats_percentile(unsigned long long *hist,
+                                           unsigned long long count, int pct) {
+  unsigned long long seen=0, target;
+  int b;
+
+  if (count == 0)
+    return(0);
+  target = (count*pct+99)/100;
+  for(b=0; b<STATS_BUCKETS; b++) {
+    seen += hist[b];
+    if (seen >= target)
+      break;
+  }
+  return(1ULL << (b+1));
+}
+
+/* ratio in % (0 if no total) */
+static double stats_ratio(unsigned long long val, unsigned long long total) {
+  return(total==0?0.0:(100.0*val)/total);
+}
+
+/* throughput (MB/s) of 'bytes' counter over 'us' counter */
+static double stats_rate(int bytes, int us) {
+  unsigned long long t = stats_counter(us);
+
+  return(t==0?0.0:(double)stats_counter(bytes)/t);
+}
+
+/* human-readable output */
+static int stats_print_text(char *buf, int size) {
+  unsigned long long count, sum, hist[STATS_BUCKETS];
+  unsigned long long hit, part, miss, nreq;
+  int op, lng;
+
+  hit = stats_counter(SC_HIT);
+  part = stats_counter(SC_PARTIAL);
+  miss = stats_counter(SC_MISS);
+  stats_sum_op(ST_FETCH, &nreq, &sum, hist);
+  lng = snprintf(buf, size, "Access statistics:\n"
+         "Current opened files: %lld\n"
+         "Total number of [fl]stat, access...: %llu\n"
+         "Total number of dir access: %llu\n"
+         "Total number of open: %llu\n"
+         "Total number of read: %llu\n"
+         "Total number of bytes read: %llu\n"
+         "Cache reads: %llu hits, %llu partial hits, %llu misses"
+         " (%.1f%% / %.1f%% / %.1f%%), %llu direct\n"
+         "Cache evictions: %llu caches, %llu chunks\n"
+         "HTTP requests: %llu (%llu failed), %llu bytes (%llu per request),"
+         " in flight: %lld\n"
+         "HTTP retries: %llu, hedged requests: %llu (%llu answered first)\n"
+         "Background loads: %llu (%llu cancelled), queued: %lld,"
+         " throttled transfers: %llu\n"
+         "Connections opened: %llu (%llu us each)\n"
+         "Failed at once: %llu opens (file failed before), %llu requests"
+         " (server down)\n"
+         "Cache memory: %lld bytes in buffers, %lld mapped, %llu chunks"
+         " dropped for budget, %llu bytes released\n"
+         "Compressed chunks: %lld bytes, %llu kept (%llu -> %llu bytes,"
+         " %.1f MB/s), %llu not compressible, %llu dropped, %llu read"
+         " again (%.1f MB/s)\n"
+         "Latency (us): count avg p50 p90 p99\n",
+         stats_gauge_value(SG_USED), stats_counter(SC_STAT),
+         stats_counter(SC_DIR), stats_counter(SC_OPEN),
+         stats_counter(SC_READ), stats_counter(SC_DATA),
+         hit, part, miss, stats_ratio(hit, hit+part+miss),
+         stats_ratio(part, hit+part+miss), stats_ratio(miss, hit+part+miss),
+         stats_counter(SC_DIRECT), stats_counter(SC_EVICT),
+         stats_counter(SC_CHUNK_EVICT),
+         nreq, stats_counter(SC_FETCH_ERR), stats_counter(SC_FETCH_DATA),
+         nreq==0?0:stats_counter(SC_FETCH_DATA)/nreq,
+         stats_gauge_value(SG_INFLIGHT), stats_counter(SC_RETRY),
+         stats_counter(SC_HEDGE), stats_counter(SC_HEDGE_WIN),
+         stats_counter(SC_BG_FETCH), stats_counter(SC_BG_CANCEL),
+         stats_gauge_value(SG_QUEUED), stats_counter(SC_THROTTLED),
+         stats_counter(SC_CONNECT), stats_counter(SC_CONNECT)==0?0:
+         stats_counter(SC_CONNECT_US)/stats_counter(SC_CONNECT),
+         stats_counter(SC_NEGATIVE), stats_counter(SC_BREAKER),
+         stats_gauge_value(SG_POOL_USED), stats_gauge_value(SG_POOL_MAPPED),
+         stats_counter(SC_POOL_EVICT), stats_counter(SC_POOL_RELEASED),
+         stats_gauge_value(SG_ZIP_MEM), stats_counter(SC_ZIP),
+         stats_counter(SC_ZIP_IN), stats_counter(SC_ZIP_OUT),
+         stats_rate(SC_ZIP_IN, SC_ZIP_US), stats_counter(SC_ZIP_SKIP),
+         stats_counter(SC_ZIP_EVICT), stats_counter(SC_UNZIP),
+         stats_rate(SC_UNZIP_DATA, SC_UNZIP_US));
+  for(op=0; (op<ST_MAX)&&(lng<size); op++) {
+    stats_sum_op(op, &count, &sum, hist);
+    lng += snprintf(buf+lng, size-lng, "  %-8s %llu %llu %llu %llu %llu\n",
+                    stats_op_name[op], count, count==0?0:sum/count,
+                    stats_percentile(hist, count, 50),
+                    stats_percentile(hist, count, 90),
+                    stats_percentile(hist, count, 99));
+  }
+  return(MIN(lng, size-1));
+}
+
+/* Prometheus text format */
+static int stats_print_prom(char *buf, int size) {
+  unsigned long long count, sum, cumul, hist[STATS_BUCKETS];
+  int op, b, lng;
+
+  lng = snprintf(buf, size,
+         "# TYPE webfs_open_files gauge\nwebfs_open_files %lld\n"
+         "# TYPE webfs_http_inflight gauge\nwebfs_http_inflight %lld\n"
+         "# TYPE webfs_background_queued gauge\nwebfs_background_queued %lld\n"
+         "# TYPE webfs_ops_total counter\n"
+         "webfs_ops_total{op=\"stat\"} %llu\n"
+         "webfs_ops_total{op=\"readdir\"} %llu\n"
+         "webfs_ops_total{op=\"open\"} %llu\n"
+         "webfs_ops_total{op=\"read\"} %llu\n"
+         "# TYPE webfs_read_bytes_total counter\nwebfs_read_bytes_total %llu\n"
+         "# TYPE webfs_cache_reads_total counter\n"
+         "webfs_cache_reads_total{result=\"hit\"} %llu\n"
+         "webfs_cache_reads_total{result=\"partial\"} %llu\n"
+         "webfs_cache_reads_total{result=\"miss\"} %llu\n"
+         "# TYPE webfs_direct_reads_total counter\nwebfs_direct_reads_total %llu\n"
+         "# TYPE webfs_cache_evictions_total counter\n"
+         "webfs_cache_evictions_total{kind=\"cache\"} %llu\n"
+         "webfs_cache_evictions_total{kind=\"chunk\"} %llu\n"
+         "# TYPE webfs_http_bytes_total counter\nwebfs_http_bytes_total %llu\n"
+         "# TYPE webfs_http_errors_total counter\nwebfs_http_errors_total %llu\n"
+         "# TYPE webfs_http_retries_total counter\nwebfs_http_retries_total %llu\n"
+         "# TYPE webfs_http_hedged_total counter\n"
+         "webfs_http_hedged_total{result=\"sent\"} %llu\n"
+         "webfs_http_hedged_total{result=\"won\"} %llu\n"
+         "# TYPE webfs_background_loads_total counter\n"
+         "webfs_background_loads_total{result=\"done\"} %llu\n"
+         "webfs_background_loads_total{result=\"cancelled\"} %llu\n"
+         "# TYPE webfs_throttled_total counter\nwebfs_throttled_total %llu\n"
+         "# TYPE webfs_http_connections_total counter\n"
+         "webfs_http_connections_total %llu\n"
+         "# TYPE webfs_http_connect_seconds_total counter\n"
+         "webfs_http_connect_seconds_total %g\n"
+         "# TYPE webfs_failed_fast_total counter\n"
+         "webfs_failed_fast_total{reason=\"negative\"} %llu\n"
+         "webfs_failed_fast_total{reason=\"breaker\"} %llu\n"
+         "# TYPE webfs_cache_memory_bytes gauge\n"
+         "webfs_cache_memory_bytes{kind=\"used\"} %lld\n"
+         "webfs_cache_memory_bytes{kind=\"mapped\"} %lld\n"
+         "# TYPE webfs_budget_evictions_total counter\n"
+         "webfs_budget_evictions_total %llu\n"
+         "# TYPE webfs_memory_released_bytes_total counter\n"
+         "webfs_memory_released_bytes_total %llu\n"
+         "# TYPE webfs_compressed_bytes gauge\nwebfs_compressed_bytes %lld\n"
+         "# TYPE webfs_compressed_chunks_total counter\n"
+         "webfs_compressed_chunks_total{result=\"kept\"} %llu\n"
+         "webfs_compressed_chunks_total{result=\"skipped\"} %llu\n"
+         "webfs_compressed_chunks_total{result=\"dropped\"} %llu\n"
+         "webfs_compressed_chunks_total{result=\"restored\"} %llu\n"
+         "# TYPE webfs_compression_bytes_total counter\n"
+         "webfs_compression_bytes_total{kind=\"in\"} %llu\n"
+         "webfs_compression_bytes_total{kind=\"out\"} %llu\n"
+         "webfs_compression_bytes_total{kind=\"restored\"} %llu\n"
+         "# TYPE webfs_compression_seconds_total counter\n"
+         "webfs_compression_seconds_total{op=\"compress\"} %g\n"
+         "webfs_compression_seconds_total{op=\"uncompress\"} %g\n"
+         "# TYPE webfs_latency_seconds histogram\n",
+         stats_gauge_value(SG_USED), stats_gauge_value(SG_INFLIGHT),
+         stats_gauge_value(SG_QUEUED), stats_counter(SC_STAT), stats_counter(SC_DIR),
+         stats_counter(SC_OPEN), stats_counter(SC_READ),
+         stats_counter(SC_DATA), stats_counter(SC_HIT),
+         stats_counter(SC_PARTIAL), stats_counter(SC_MISS),
+         stats_counter(SC_DIRECT), stats_counter(SC_EVICT),
+         stats_counter(SC_CHUNK_EVICT),
+         stats_counter(SC_FETCH_DATA), stats_counter(SC_FETCH_ERR),
+         stats_counter(SC_RETRY), stats_counter(SC_HEDGE),
+         stats_counter(SC_HEDGE_WIN), stats_counter(SC_BG_FETCH),
+         stats_counter(SC_BG_CANCEL), stats_counter(SC_THROTTLED),
+         stats_counter(SC_CONNECT), stats_counter(SC_CONNECT_US)/1000000.0,
+         stats_counter(SC_NEGATIVE), stats_counter(SC_BREAKER),
+         stats_gauge_value(SG_POOL_USED), stats_gauge_value(SG_POOL_MAPPED),
+         stats_counter(SC_POOL_EVICT), stats_counter(SC_POOL_RELEASED),
+         stats_gauge_value(SG_ZIP_MEM), stats_counter(SC_ZIP),
+         stats_counter(SC_ZIP_SKIP), stats_counter(SC_ZIP_EVICT),
+         stats_counter(SC_UNZIP), stats_counter(SC_ZIP_IN),
+         stats_counter(SC_ZIP_OUT), stats_counter(SC_UNZIP_DATA),
+         stats_counter(SC_ZIP_US)/1000000.0,
+         stats_counter(SC_UNZIP_US)/1000000.0);
+  for(op=0; (op<ST_MAX)&&(lng<size); op++) {
+    stats_sum_op(op, &count, &sum, hist);
+    cumul = 0;
+    for(b=0; (b<STATS_BUCKETS-1)&&(lng<size); b++) {
+      cumul += hist[b];
+      lng += snprintf(buf+lng, size-lng,
+                      "webfs_latency_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+                      stats_op_name[op], (double)(1ULL << (b+1))/1000000.0, cumul);
+    }
+    if (lng < size)
+      lng += snprintf(buf+lng, size-lng,
+                      "webfs_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n"
+                      "webfs_latency_seconds_sum{op=\"%s\"} %g\n"
+                      "webfs_latency_seconds_count{op=\"%s\"} %llu\n",
+                      stats_op_name[op], count, stats_op_name[op],
+                      (double)sum/1000000.0, stats_op_name[op], count);
+  }
+  return(MIN(lng, size-1));
+}
+
+/* print all stats in 'buf' (size 'size') with given format
+   returns the length of the output */
+int stats_print(char *buf, int size, int format) {
+  if (size <= 0)
+    return(0);
+  if (format == STATS_PROM)
+    return(stats_print_prom(buf, size));
+  return(stats_print_text(buf, size));
+}
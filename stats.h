@@ -0,0 +1,115 @@
+#ifndef __stats_h_
+#define __stats_h_
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/* timed operations */
+#define ST_GETATTR 0
+#define ST_READDIR 1
+#define ST_OPEN    2
+#define ST_READ    3
+#define ST_RELEASE 4
+#define ST_FETCH   5  /* HTTP request for file data */
+#define ST_MAX     6
+
+/* counters */
+#define SC_STAT        0  /* [fl]stat, access... */
+#define SC_DIR         1  /* readdir */
+#define SC_OPEN        2
+#define SC_READ        3
+#define SC_DATA        4  /* bytes read by applications */
+#define SC_HIT         5  /* cache reads fully served from cache */
+#define SC_PARTIAL     6  /* cache reads partially served from cache */
+#define SC_MISS        7  /* cache reads that needed a fetch */
+#define SC_EVICT       8  /* caches dropped to get a free one */
+#define SC_CHUNK_EVICT 9  /* chunks re-used for other data */
+#define SC_FETCH_DATA 10  /* bytes received from web server */
+#define SC_FETCH_ERR  11  /* failed HTTP requests */
+#define SC_RETRY      12  /* HTTP requests tried again */
+#define SC_HEDGE      13  /* duplicate requests sent for slow ones */
+#define SC_HEDGE_WIN  14  /* duplicate requests that answered first */
+#define SC_BG_FETCH   15  /* chunks loaded in background (readahead...) */
+#define SC_BG_CANCEL  16  /* background transfers cancelled */
+#define SC_THROTTLED  17  /* transfers delayed by the budget */
+#define SC_CONNECT    18  /* new connections to servers */
+#define SC_CONNECT_US 19  /* time spent opening them (TCP+TLS, us) */
+#define SC_DIRECT     20  /* cache misses read straight in the buffer */
+#define SC_NEGATIVE   21  /* opens failed at once (file failed before) */
+#define SC_BREAKER    22  /* requests refused (server down) */
+#define SC_POOL_EVICT 23  /* chunks dropped to stay in memory budget */
+#define SC_POOL_RELEASED 24  /* bytes of buffers given back to system */
+#define SC_ZIP        25  /* chunks kept compressed */
+#define SC_ZIP_IN     26  /* their bytes */
+#define SC_ZIP_OUT    27  /* their bytes compressed */
+#define SC_ZIP_US     28  /* time spent compressing (us) */
+#define SC_ZIP_SKIP   29  /* chunks not compressible */
+#define SC_ZIP_EVICT  30  /* compressed chunks dropped */
+#define SC_UNZIP      31  /* compressed chunks read again */
+#define SC_UNZIP_DATA 32  /* their bytes */
+#define SC_UNZIP_US   33  /* time spent uncompressing (us) */
+#define SC_MAX        34
+
+/* gauges (current values) */
+#define SG_USED     0  /* opened files */
+#define SG_INFLIGHT 1  /* HTTP transfers in progress */
+#define SG_QUEUED   2  /* background transfers waiting */
+#define SG_POOL_USED   3  /* bytes of cache buffers */
+#define SG_POOL_MAPPED 4  /* bytes of slabs holding them */
+#define SG_ZIP_MEM  5  /* bytes of compressed chunks */
+#define SG_MAX      6
+
+/* latency histograms: bucket i counts durations in [2^i, 2^(i+1)[ us
+   (first one starts at 0, last one has no upper bound) */
+#define STATS_BUCKETS 24
+
+/* counters are sharded: each thread uses its own shard (shared if
+   there are more threads than shards). Shards are summed when read */
+#define STATS_SHARDS 16
+
+/* output formats */
+#define STATS_TEXT 0  /* human-readable */
+#define STATS_PROM 1  /* Prometheus text format */
+
+/* max size of output */
+#define STATS_SIZE 16384
+
+/* one shard of counters. Each one in its own cache lines */
+typedef struct {
+  unsigned long long count[ST_MAX];
+  unsigned long long sum[ST_MAX];  /* us */
+  unsigned long long hist[ST_MAX][STATS_BUCKETS];
+  unsigned long long counter[SC_MAX];
+  long long gauge[SG_MAX];
+}__attribute__((aligned(64))) StatsShard;
+
+
+/* current time in us (monotonic), to compute durations */
+unsigned long long stats_now();
+
+/* add a duration (us) for an operation */
+void stats_time(int op, unsigned long long us);
+
+/* add the duration since 'start' (from stats_now) for an operation */
+void stats_since(int op, unsigned long long start);
+
+/* increase a counter */
+void stats_add(int counter, unsigned long long val);
+
+/* change a gauge */
+void stats_gauge(int gauge, long long val);
+
+/* current value of a counter/gauge (all shards) */
+unsigned long long stats_counter(int counter);
+long long stats_gauge_value(int gauge);
+
+/* print all stats in 'buf' (size 'size') with given format
+   returns the length of the output */
+int stats_print(char *buf, int size, int format);
+
+
+#endif /* __stats_h_ */
@@ -1,28 +1,282 @@
 #include "tools.h"
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/time.h>
 
 
+/* max length of a message (longer ones are truncated) */
+#define LOG_MSG 256
+/* number of messages in the ring of a thread */
+#define LOG_RING 1024
+
+/* a message waiting to be written */
+typedef struct {
+  struct timeval stamp;
+  int level;
+  char text[LOG_MSG];
+}LogMsg;
+
+/* ring of messages of a thread. Only this thread writes messages
+   (moves 'head'), only the logger thread reads them (moves 'tail') */
+typedef struct _LogRing {
+  LogMsg msgs[LOG_RING];
+  unsigned int head;   /* next message to write */
+  unsigned int tail;   /* next message to read */
+  unsigned int lost;   /* messages dropped (ring full) */
+  int id;              /* thread number, for output */
+  int dead;            /* thread ended: freed once empty */
+  struct _LogRing *next;
+}LogRing;
+
+/* messages above this level are ignored */
+int mylog_level = MYLOG_WARN;
+
+/* output */
+static char *mylog_file = "/tmp/webfs.log";
+static int mylog_syslog = 0;
+static FILE *mylog_out = NULL;
+
+/* rings of all threads. the lock is only used to add/remove rings */
+static LogRing *mylog_rings = NULL;
+static pthread_mutex_t mylog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t mylog_key;
+static __thread LogRing *mylog_ring = NULL;
+static int mylog_ids = 0;
+
+/* logger thread */
+static pthread_t mylog_thread;
+static int mylog_running = 0;
+static int mylog_end = 0;
+
+static char *mylog_names[] = { "error", "warn", "info", "debug", NULL };
+static int mylog_prio[] = { LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG };
+
+
+/* level for given name (error, warn, info, debug), or -1 */
+int mylog_level_name(const char *name) {
+  int i;
+
+  for(i=0; mylog_names[i] != NULL; i++)
+    if (strcmp(name, mylog_names[i]) == 0)
+      return(i);
+  return(-1);
+}
+
+/* set log level and output (file, or syslog if 'use_syslog'). Until
+   the logger thread is started, messages are written directly */
+int mylog_init(int level, const char *file, int use_syslog) {
+  if ((level < MYLOG_ERROR)||(level > MYLOG_DEBUG))
+    return(0);
+  mylog_level = level;
+  if (file != NULL) {
+    mylog_file = strdup(file);
+    if (mylog_file == NULL)
+      return(0);
+  }
+  mylog_syslog = use_syslog;
+  if (use_syslog)
+    openlog("webfs", LOG_PID, LOG_DAEMON);
+  return(1);
+}
+
 int mylog_clean() {
   FILE *f;
-  f = fopen("/tmp/webfs.log", "w");
+  f = fopen(mylog_file, "w");
   if (f != NULL)
     fclose(f);
   return(1);
 }
 
-int mylog(const char *fmt, ...) {
-  FILE *f;
-  int ret;
-  va_list ap;
-return(0);
-  f = fopen("/tmp/webfs.log", "a");
+/* write a message to the output */
+static void mylog_write(FILE *f, int id, LogMsg *msg) {
+  struct tm tm;
+  int lng;
+
+  if (mylog_syslog) {
+    syslog(mylog_prio[msg->level], "%s", msg->text);
+    return;
+  }
   if (f == NULL)
+    return;
+  localtime_r(&(msg->stamp.tv_sec), &tm);
+  lng = strlen(msg->text);
+  fprintf(f, "%02d:%02d:%02d.%06ld %-5s t%d: %s%s", tm.tm_hour, tm.tm_min,
+          tm.tm_sec, (long)msg->stamp.tv_usec, mylog_names[msg->level], id,
+          msg->text, ((lng > 0)&&(msg->text[lng-1] == '\n'))?"":"\n");
+}
+
+/* end of a thread: its ring is freed by the logger once empty */
+static void mylog_thread_end(void *data) {
+  __atomic_store_n(&(((LogRing*)data)->dead), 1, __ATOMIC_RELEASE);
+}
+
+/* ring of the current thread (created at first use) */
+static LogRing *mylog_get_ring() {
+  LogRing *ring;
+
+  if (mylog_ring != NULL)
+    return(mylog_ring);
+  ring = malloc(sizeof(LogRing));
+  if (ring == NULL)
+    return(NULL);
+  ring->head = ring->tail = ring->lost = 0;
+  ring->dead = 0;
+  pthread_mutex_lock(&mylog_lock);
+  ring->id = ++mylog_ids;
+  ring->next = mylog_rings;
+  mylog_rings = ring;
+  pthread_mutex_unlock(&mylog_lock);
+  pthread_setspecific(mylog_key, ring);
+  mylog_ring = ring;
+  return(ring);
+}
+
+/* write all waiting messages. returns the number of messages */
+static int mylog_drain() {
+  LogRing *ring, **prev;
+  LogMsg lost;
+  unsigned int head, tail, nlost;
+  int nb=0;
+
+  pthread_mutex_lock(&mylog_lock);
+  prev = &mylog_rings;
+  while((ring = *prev) != NULL) {
+    head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+    for(tail=ring->tail; tail != head; tail++, nb++)
+      mylog_write(mylog_out, ring->id, &(ring->msgs[tail%LOG_RING]));
+    __atomic_store_n(&(ring->tail), tail, __ATOMIC_RELEASE);
+    nlost = __atomic_exchange_n(&(ring->lost), 0, __ATOMIC_RELAXED);
+    if (nlost > 0) {
+      gettimeofday(&(lost.stamp), NULL);
+      lost.level = MYLOG_WARN;
+      snprintf(lost.text, LOG_MSG, "%u messages lost (log ring full)", nlost);
+      mylog_write(mylog_out, ring->id, &lost);
+    }
+    /* thread ended and nothing more to write */
+    if (__atomic_load_n(&(ring->dead), __ATOMIC_ACQUIRE)&&
+        (__atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE) == tail)) {
+      *prev = ring->next;
+      free(ring);
+      continue;
+    }
+    prev = &(ring->next);
+  }
+  pthread_mutex_unlock(&mylog_lock);
+  return(nb);
+}
+
+/* the logger thread: write messages until stopped */
+static void *mylog_loop(void *data) {
+  struct timespec wait = { 0, 5000000 };  /* 5ms */
+
+  (void)data;
+  while(1) {
+    if (mylog_drain() > 0)
+      continue;
+    if (__atomic_load_n(&mylog_end, __ATOMIC_ACQUIRE))
+      break;
+    if (mylog_out != NULL)
+      fflush(mylog_out);
+    nanosleep(&wait, NULL);
+  }
+  mylog_drain();
+  return(NULL);
+}
+
+/* start the logger thread. Messages are then put in a per-thread
+   ring, and written by this thread (must be called after any fork) */
+int mylog_start() {
+  if (mylog_running)
+    return(1);
+  if (!mylog_syslog) {
+    mylog_out = fopen(mylog_file, "a");
+    if (mylog_out == NULL)
+      return(0);
+  }
+  if (pthread_key_create(&mylog_key, mylog_thread_end) != 0)
+    return(0);
+  mylog_end = 0;
+  if (pthread_create(&mylog_thread, NULL, mylog_loop, NULL) != 0)
+    return(0);
+  __atomic_store_n(&mylog_running, 1, __ATOMIC_RELEASE);
+  return(1);
+}
+
+/* stop the logger thread, after all messages are written */
+int mylog_stop() {
+  if (!mylog_running)
+    return(1);
+  __atomic_store_n(&mylog_running, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&mylog_end, 1, __ATOMIC_RELEASE);
+  pthread_join(mylog_thread, NULL);
+  /* late messages of other threads, if any */
+  mylog_drain();
+  if (mylog_out != NULL)
+    fclose(mylog_out);
+  mylog_out = NULL;
+  return(1);
+}
+
+/* put a message in the ring of the thread, or write it directly if
+   the logger thread is not running */
+static int mylog_push(int level, const char *fmt, va_list ap) {
+  LogRing *ring;
+  LogMsg *msg, direct;
+  unsigned int head;
+  FILE *f;
+
+  if (!__atomic_load_n(&mylog_running, __ATOMIC_ACQUIRE)) {
+    /* no logger: single thread (startup, exit) */
+    gettimeofday(&(direct.stamp), NULL);
+    direct.level = level;
+    vsnprintf(direct.text, LOG_MSG, fmt, ap);
+    f = mylog_syslog?NULL:fopen(mylog_file, "a");
+    mylog_write(f, 0, &direct);
+    if (f != NULL)
+      fclose(f);
+    return(1);
+  }
+  ring = mylog_get_ring();
+  if (ring == NULL)
     return(0);
+  head = ring->head;
+  if (head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE) >= LOG_RING) {
+    /* full: never wait */
+    __atomic_fetch_add(&(ring->lost), 1, __ATOMIC_RELAXED);
+    return(0);
+  }
+  msg = &(ring->msgs[head%LOG_RING]);
+  gettimeofday(&(msg->stamp), NULL);
+  msg->level = level;
+  vsnprintf(msg->text, LOG_MSG, fmt, ap);
+  __atomic_store_n(&(ring->head), head+1, __ATOMIC_RELEASE);
+  return(1);
+}
 
+/* print into logfile, at given level */
+int mylogl(int level, const char *fmt, ...) {
+  va_list ap;
+  int ret;
+
+  if (level > mylog_level)
+    return(0);
   va_start(ap, fmt);
-  ret = vfprintf(f, fmt, ap);
+  ret = mylog_push(level, fmt, ap);
   va_end(ap);
+  return(ret);
+}
+
+/* print into logfile (debug level) */
+int mylog(const char *fmt, ...) {
+  va_list ap;
+  int ret;
 
-  fclose(f);
+  if (mylog_level < MYLOG_DEBUG)
+    return(0);
+  va_start(ap, fmt);
+  ret = mylog_push(MYLOG_DEBUG, fmt, ap);
+  va_end(ap);
   return(ret);
 }
 
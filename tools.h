@@ -14,12 +14,34 @@ extern int opt_exec_files;
 
 /* various */
 #define MIN(a,b) ((a)<(b)?(a):(b))
+#define MAX(a,b) ((a)>(b)?(a):(b))
 
 
 /* logs */
+/* log levels */
+#define MYLOG_ERROR 0
+#define MYLOG_WARN  1
+#define MYLOG_INFO  2
+#define MYLOG_DEBUG 3
+
+/* messages above this level are ignored */
+extern int mylog_level;
+
+/* set log level and output (file, or syslog if 'use_syslog'). Until
+   the logger thread is started, messages are written directly */
+int mylog_init(int level, const char *file, int use_syslog);
+/* start the logger thread. Messages are then put in a per-thread
+   ring, and written by this thread (must be called after any fork) */
+int mylog_start();
+/* stop the logger thread, after all messages are written */
+int mylog_stop();
+/* level for given name (error, warn, info, debug), or -1 */
+int mylog_level_name(const char *name);
 /* reset log file */
 int mylog_clean();
-/* print into logfile */
+/* print into logfile, at given level */
+int mylogl(int level, const char *fmt, ...);
+/* print into logfile (debug level) */
 int mylog(const char *fmt, ...);
 
 /* return a hash using given string */
@@ -5,17 +5,15 @@
 int tree_debug = 0;
 
 
-/* this is the root node, always created */
-Node root={NULL,0,0,0,0,0,0,0,NULL,NULL,NULL,0,0,0,NULL};
+/* the live tree. its root node is always created */
+static Tree live;
 /* timestamp of the tree content. to be compared with meta-data
     to decide if an update is needed */
 unsigned int update=0;
 
-
-/* hash table for nodes */
-Node **hash_nodes=NULL;
-unsigned int hash_size=0;
-unsigned int hash_col=0;
+/* marker for a removed entry in hash. As its fullname is NULL
+   it is skipped by searches */
+Node hash_removed={NULL,0,0,0,0,0,0,0,NULL,NULL,NULL,0,0,0,NULL};
 
 
 /* note: this hash system is not very nice. In particular you
@@ -23,99 +21,159 @@ unsigned int hash_col=0;
 
 
 /* put hash */
-int tree_push_hash(const char *name, Node *node) {
+int tree_push_hash(Tree *t, const char *name, Node *node) {
   unsigned int hash;
   int cnt = 0;
   
-  if ((node == NULL)||(hash_nodes == NULL))
+  if ((node == NULL)||(t->hash_nodes == NULL))
     return(0);
-  hash = str_hash(name)%hash_size;
+  hash = str_hash(name)%t->hash_size;
   /* if not available, search a free place */
-  if (hash_nodes[hash] != NULL) {
-    while(hash_nodes[hash] != NULL) {
-      hash_col++;
-      hash = (hash+1)%hash_size;
+  if ((t->hash_nodes[hash] != NULL)&&(t->hash_nodes[hash] != &hash_removed)) {
+    while((t->hash_nodes[hash] != NULL)&&(t->hash_nodes[hash] != &hash_removed)) {
+      t->hash_col++;
+      hash = (hash+1)%t->hash_size;
       cnt++;
-      if (cnt >= hash_size) {
+      if (cnt >= t->hash_size) {
         /* eek. hash table smaller than number of entries. Kill! */
 	exit(9);
       }
     }
   }
   /* insert */
-  hash_nodes[hash] = node;
+  if (t->hash_nodes[hash] == NULL)
+    t->hash_fill++;
+  t->hash_nodes[hash] = node;
+  
+  return(0);
+}
+
+/* remove a node from hash */
+int tree_pop_hash(Tree *t, Node *node) {
+  unsigned int hash;
   
+  if ((node == NULL)||(node->fullname == NULL)||(t->hash_nodes == NULL))
+    return(0);
+  hash = str_hash(node->fullname)%t->hash_size;
+  while(t->hash_nodes[hash] != NULL) {
+    if (t->hash_nodes[hash] == node) {
+      t->hash_nodes[hash] = &hash_removed;
+      return(1);
+    }
+    hash = (hash+1)%t->hash_size;
+  }
   return(0);
 }
 
 /* search in hash */
-Node *tree_search_hash(const char *name) {
+Node *tree_search_hash(Tree *t, const char *name) {
   unsigned int hash;
 mylog("::tree_search_hash(%s)\n", name);
-  if (hash_nodes == NULL)
+  if (t->hash_nodes == NULL)
     return(NULL);
 
-  hash = str_hash(name+1)%hash_size;
+  hash = str_hash(name+1)%t->hash_size;
 mylog(":::tree_search_hash: hash value is %u\n", hash);
   /* loop to find the good one */
-  while(hash_nodes[hash] != NULL) {
+  while(t->hash_nodes[hash] != NULL) {
     /* prevent NULL entries */
-    if (hash_nodes[hash]->fullname == NULL) {
-      hash = (hash+1)%hash_size;
+    if (t->hash_nodes[hash]->fullname == NULL) {
+      hash = (hash+1)%t->hash_size;
       continue;
     }
-    if (strcmp(hash_nodes[hash]->fullname, name+1) == 0) {
-      return(hash_nodes[hash]);
+    if (strcmp(t->hash_nodes[hash]->fullname, name+1) == 0) {
+      return(t->hash_nodes[hash]);
     }
-    hash = (hash+1)%hash_size;
+    hash = (hash+1)%t->hash_size;
   }
 
   return(NULL);
 }
 
-int tree_init_hash(int size) {
+int tree_init_hash(Tree *t, int size) {
     int i;
 
   /* re-alloc hash-table */
-  if (hash_nodes != NULL)
-    free(hash_nodes);
+  if (t->hash_nodes != NULL)
+    free(t->hash_nodes);
   
-  hash_size = size + 0.9*size;
-  hash_nodes = malloc(sizeof(Node*)*hash_size);
+  t->hash_size = size + 0.9*size;
+  if (t->hash_size < 16)
+    t->hash_size = 16;
+  t->hash_fill = 0;
+  t->hash_nodes = malloc(sizeof(Node*)*t->hash_size);
 
-  if (hash_nodes == NULL) {
+  if (t->hash_nodes == NULL) {
     /* hash disabled... */
     return(0);
   }
   /* init */
-  for(i=0; i<hash_size; i++) {
-    hash_nodes[i] = NULL;
+  for(i=0; i<t->hash_size; i++) {
+    t->hash_nodes[i] = NULL;
   }
   return(1);
 }
 
+/* recursive part of tree_rehash. / is found without hash */
+void r_tree_rehash(Tree *t, Node *node) {
+  int i;
+
+  if (node->parent != node)
+    tree_push_hash(t, node->fullname, node);
+  for(i=0; i<node->nb_entries; i++)
+    if (node->entries[i] != NULL)
+      r_tree_rehash(t, node->entries[i]);
+}
+
+/* re-build the hash table with a size suitable for current
+   number of entries (and no more removed entries) */
+int tree_rehash(Tree *t) {
+  mylog("tree_rehash(): %d entries, %u/%u used\n", t->nb, t->hash_fill, t->hash_size);
+  if (!tree_init_hash(t, 2*t->nb+16))
+    return(0);
+  r_tree_rehash(t, &(t->root));
+  return(1);
+}
+
+/* empty tree (only /) */
+void tree_zero(Tree *t) {
+  t->root.parent = &(t->root);
+  t->root.stamp = 0;
+  t->root.name = "/";
+  t->root.fullname = "/";
+  t->root.file = 0;
+  t->root.special = 0;
+  t->root.entries = NULL;
+  t->root.nb_entries = 0;
+  t->root.m_own = 7;
+  t->root.m_grp = t->root.m_other = 5;
+  t->root.symlink = NULL;
+  t->root.shard = NULL;
+  t->root.shard_update = t->root.shard_next = 0;
+  t->root.shard_loading = 0;
+  t->root.target = NULL;
+  t->root.target_lng = 0;
+  t->root.fail_until = t->root.fail_stamp = 0;
+  t->root.fail_err = 0;
+  t->hash_nodes = NULL;
+  t->hash_size = 0;
+  t->hash_col = 0;
+  t->hash_fill = 0;
+  t->nb = 0;
+}
 
 /* initialize FS tree. Do not call on an existing tree, as it
    will not cleanup the allocated memory */
 void tree_init() {
-  root.parent = &root;
-  root.stamp = 0;
-  root.name = "/";
-  root.fullname = "/";
-  root.file = 0;
-  root.special = 0;
-  if (root.entries != NULL)
-    free(root.entries);
-  root.entries = NULL;
-  root.nb_entries = 0;
-  root.m_own = 7;
-  root.m_grp = root.m_other = 5;
-  root.symlink = NULL;
+  if (live.root.entries != NULL)
+    free(live.root.entries);
+  tree_zero(&live);
   update = 0;
-  
-  hash_nodes = NULL;
-  hash_size = 0;
-  hash_col = 0;
+}
+
+/* number of entries in tree */
+int tree_count() {
+  return(live.nb);
 }
 
 /* recursive function for tree_free */
@@ -134,52 +192,77 @@ void r_tree_free(Node *node) {
     free(node->fullname);
   if (node->symlink != NULL)
     free(node->symlink);
+  if (node->shard != NULL)
+    free(node->shard);
+  if (node->target != NULL)
+    free(node->target);
   if (node->entries != NULL)
     free(node->entries);
   free(node);
 }
 
+/* destroy the content of a tree (its root is kept) */
+void tree_clear(Tree *t) {
+  int i;
+
+  for(i=0; i<t->root.nb_entries; i++)
+    if (t->root.entries[i] != NULL)
+      r_tree_free(t->root.entries[i]);
+  if (t->root.entries != NULL)
+    free(t->root.entries);
+  t->root.entries = NULL;
+  t->root.nb_entries = 0;
+  if (t->hash_nodes != NULL)
+    free(t->hash_nodes);
+  t->hash_nodes = NULL;
+}
+
 /* cleanup all the tree */
 void tree_free() {
-  int i;
-  for(i=0; i<root.nb_entries; i++)
-    if (root.entries[i] != NULL)
-      r_tree_free(root.entries[i]);
-  if (hash_nodes != NULL)
-    free(hash_nodes);
+  tree_clear(&live);
   tree_init(); /* root never destroyed */
 }
 
 
-/* search the node corresponding to given entry */
-Node *tree_search(const char *path) {
+/* search the node corresponding to given entry in tree 't' */
+Node *tree_search_in(Tree *t, const char *path) {
   char *mpath;
   char *cur;
   Node *node;
-  int ok, i;
+  int ok, i, lng;
 mylog("::tree_search(%s)\n", path);
   /* easy: / */
   if (strcmp(path, "/") == 0) {
 mylog(":::tree_search: this is sparta!\n");
-    return(&root);
+    return(&(t->root));
   }
   
   /* if available, we use hash table */
-  if (hash_nodes != NULL) {
+  if (t->hash_nodes != NULL) {
 mylog(":::tree_search: using hash...\n");
-    return(tree_search_hash(path));
+    return(tree_search_hash(t, path));
   }
   
 mylog(":::tree_search: using recursive...\n");
   /* if no hash, use old search method */
-  mpath = strdup(path+1);
+  node = &(t->root);
+  if (node->parent != node) {
+    /* content of a sharded dir, built aside: names start with the
+       name of the dir */
+    lng = strlen(node->fullname);
+    if ((strncmp(path+1, node->fullname, lng) != 0)||
+        ((path[lng+1] != '/')&&(path[lng+1] != '\0')))
+      return(NULL);
+    mpath = strdup(path+1+lng);
+  } else {
+    mpath = strdup(path+1);
+  }
   if (mpath == NULL)
     return(NULL);
 
 
   /* search 1st part in /, them 2nd in node found, then... */  
   cur = strtok(mpath, "/");
-  node = &root;
   while(cur != NULL) {
 
     ok = 0;
@@ -202,6 +285,11 @@ mylog(":::tree_search: using recursive...\n");
   return(node);
 }
 
+/* search the node corresponding to given entry */
+Node *tree_search(const char *path) {
+  return(tree_search_in(&live, path));
+}
+
 
 /* recursive part of tree_search_inode */
 Node *r_tree_search_inode(unsigned int inode, Node *node) {
@@ -230,7 +318,7 @@ Node *r_tree_search_inode(unsigned int inode, Node *node) {
    returns pointer to the Node or NULL if not found */
 Node *tree_search_inode(unsigned int inode) {
 
-  return(r_tree_search_inode(inode, &root));
+  return(r_tree_search_inode(inode, &(live.root)));
 
 }
 
@@ -275,15 +363,14 @@ void r_tree_print(Node *node) {
 
 /* debug: print tree */
 void tree_print() {
-  printf("Tree (update=%u, collisions in hash: %u):\n", update, hash_col);
-  r_tree_print(&root);
+  printf("Tree (update=%u, collisions in hash: %u):\n", update, live.hash_col);
+  r_tree_print(&(live.root));
 }
 
 
-/* returns the 'dirname' of path. path should not ends with a /.
-   use a buffer. Do not free it, do not use in thread context */
-char *tree_dirname(char *path) {
-  static char buffer[MAX_NAME];
+/* returns the 'dirname' of path (in 'buffer', MAX_NAME bytes). path
+   should not ends with a / */
+char *tree_dirname(char *path, char *buffer) {
   int i;
 
   if (path[0] != '/') {
@@ -373,177 +460,668 @@ int r_tree_update_links(Node *node) {
 }
 
 int tree_update_links() {
-  return(r_tree_update_links(&root));
+  return(r_tree_update_links(&(live.root)));
 }
 
+/* number of links of a dir: its sub-dirs, plus . and .. */
+void tree_set_links(Node *node) {
+  int i, nb = 0;
 
-/* create tree from FS description (tree must be cleaned)
-   returns the number of item created (or <= 0 on error) */
-int tree_create(FILE *f) {
-  char name[MAX_NAME], target[MAX_NAME], mode[8];
-  int file, ret, nb, nbt;
-  unsigned int stamp, size, links, inode;
-  char *dirname, *cret;
-  Node *node;
-  int fp, special;
-  int line = 0;
+  for(i=0; i<node->nb_entries; i++)
+    if ((node->entries[i] != NULL)&&(!node->entries[i]->file))
+      nb++;
+  node->links = nb+2;
+}
 
-  line = 1;
-  if(fscanf(f, "%u", &update) != 1) {
-    fprintf(stderr, "Bad format (line %d)!\n", line);
-    return(0);
+
+/* fill a node with given values (from an entry block) */
+void tree_set_entry(Node *node, int file, unsigned int size,
+                    unsigned int inode, unsigned int stamp,
+                    unsigned int links, char *mode, char *target) {
+  int special;
+
+  if (file >= 100) {
+    /* it is a file */
+    special = file-100; /* type of special file */
+    file = 1; /* force file */
+  } else {
+    special = 0;
   }
-  line++;
-  if(fscanf(f, "%d", &nbt) != 1) {
-    fprintf(stderr, "Bad format (line %d)!\n", line);
-    return(0);
+  /* if symlink, use target length */
+  if (file == 2) {
+    node->size = strlen(target);
+  } else {
+    node->size = size;
+  }
+  node->stamp = stamp;
+  node->links = links;
+  node->inode = inode;
+  node->file = (file==1)||(file==2); /* symlinks are files */
+  node->special = special;
+  tree_set_mode(node, mode);
+  if (node->symlink != NULL)
+    free(node->symlink);
+  node->symlink = NULL;
+  /* sharded dir: the "target" is its metadata file */
+  if (file == 3) {
+    if ((node->shard == NULL)||(strcmp(node->shard, target) != 0))
+      node->shard_update = 0;  /* (re)load content when needed */
+    if (node->shard != NULL)
+      free(node->shard);
+    node->shard = strdup(target);
+    return;
+  }
+  if (node->shard != NULL)
+    free(node->shard);
+  node->shard = NULL;
+  if (target[0] != '\0')
+    node->symlink = strdup(target);
+}
+
+/* add a new entry in tree 't' (its dirname must exist)
+   returns the new node, or NULL if failed */
+Node *tree_add_entry(Tree *t, int file, unsigned int size,
+                     unsigned int inode, unsigned int stamp,
+                     unsigned int links, char *mode, char *name,
+                     char *target) {
+  char buffer[MAX_NAME];
+  char *dirname;
+  Node *node, *new;
+  int fp;
+
+  /* search the dirname */
+  dirname = tree_dirname(name, buffer);
+  /* search corresponding node */
+  node = tree_search_in(t, dirname);
+  if (node == NULL) {
+    fprintf(stderr, "Entry '%s': can't find dirname node (for '%s').\n",
+                     name, dirname);
+    return(NULL);
+  }
+  /* check that it is a directory */
+  if (node->file) {
+    fprintf(stderr, "Entry '%s': dirname node '%s' is a file!\n",
+                     name, dirname);
+    return(NULL);
+  }
+  //printf("# -> dirname = '%s' (node=%p)\n", dirname, node);
+  
+  /* allocate it */
+  new = malloc(sizeof(Node));
+  if (new == NULL) {
+    fprintf(stderr, "Failed to allocate a node. Ignoring '%s'.\n", name);
+    return(NULL);
+  }
+
+  /* keep enough free places in hash, else searches are slow (and
+     insertion can't end) */
+  if ((t->hash_nodes != NULL)&&((t->hash_fill+1)*10 >= t->hash_size*8))
+    tree_rehash(t);
+
+  /* create a new node */
+  fp = tree_add_node(node);
+  if (fp < 0) {
+    fprintf(stderr, "Failed to increase entries list size. Node probably lost.\n");
+    fprintf(stderr, "We're in big trouble! Dying badly...\n");
+    exit(66);
   }
+  node->entries[fp] = new;
+  
+  //printf("# adding node (%p) add pos %d in entry %p\n", node->entries[fp], fp, node);
+  
+  /* fill it */
+  new->parent = node;
+  new->symlink = NULL;
+  new->shard = NULL;
+  new->shard_update = new->shard_next = 0;
+  new->shard_loading = 0;
+  new->target = NULL;
+  new->target_lng = 0;
+  new->fail_until = new->fail_stamp = 0;
+  new->fail_err = 0;
+  tree_set_entry(new, file, size, inode, stamp, links, mode, target);
+  if (strcmp(dirname, "/") == 0)
+    new->name = strdup(name);
+  else
+    new->name = strdup(name+strlen(dirname));
+  new->fullname = strdup(name);
+  new->nb_entries = 0;
+  new->entries = NULL;
+
+  tree_push_hash(t, name, new);
+
+  /* lack checking for failed strdup() */
+
+  t->nb++;
+  return(new);
+}
+
+/* count entries in a sub-tree */
+int r_tree_count(Node *node) {
+  int i, nb=1;
+
+  for(i=0; i<node->nb_entries; i++)
+    if (node->entries[i] != NULL)
+      nb += r_tree_count(node->entries[i]);
+  return(nb);
+}
+
+/* remove a sub-tree from hash */
+void r_tree_unhash(Tree *t, Node *node) {
+  int i;
+
+  tree_pop_hash(t, node);
+  for(i=0; i<node->nb_entries; i++)
+    if (node->entries[i] != NULL)
+      r_tree_unhash(t, node->entries[i]);
+}
 
-  /* initialise hash table */
-  tree_init_hash(nbt);
+/* remove an entry (and its content for a dir) from tree
+   returns 1 if removed, 0 if not found */
+int tree_remove_entry(Node *node) {
+  Node *parent;
+  int i, j;
 
-  /* data for / */
-  ret = fscanf(f, "%d%u%u%u%u%s", &file, &size, &inode, &stamp, &links, mode);
-  line++;
-  if (ret != 6) {
-    fprintf(stderr, "Bad format (line %d)!\n", line);
+  if ((node == NULL)||(node == &(live.root)))
     return(0);
+  parent = node->parent;
+  for(i=0; i<parent->nb_entries; i++)
+    if (parent->entries[i] == node)
+      break;
+  if (i >= parent->nb_entries)
+    return(0);  /* should not occur */
+  /* remove it from its parent */
+  for(j=i; j<parent->nb_entries-1; j++)
+    parent->entries[j] = parent->entries[j+1];
+  parent->nb_entries--;
+  if (parent->nb_entries == 0) {
+    free(parent->entries);
+    parent->entries = NULL;
+  }
+  /* destroy it */
+  live.nb -= r_tree_count(node);
+  r_tree_unhash(&live, node);
+  r_tree_free(node);
+  return(1);
+}
+
+/* search the nearest sharded dir containing 'node' (or NULL) */
+Node *tree_shard_of(Node *node) {
+  while(node != &(live.root)) {
+    node = node->parent;
+    if (node->shard != NULL)
+      return(node);
   }
-  cret = fgets(name, MAX_NAME, f); /* remove \n */
-  cret = fgets(name, MAX_NAME, f);
-  line++;
-  if (cret == NULL) {
-    fprintf(stderr, "Bad format (line %d)!\n", line);
+  return(NULL);
+}
+
+/* opening 'node' failed with error 'err': opens of this version of
+   the file fail at once until 'until' (unix time). Called with the
+   tree read locked: fields are atomic */
+void tree_set_failed(Node *node, unsigned int until, int err) {
+  __atomic_store_n(&(node->fail_stamp), node->stamp, __ATOMIC_RELAXED);
+  __atomic_store_n(&(node->fail_err), err, __ATOMIC_RELAXED);
+  __atomic_store_n(&(node->fail_until), until, __ATOMIC_RELEASE);
+}
+
+/* error of opening 'node' if it failed before 'now' (see
+   tree_set_failed), else 0. a new version of the file (metadata
+   update) is tried again */
+int tree_failed(Node *node, unsigned int now) {
+  if (__atomic_load_n(&(node->fail_until), __ATOMIC_ACQUIRE) <= now)
+    return(0);
+  if (__atomic_load_n(&(node->fail_stamp), __ATOMIC_RELAXED) != node->stamp)
     return(0);
+  return(__atomic_load_n(&(node->fail_err), __ATOMIC_RELAXED));
+}
+
+/* initialise a parser for a metadata content ('delta' false) or for
+   a delta content ('delta' true) (see DescriptionFormat.txt).
+   if 'check' is true, parsing stops if content is not newer than
+   the live tree (always true for delta).
+   'changed' (if not NULL) is called with the fullname of each entry
+   changed or removed by a delta, before the change */
+void tree_parse_init(TreeParser *p, int delta, int check,
+                     void (*changed)(const char *name)) {
+  p->delta = delta;
+  p->check = check;
+  p->changed = changed;
+  p->state = TP_STAMP;
+  p->status = TP_RUN;
+  p->line = 0;
+  p->nb = 0;
+  p->nbt = 0;
+  p->stamp = 0;
+  p->base = 0;
+  p->built = 0;
+  p->shard = 0;
+  p->shard_name[0] = '\0';
+  p->shard_stamp = 0;
+  p->changes = NULL;
+  p->nb_changes = 0;
+  p->max_changes = 0;
+}
+
+/* initialise a parser for the content of sharded dir 'dir'. Same
+   format than metadata content, but without the / entry: all entries
+   must be inside 'dir'.
+   if 'check' is true, parsing stops if content is not newer than
+   current content of the dir */
+void tree_parse_init_shard(TreeParser *p, Node *dir, int check) {
+  tree_parse_init(p, 0, check, NULL);
+  p->shard = 1;
+  snprintf(p->shard_name, MAX_NAME, "%s", dir->fullname);
+  p->shard_stamp = dir->shard_update;
+}
+
+/* stop parser on bad format */
+int tree_parse_error(TreeParser *p) {
+  fprintf(stderr, "Bad %sformat (line %d)!\n", p->delta?"delta ":"", p->line);
+  p->status = TP_ERROR;
+  return(0);
+}
+
+/* the current entry of the parser is complete: create it (or apply
+   it for a delta) */
+void tree_parse_entry(TreeParser *p, char *target) {
+  TreeChange *change;
+  Node *root;
+  int lng;
+
+  /* content of a sharded dir */
+  if (p->shard) {
+    lng = strlen(p->shard_name);
+    if ((strncmp(p->name+1, p->shard_name, lng) != 0)||
+        (p->name[lng+1] != '/')) {
+      fprintf(stderr, "Entry '%s' not in sharded dir '%s'.\n", p->name+1,
+                      p->shard_name);
+      tree_parse_error(p);
+      return;
+    }
+    if (tree_add_entry(&(p->tree), p->file, p->size, p->inode, p->estamp,
+                       p->links, p->mode, p->name+1, target) != NULL)
+      p->nb++;
+    return;
   }
-  if (name[strlen(name)-1] == '\n')
-    name[strlen(name)-1] = '\0';
-printf("# read: %d %u %u %u %u %s %s\n", file, inode, size, stamp, links, mode, name);
-
-  root.parent = &root;
-  root.m_own = 7;
-  root.m_grp = root.m_other = 5;  /* ignore mode for / */
-  root.inode = inode;
-  root.file = 0;  /* / always a dir */
-  root.special = 0;  /* never occur for / */
-  root.size = size;
-  root.links = links;
-  root.stamp = stamp;
-  root.symlink = NULL;  /* / never a symlink */
-  root.fullname = "/";
-  nb = 1;  /* number of created entries */
-
-  tree_push_hash("/", &root);
-
-  /* now treat all entries */
-  while(1) {
-    ret = fscanf(f, "%d%u%u%u%u%s", &file, &size, &inode, &stamp, &links, mode);
-    line++;
-    if (feof(f)||(ret != 6))
-      break;
-    cret = fgets(name, MAX_NAME, f); /* remove \n */
-    cret = fgets(name, MAX_NAME, f);
-    line++;
-    if (cret == NULL) {
-      fprintf(stderr, "Bad format (line %d)!\n", line);
-      return(0);
+
+  /* first entry of a metadata file: / */
+  if ((!p->delta)&&(p->nb == 0)) {
+printf("# read: %d %u %u %u %u %s %s\n", p->file, p->inode, p->size, p->estamp, p->links, p->mode, p->name+1);
+    root = &(p->tree.root);
+    root->parent = root;
+    root->m_own = 7;
+    root->m_grp = root->m_other = 5;  /* ignore mode for / */
+    root->inode = p->inode;
+    root->file = 0;  /* / always a dir */
+    root->special = 0;  /* never occur for / */
+    root->size = p->size;
+    root->links = p->links;
+    root->stamp = p->estamp;
+    root->symlink = NULL;  /* / never a symlink */
+    root->fullname = "/";
+    p->nb = 1;  /* number of created entries */
+    p->tree.nb = 1;
+    return;
+  }
+
+  if (!p->delta) {
+    if (tree_add_entry(&(p->tree), p->file, p->size, p->inode, p->estamp,
+                       p->links, p->mode, p->name+1, target) != NULL)
+      p->nb++;
+    return;
+  }
+
+  /* delta: kept until applied to the live tree */
+  if (p->nb_changes >= p->max_changes) {
+    change = realloc(p->changes, sizeof(TreeChange)*(2*p->max_changes+16));
+    if (change == NULL) {
+      fprintf(stderr, "Failed to keep the changes of delta.\n");
+      p->status = TP_ERROR;
+      return;
     }
-    if (name[strlen(name)-1] == '\n')
-      name[strlen(name)-1] = '\0';
-    //printf("# read: %d %u %u %u %u %s %s\n", file, inode, size, stamp, links, mode, name);
-    if (file >= 100) {
-      /* it is a file */
-      special = file-100; /* type of special file */
-      file = 1; /* force file */
-    } else {
-      special = 0;
+    p->changes = change;
+    p->max_changes = 2*p->max_changes+16;
+  }
+  change = &(p->changes[p->nb_changes]);
+  change->name = strdup(p->name);
+  change->target = strdup(target);
+  if ((change->name == NULL)||(change->target == NULL)) {
+    free(change->name);
+    free(change->target);
+    fprintf(stderr, "Failed to keep the changes of delta.\n");
+    p->status = TP_ERROR;
+    return;
+  }
+  change->op = p->op;
+  change->file = p->file;
+  change->size = p->size;
+  change->inode = p->inode;
+  change->estamp = p->estamp;
+  change->links = p->links;
+  strcpy(change->mode, p->mode);
+  p->nb_changes++;
+  p->nb++;
+}
+
+/* apply a change of delta to the live tree
+   returns 1 if applied, 0 if nothing to do, -1 if failed */
+int tree_apply_change(TreeParser *p, TreeChange *change) {
+  Node *node, *parent;
+
+  /* names are searched with the initial / */
+  node = tree_search(change->name);
+  if (change->op == '-') {
+    if (node == NULL)
+      return(0);  /* already removed */
+    if (p->changed != NULL)
+      p->changed(change->name+1);
+    parent = node->parent;
+    tree_remove_entry(node);
+    tree_set_links(parent);
+    return(1);
+  }
+  /* added or changed: same treatment, as the entry may already be
+     there (i.e. a delta applied twice) */
+  if (node != NULL) {
+    if (p->changed != NULL)
+      p->changed(change->name+1);
+    if (node->file == ((change->file != 0)&&(change->file != 3))) {
+      /* same kind of entry: just change it */
+      tree_set_entry(node, change->file, change->size, change->inode,
+                     change->estamp, change->links, change->mode,
+                     change->target);
+      if (!node->file)
+        tree_set_links(node);
+      return(1);
     }
-    
-    /* if symlink, read target */
-    if (file == 2) {
-      cret = fgets(target, MAX_NAME, f);
-      line++;
-      if (cret == NULL) {
-        fprintf(stderr, "Bad format (line %d)!\n", line);
-        return(0);
+    /* file to dir (or the reverse): re-create it */
+    tree_remove_entry(node);
+  }
+  node = tree_add_entry(&live, change->file, change->size, change->inode,
+                        change->estamp, change->links, change->mode,
+                        change->name+1, change->target);
+  if (node == NULL)
+    return(-1);  /* the delta does not match the tree */
+  if (!node->file)
+    tree_set_links(node);
+  tree_set_links(node->parent);
+  return(1);
+}
+
+/* give a line (without the final \n) to the parser
+   returns 1 if more lines are expected, 0 if parsing stopped (see
+   p->status) */
+int tree_parse_line(TreeParser *p, char *line) {
+  unsigned int val;
+  char op[4];
+  int n;
+
+  if (p->status != TP_RUN)
+    return(0);
+  p->line++;
+  /* empty lines are only allowed before numbers */
+  if ((line[0] == '\0')&&(p->state != TP_NAME)&&(p->state != TP_TARGET))
+    return(1);
+
+  switch(p->state) {
+    case TP_STAMP:
+      if (sscanf(line, "%u", &val) != 1)
+        return(tree_parse_error(p));
+      if (p->delta) {
+        p->base = val;
+      } else if (p->shard) {
+        if (p->check && (val <= p->shard_stamp)) {
+          p->status = TP_OLD;
+          return(0);
+        }
+        /* new content built aside, in a tree whose root stands for
+           the dir. the current one is used until the new one is
+           complete */
+        tree_zero(&(p->tree));
+        p->tree.root.parent = NULL;  /* not / */
+        p->tree.root.fullname = p->shard_name;
+        p->built = 1;
+        tree_init_hash(&(p->tree), 16);
+        tree_push_hash(&(p->tree), p->shard_name, &(p->tree.root));
+      } else {
+        /* not newer: do not go further */
+        if (p->check && (val <= update)) {
+          p->status = TP_OLD;
+          return(0);
+        }
+        /* start a new tree, built aside. the live one is used until
+           the new one is complete */
+        tree_zero(&(p->tree));
+        p->built = 1;
       }
-      if (target[strlen(name)-1] == '\n')
-        target[strlen(name)-1] = '\0';
-    } else {
-      target[0] = '\0';
-    }
+      p->stamp = val;
+      p->state = TP_COUNT;
+      return(1);
+    case TP_COUNT:
+      if (sscanf(line, "%u", &val) != 1)
+        return(tree_parse_error(p));
+      if (p->delta) {
+        p->stamp = val;
+        /* nothing new */
+        if (val <= update) {
+          p->status = TP_OLD;
+          return(0);
+        }
+        /* delta chain is broken: changes are missing between the
+           tree and the delta */
+        if (p->base > update) {
+          mylogl(MYLOG_INFO, "tree_parse_line: delta from %u, tree is %u\n", p->base, update);
+          p->status = TP_ERROR;
+          return(0);
+        }
+      } else if (!p->shard) {
+        /* initialise hash table */
+        p->nbt = (int)val;
+        tree_init_hash(&(p->tree), p->nbt);
+      }
+      p->state = TP_ENTRY;
+      return(1);
+    case TP_ENTRY:
+      n = 0;
+      if (p->delta) {
+        if (sscanf(line, "%3s%n", op, &n) != 1)
+          return(tree_parse_error(p));
+        if ((op[0] != '+')&&(op[0] != '~')&&(op[0] != '-'))
+          return(tree_parse_error(p));
+        p->op = op[0];
+        if (op[0] == '-') {
+          p->state = TP_NAME;
+          return(1);
+        }
+      }
+      if (sscanf(line+n, "%d%u%u%u%u%7s", &(p->file), &(p->size), &(p->inode),
+                 &(p->estamp), &(p->links), p->mode) != 6)
+        return(tree_parse_error(p));
+      p->state = TP_NAME;
+      return(1);
+    case TP_NAME:
+      if ((line[0] == '\0')||(strlen(line) >= MAX_NAME-1))
+        return(tree_parse_error(p));
+      p->name[0] = '/';
+      strcpy(p->name+1, line);
+      /* if symlink (or sharded dir), read target (metadata file) */
+      if (((p->file == 2)||(p->file == 3))&&(!p->delta || (p->op != '-'))) {
+        p->state = TP_TARGET;
+        return(1);
+      }
+      tree_parse_entry(p, "");
+      p->state = TP_ENTRY;
+      return(p->status == TP_RUN);
+    case TP_TARGET:
+      if (strlen(line) >= MAX_NAME)
+        return(tree_parse_error(p));
+      tree_parse_entry(p, line);
+      p->state = TP_ENTRY;
+      return(p->status == TP_RUN);
+  }
+  return(tree_parse_error(p));
+}
 
-    /* search the dirname */
-    dirname = tree_dirname(name);
-    /* search corresponding node */
-    node = tree_search(dirname);
-    if (node == NULL) {
-      fprintf(stderr, "Entry '%s': can't find dirname node (for '%s').\n",
-                       name, dirname);
-      continue;
-    }
-    /* check that it is a directory */
-    if (node->file) {
-      fprintf(stderr, "Entry '%s': dirname node '%s' is a file!\n",
-                       name, dirname);
-      continue;
-    }
-    //printf("# -> dirname = '%s' (node=%p)\n", dirname, node);
-    
-    /* create a new node */
-    fp = tree_add_node(node);
-    if (fp < 0) {
-      fprintf(stderr, "Failed to increase entries list size. Node probably lost.\n");
-      fprintf(stderr, "We're in big trouble! Dying badly...\n");
-      exit(66);
-    }
-    
-    /* allocate it */
-    node->entries[fp] = malloc(sizeof(Node));
-    if (node->entries[fp] == NULL) {
-      fprintf(stderr, "Failed to allocate a node. Ignoring '%s'.\n", name);
-      continue;
-      /* should reduce the table size, here... */
+/* end of parsing. 'ok' is false if content is incomplete (i.e. failed
+   download). The live tree is not used: no lock needed.
+   returns the number of entries created (metadata, sharded dir) or
+   changes to apply (delta), 0 if content is not newer than the tree,
+   or -1 on error */
+int tree_parse_end(TreeParser *p, int ok) {
+  /* content must end after a full entry */
+  if ((p->status == TP_RUN)&&(p->state != TP_ENTRY))
+    tree_parse_error(p);
+  if (!ok && (p->status == TP_RUN))
+    p->status = TP_ERROR;
+  /* metadata must give at least / */
+  if ((p->status == TP_RUN)&&(!p->delta)&&(!p->shard)&&(p->nb == 0))
+    p->status = TP_ERROR;
+  if (p->status == TP_OLD)
+    return(0);
+  if (p->status != TP_RUN)
+    return(-1);
+  /* update the number of links for dirs */
+  if (p->built)
+    r_tree_update_links(&(p->tree.root));
+  return(p->nb);
+}
+
+/* put the content ended by tree_parse_end in the live tree (which
+   must be locked for writing). For a sharded dir, 'dir' is the dir
+   (searched again if the tree was unlocked). What is replaced is kept
+   in the parser until tree_parse_free.
+   returns the number of entries created (metadata, sharded dir) or
+   changes applied (delta), 0 if content is not newer than the tree,
+   or -1 on error (a delta may be partially applied) */
+int tree_parse_commit(TreeParser *p, Node *dir) {
+  Node **entries;
+  Tree old;
+  int i, nb, ret;
+
+  if (p->status == TP_OLD)
+    return(0);
+  if (p->status != TP_RUN)
+    return(-1);
+
+  if (p->shard) {
+    /* previous content out of the tree, kept aside to be freed */
+    for(i=0; i<dir->nb_entries; i++) {
+      if (dir->entries[i] == NULL)
+        continue;
+      live.nb -= r_tree_count(dir->entries[i]);
+      r_tree_unhash(&live, dir->entries[i]);
     }
-    
-    //printf("# adding node (%p) add pos %d in entry %p\n", node->entries[fp], fp, node);
-    
-    /* fill it */
-    node->entries[fp]->parent = node;
-    /* if symlink, use target length */
-    if (file == 2) {
-      node->entries[fp]->size = strlen(target);
+    entries = dir->entries;
+    nb = dir->nb_entries;
+    dir->entries = p->tree.root.entries;
+    dir->nb_entries = p->tree.root.nb_entries;
+    p->tree.root.entries = entries;
+    p->tree.root.nb_entries = nb;
+    /* new content in the tree */
+    for(i=0; i<dir->nb_entries; i++)
+      if (dir->entries[i] != NULL)
+        dir->entries[i]->parent = dir;
+    live.nb += p->tree.nb;
+    if ((live.hash_fill+p->tree.nb)*10 >= live.hash_size*8) {
+      tree_rehash(&live);
     } else {
-      node->entries[fp]->size = size;
+      for(i=0; i<dir->nb_entries; i++)
+        if (dir->entries[i] != NULL)
+          r_tree_rehash(&live, dir->entries[i]);
     }
-    node->entries[fp]->stamp = stamp;
-    node->entries[fp]->links = links;
-    node->entries[fp]->inode = inode;
-    node->entries[fp]->file = file==2?1:file; /* symlinks are files */
-    node->entries[fp]->special = special;
-    tree_set_mode(node->entries[fp], mode);
-    if (strcmp(dirname, "/") == 0)
-      node->entries[fp]->name = strdup(name);
-    else
-      node->entries[fp]->name = strdup(name+strlen(dirname));
-    node->entries[fp]->fullname = strdup(name);
-    node->entries[fp]->nb_entries = 0;
-    node->entries[fp]->entries = NULL;
-    if (target[0] == '\0') {
-      node->entries[fp]->symlink = NULL;
-    } else {
-      node->entries[fp]->symlink = strdup(target);
+    dir->links = p->tree.root.links;
+    dir->shard_update = p->stamp;
+    return(p->nb);
+  }
+
+  if (p->delta) {
+    nb = 0;
+    for(i=0; i<p->nb_changes; i++) {
+      ret = tree_apply_change(p, &(p->changes[i]));
+      if (ret < 0) {
+        fprintf(stderr, "Delta does not match the tree (entry '%s').\n",
+                p->changes[i].name+1);
+        p->status = TP_ERROR;
+        return(-1);
+      }
+      nb += ret;
     }
+    update = p->stamp;
+    return(nb);
+  }
+
+  /* new tree in place of the live one, kept aside to be freed */
+  old = live;
+  live = p->tree;
+  p->tree = old;
+  live.root.parent = &(live.root);
+  for(i=0; i<live.root.nb_entries; i++)
+    if (live.root.entries[i] != NULL)
+      live.root.entries[i]->parent = &(live.root);
+  update = p->stamp;
+  return(p->nb);
+}
+
+/* free what the parser keeps aside: content not put in the live tree,
+   or content replaced by it. No lock needed */
+void tree_parse_free(TreeParser *p) {
+  int i;
 
-    tree_push_hash(name, node->entries[fp]);
+  if (p->built)
+    tree_clear(&(p->tree));
+  p->built = 0;
+  for(i=0; i<p->nb_changes; i++) {
+    free(p->changes[i].name);
+    free(p->changes[i].target);
+  }
+  if (p->changes != NULL)
+    free(p->changes);
+  p->changes = NULL;
+  p->nb_changes = 0;
+  p->max_changes = 0;
+}
 
-    /* lack checking for failed strdup() */
+/* give all lines of a file to a parser, and end it */
+int tree_parse_file(TreeParser *p, FILE *f) {
+  char buffer[MAX_NAME+64];
 
-    nb++;
+  while(fgets(buffer, MAX_NAME+64, f) != NULL) {
+    if (buffer[strlen(buffer)-1] == '\n')
+      buffer[strlen(buffer)-1] = '\0';
+    if (!tree_parse_line(p, buffer))
+      break;
   }
+  return(tree_parse_end(p, 1));
+}
 
-  /* update the number of links for dirs */
-  tree_update_links();
+/* create tree from FS description, in place of the current one
+   returns the number of item created (or <= 0 on error) */
+int tree_create(FILE *f) {
+  TreeParser p;
+  int nb;
+
+  tree_parse_init(&p, 0, 0, NULL);
+  nb = tree_parse_file(&p, f);
+  if (nb >= 0)
+    nb = tree_parse_commit(&p, NULL);
+  tree_parse_free(&p);
+  return(nb);
+}
 
+/* apply a delta description to the live tree (see DescriptionFormat.txt).
+   'changed' (if not NULL) is called with the fullname of each entry
+   changed or removed, before the change.
+   returns the number of changes applied, 0 if the delta is not newer
+   than the tree, or -1 if it can't be applied (bad format, or the delta
+   does not start from the current tree content) */
+int tree_apply_delta(FILE *f, void (*changed)(const char *name)) {
+  TreeParser p;
+  int nb;
+
+  tree_parse_init(&p, 1, 1, changed);
+  nb = tree_parse_file(&p, f);
+  if (nb >= 0)
+    nb = tree_parse_commit(&p, NULL);
+  tree_parse_free(&p);
   return(nb);
 }
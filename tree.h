@@ -16,7 +16,8 @@ extern int tree_debug;
 
 /* timestamp of the tree content. to be compared with meta-data
     to decide if an update is needed */
-unsigned int update;
+extern unsigned int update;
+
 
 /* internal structure of a node (an entry in the filesystem) */
 typedef struct _Node {
@@ -45,16 +46,103 @@ typedef struct _Node {
   int nb_entries;
   /* table of child nodes */
   struct _Node **entries;
+  /* sharded dir: path (on server) of the metadata file giving its
+     content, or NULL. Content is loaded when first needed */
+  char *shard;
+  unsigned int shard_update;  /* timestamp of loaded content (0: not loaded) */
+  unsigned int shard_next;    /* not loaded again before (unix time) */
+  int shard_loading;          /* a thread is loading its content */
+  /* file: its name for the backend (encoded URL...), computed at first
+     open, and its length. NULL if not computed yet */
+  char *target;
+  unsigned int target_lng;
+  /* file: open failed (missing or failing on server), opens of this
+     version ('fail_stamp') fail at once with 'fail_err' until
+     'fail_until' */
+  unsigned int fail_until;
+  unsigned int fail_stamp;
+  int fail_err;
 }Node;
 
 
 
+/* a whole tree: the live one, or a new one built aside */
+typedef struct {
+  Node root;
+  Node **hash_nodes;
+  unsigned int hash_size, hash_col, hash_fill;
+  int nb;  /* number of entries */
+}Tree;
+
+/* a change given by a delta, kept until applied */
+typedef struct {
+  char op;
+  int file;
+  unsigned int size, inode, estamp, links;
+  char mode[8];
+  char *name;    /* with initial / */
+  char *target;
+}TreeChange;
+
+/* states of the parser: what the next line is */
+#define TP_STAMP  0  /* update timestamp (base timestamp for delta) */
+#define TP_COUNT  1  /* number of entries (update timestamp for delta) */
+#define TP_ENTRY  2  /* entry line (type, size...) */
+#define TP_NAME   3  /* entry name */
+#define TP_TARGET 4  /* symlink target */
+
+/* status of the parser */
+#define TP_RUN    0  /* parsing */
+#define TP_OLD    1  /* stopped: content not newer than the tree */
+#define TP_ERROR  2  /* stopped: bad format, or delta can't be used */
+
+/* incremental parser for metadata (or delta) content, fed line by
+   line (i.e. while downloaded). The content is built aside without
+   using the live tree (no lock needed), then put in the live tree at
+   once by tree_parse_commit */
+typedef struct {
+  int delta;   /* true for a delta content */
+  int check;   /* stop if content not newer than the tree */
+  int state;   /* TP_STAMP... */
+  int status;  /* TP_RUN... */
+  int line;    /* line number */
+  int nb;      /* entries created (changes for a delta) */
+  int nbt;     /* number of entries given in content */
+  unsigned int stamp;  /* update timestamp of content */
+  unsigned int base;   /* base timestamp (delta) */
+  /* current entry */
+  char op;     /* operation (delta) */
+  int file;
+  unsigned int size, inode, estamp, links;
+  char mode[8];
+  char name[MAX_NAME];  /* with initial / */
+  /* new tree (metadata), or new content of a sharded dir (its root
+     stands for the dir), built aside. Holds what it replaced once
+     committed */
+  Tree tree;
+  int built;
+  /* content of a sharded dir: its name, and the timestamp of its
+     current content */
+  int shard;
+  char shard_name[MAX_NAME];
+  unsigned int shard_stamp;
+  /* changes of a delta, applied once complete */
+  TreeChange *changes;
+  int nb_changes, max_changes;
+  /* called for entries changed or removed by a delta */
+  void (*changed)(const char *name);
+}TreeParser;
+
+
 /* initialise FS tree. should be called only at start */
 extern void tree_init();
 
 /* cleanup all the tree */
 extern void tree_free();
 
+/* number of entries in tree */
+extern int tree_count();
+
 /* search an entry in tree */
 extern Node *tree_search(const char *path);
 
@@ -64,9 +152,66 @@ extern Node *tree_search_inode(unsigned int inode);
 /* mostly debug: print tree content */
 extern void tree_print();
 
-/* create tree from FS description (tree must be cleaned) */
+/* create tree from FS description, in place of the current one */
 extern int tree_create(FILE *f);
 
+/* initialise a parser for metadata content ('delta' false) or delta
+   content ('delta' true). If 'check' is set, parsing stops if content
+   is not newer than the live tree. The new tree (or the changes of a
+   delta) is built aside, and put in the live tree by
+   tree_parse_commit if complete. tree_parse_free must be called at
+   the end */
+extern void tree_parse_init(TreeParser *p, int delta, int check,
+                            void (*changed)(const char *name));
+
+/* give a line (without the final \n) to the parser. The live tree is
+   not used: no lock needed
+   returns 1 if more lines are expected, 0 if parsing stopped */
+extern int tree_parse_line(TreeParser *p, char *line);
+
+/* end of parsing ('ok' false if content is incomplete). No lock needed
+   returns the number of entries created (or changes to apply), 0 if
+   content is not newer than the tree, or -1 on error */
+extern int tree_parse_end(TreeParser *p, int ok);
+
+/* put the content ended by tree_parse_end in the live tree (locked for
+   writing). 'dir' is the sharded dir of a parser for its content,
+   searched again if the tree was unlocked (NULL for others)
+   returns the number of entries created (or changes applied), 0 if
+   content is not newer than the tree, or -1 on error (a delta may be
+   partially applied: the tree must be loaded again) */
+extern int tree_parse_commit(TreeParser *p, Node *dir);
+
+/* free what the parser keeps aside (content not committed, or the
+   content it replaced). No lock needed */
+extern void tree_parse_free(TreeParser *p);
+
+/* initialise a parser for the content of sharded dir 'dir' (tree
+   locked). If 'check' is set, parsing stops if content is not newer
+   than the current content of the dir */
+extern void tree_parse_init_shard(TreeParser *p, Node *dir, int check);
+
+/* search the nearest sharded dir containing 'node' (or NULL) */
+extern Node *tree_shard_of(Node *node);
+
+/* opening 'node' failed with error 'err' (errno): opens of this
+   version of the file fail at once until 'until' (unix time) */
+extern void tree_set_failed(Node *node, unsigned int until, int err);
+
+/* error of opening 'node' if it failed before 'now' (see
+   tree_set_failed), else 0 */
+extern int tree_failed(Node *node, unsigned int now);
+
+/* give all lines of a file to the parser, then end it (see
+   tree_parse_end) */
+extern int tree_parse_file(TreeParser *p, FILE *f);
+
+/* apply a delta description to the live tree. 'changed' (if not NULL)
+   is called with the fullname of each entry changed or removed.
+   returns the number of changes, 0 if the delta is not newer than
+   the tree, -1 if it can't be applied (a full reload is needed) */
+extern int tree_apply_delta(FILE *f, void (*changed)(const char *name));
+
 /* TODO: tree_recreate() -> check if content changed are re-create
          tree if yes. */
 
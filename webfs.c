@@ -14,6 +14,7 @@ static const char *webfsDescription =
 
 
 #define _XOPEN_SOURCE 500
+#define _GNU_SOURCE  /* writer-preferring rwlock */
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -32,11 +33,21 @@ static const char *webfsDescription =
 #include <fuse.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <pthread.h>
 
 #include "tree.h"
 #include "tools.h"
 #include "cache.h"
 #include "webget.h"
+#include "profile.h"
+#include "stats.h"
+#include "probe.h"
+#include "record.h"
+#include "mirror.h"
+#include "fileget.h"
+#include "sched.h"
+#include "pool.h"
+#include "ztier.h"
 
 
 /* URL to use */
@@ -45,12 +56,20 @@ char *url_path;
 /* metadata file on HTTP server */
 char *url_metadata = "/description.data";
 
-/* the name of the temp file that contains the
-   meta-data of the filesystem. used at startup
-   and for updates */
+/* the name of the local file that contains the
+   meta-data of the filesystem, when generated by an
+   updater program (downloaded metadata is not stored) */
 char tpl[4096];
 /* URL where to find metadata file on server */
 char metaurl[4096];
+/* validators of the last download of metadata file */
+MetaState meta_state;
+
+/* delta file on HTTP server (NULL: not used) */
+char *url_delta = NULL;
+/* URL of delta file */
+char deltaurl[4096];
+MetaState delta_state;
 
 
 /* last time we dl the metadata file */
@@ -63,6 +82,13 @@ unsigned int intv_dl=60; /* 1 minute */
 /* global setting: force files to be executable */
 int opt_exec_files = 0;
 
+/* global setting: servers resolved (and TLS sessions opened) at mount */
+int opt_warmup = 0;
+
+/* global setting: opens of a file missing or failing on server fail at
+   once for that long (s, 0: never) */
+int opt_negttl = 10;
+
 
 /* status for updates */
 #define UP_OK   0  /* last update ok */
@@ -82,6 +108,22 @@ char *update_str[] = { "Ok", "Failed to connect to web server",
 /* last detailled error message */
 char update_msg[1024];
 
+/* the tree (and update data) is read by callbacks with a shared lock,
+   taken by hooks, and changed by metadata updates with an exclusive
+   lock. A callback changing the tree drops its shared lock meanwhile,
+   so nodes got before are no more valid after */
+static pthread_rwlock_t tree_lock;
+/* held by the thread updating the tree from metadata */
+static pthread_mutex_t update_lock = PTHREAD_MUTEX_INITIALIZER;
+/* threads waiting for the first load of a sharded dir, woken at the
+   end of each load */
+static pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shard_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int shard_loads = 0;  /* loads ended */
+/* a sharded dir that failed to load is tried again after
+   intv_dl/SHARD_RETRY */
+#define SHARD_RETRY 4
+
 
 void set_message(char *msg) {
   if (msg == NULL) {
@@ -95,158 +137,330 @@ void set_message(char *msg) {
 }
 
 
-/* global statistics */
-unsigned long long int stat_open = 0;  /* # open */
-unsigned long long int stat_stat = 0;  /* stat or similar */
-unsigned long long int stat_read = 0;  /* # read */
-unsigned long long int stat_dir  = 0;  /* # readdir */
-unsigned long long int stat_data = 0;  /* # bytes read */
-unsigned int stat_used = 0;  /* number of files opened now */
+/* global statistics are in stats.c */
 
 
 
 
-/* get the node corresponding to path, or NULL */
-static Node* get_node_path(const char* path) {
-    return(tree_search(path));
+/* give a line of downloaded metadata to the tree parser */
+int meta_line(char *line, void *data) {
+  return(tree_parse_line((TreeParser*)data, line));
 }
 
+/* callback downloading metadata: its shared lock is dropped meanwhile
+   (the tree parser builds the new content aside) */
+static void tree_fetch_begin() {
+  pthread_rwlock_unlock(&tree_lock);
+}
 
-/* load metadata file */
-int load_metadata() {
+/* content downloaded: exclusive lock to put it in the tree */
+static void tree_write_begin() {
+  pthread_rwlock_wrlock(&tree_lock);
+}
+
+/* end of change: what the parser replaced is freed without lock, then
+   back to shared lock */
+static void tree_write_end(TreeParser *parser) {
+  pthread_rwlock_unlock(&tree_lock);
+  tree_parse_free(parser);
+  pthread_rwlock_rdlock(&tree_lock);
+}
+
+/* load metadata file and build FS tree from it (shared lock held,
+   dropped while loading). The new tree is built aside while the file
+   is downloaded, and replaces the current one only if complete. If
+   'check' is set, stops as soon as the file is known not newer than
+   the current tree.
+   returns 0 on error, 1 if tree was built, WGET_META_SAME if not
+   modified/not newer */
+int load_metadata(int check) {
+  TreeParser parser;
   FILE *f;
-  unsigned int stp;
-mylog("::load_metadata()\n");
-  if (metaurl[0] != '@') {
-    /* not for @ code: it is not updated */
-    f = fopen(tpl, "w");
-    if (f == NULL) {
-      update_ok = UP_INT;
-      set_message("Failed to create local metadata file (check /tmp).");
-      return(0);
-    }
-  }
-  
+  char *msg=NULL;
+  int ret=WGET_META_OK, nb=-1, fail=0;
+mylog("::load_metadata(%d)\n", check);
+  tree_parse_init(&parser, 0, check, NULL);
+  tree_fetch_begin();
   if (metaurl[0] == '@') {
     /* user ask for a local program to update file */
     /* run it with "system". may change */
     if (system(metaurl+1) != 0) {
-      update_ok = UP_404; /* fail. same error than 404 */
-      set_message("Failed to execute updater program for metadata.");
-      return(0);
+      fail = UP_404; /* fail. same error than 404 */
+      msg = "Failed to execute updater program for metadata.";
+    } else if ((f = fopen(tpl, "r")) == NULL) {
+      fail = UP_INT;
+      msg = "Failed to open local metadata file.";
+    } else {
+      nb = tree_parse_file(&parser, f);
+      fclose(f);
     }
-    return(1);
   } else {
-    /* we just dl the metadata file from website */
-    if (!wget_meta(metaurl, f)) {
-      fclose(f);
-      update_ok = UP_404;
-      return(0);
+    /* we just dl the metadata file from website, if modified */
+    ret = wget_meta(metaurl, &meta_state, meta_line, &parser);
+    if (ret != WGET_META_SAME)
+      nb = tree_parse_end(&parser, ret != WGET_META_FAIL);
+    if (ret == WGET_META_FAIL) {
+      fail = UP_404;
+      msg = "Failed to get metadata file from web server.";
+    } else if (nb < 0) {
+      /* get it again next time */
+      wget_meta_reset(&meta_state);
     }
-    fclose(f);
   }
-  
-  /* now check for timestamp value */
-  f = fopen(tpl, "r");
-  if (f == NULL) {
-    update_ok = UP_INT;
-    set_message("Failed to open local metadata file (check /tmp).");
-    return(0);
-  }
-  if (fscanf(f, "%u", &stp) != 1) {
-    fclose(f);
+  tree_write_begin();
+  if (ret == WGET_META_SAME) {
+    /* tree is still valid. nothing to do */
+    set_message(NULL);
+    ret = WGET_META_SAME;
+  } else if (msg != NULL) {
+    update_ok = fail;
+    set_message(msg);
+    ret = 0;
+  } else if (nb < 0) {
     update_ok = UP_TREE;
-    set_message("Failed to find timestamp in metadata file (bad format?).");
-    return(0);
+    set_message("Failed to read metadata file (bad format?).");
+    ret = 0;
+  } else if (nb == 0) {
+    set_message(NULL);
+    ret = WGET_META_SAME;  /* not newer than current tree */
+  } else {
+    tree_parse_commit(&parser, NULL);
+    set_message(NULL);
+    update_ok = UP_OK;
+    update_nbent = nb;
+    /* the tree was rebuilt: cache data may point to old content */
+    cache_destroy_all();
+    ret = 1;
   }
-  fclose(f);
-  set_message(NULL);
-  
+  tree_write_end(&parser);
+  return(ret);
+}
+
+/* called for each entry changed or removed by a delta: the
+   cache of this entry (or of its content) is no more valid */
+void delta_changed(const char *name) {
+  int i, lng;
+
+  lng = strlen(name);
+  pthread_mutex_lock(&cache_lock);
+  for(i=0; i<CACHE_MAX; i++) {
+    if (caches[i].name == NULL)
+      continue;
+    /* names of caches start with / */
+    if ((strncmp(caches[i].name+1, name, lng) == 0)&&
+        ((caches[i].name[lng+1] == '\0')||(caches[i].name[lng+1] == '/')))
+      cache_free(&(caches[i]));
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/* get delta file from server (shared lock held, dropped while
+   loading), and apply it to the tree once complete.
+   returns the number of changes (0: tree is up to date) or -1 if
+   the delta can't be used (a full reload is needed) */
+int load_delta() {
+  TreeParser parser;
+  int ret, nb=0;
+mylog("::load_delta()\n");
+  tree_parse_init(&parser, 1, 1, delta_changed);
+  tree_fetch_begin();
+  ret = wget_meta(deltaurl, &delta_state, meta_line, &parser);
+  /* (SAME: already applied) */
+  if (ret != WGET_META_SAME)
+    nb = tree_parse_end(&parser, ret != WGET_META_FAIL);
+  tree_write_begin();
+  if (nb >= 0)
+    nb = tree_parse_commit(&parser, NULL);
+  if (nb < 0) {
+    /* can't be used: get it again next time */
+    wget_meta_reset(&delta_state);
+  } else {
+    if (nb > 0) {
+      update_ok = UP_OK;
+      update_nbent = tree_count();
+    }
+    set_message(NULL);
+  }
+  tree_write_end(&parser);
+  return(nb);
+}
+
+/* end of a load of sharded dir: back to shared lock, and wake up the
+   threads waiting for it */
+static void shard_end(TreeParser *parser) {
+  tree_write_end(parser);
+  pthread_mutex_lock(&shard_lock);
+  shard_loads++;
+  pthread_cond_broadcast(&shard_cond);
+  pthread_mutex_unlock(&shard_lock);
+}
+
+/* load (or refresh) the content of sharded dir 'node' from its own
+   metadata file, if not done recently (shared lock held, dropped
+   while loading). The new content is built aside while downloaded. If
+   it fails the current content is kept, and loaded again a bit later.
+   A single thread loads a dir: others use its current content, or
+   wait for it if not loaded yet.
+   returns 1 if the content changed or the lock was dropped, -1 if
+   failed (lock dropped) */
+int load_shard(Node *node) {
+  TreeParser parser;
+  char name[MAX_NAME], shard[MAX_NAME];
+  unsigned int cur, stamp, loads;
+  Node *dir;
+  int ret, nb;
+
+  cur = (unsigned int)time(NULL);
+  if (cur < node->shard_next)
+    return(0);  /* too recent (loaded or failed) */
+  if (__atomic_exchange_n(&(node->shard_loading), 1, __ATOMIC_ACQUIRE)) {
+    if (node->shard_update != 0)
+      return(0);  /* loaded by another thread */
+    /* wait for the end of a load. as its thread can't end while the
+       shared lock is held, the count is the one before it ends */
+    pthread_mutex_lock(&shard_lock);
+    loads = shard_loads;
+    pthread_rwlock_unlock(&tree_lock);
+    while(loads == shard_loads)
+      pthread_cond_wait(&shard_cond, &shard_lock);
+    pthread_mutex_unlock(&shard_lock);
+    pthread_rwlock_rdlock(&tree_lock);
+    return(1);
+  }
+mylog("::load_shard(%s)\n", node->fullname);
+  /* path to search it again (fullname has no leading '/') */
+  snprintf(name, sizeof(name), "/%s", (node->parent == node)?"":node->fullname);
+  snprintf(shard, sizeof(shard), "%s", node->shard);
+  stamp = node->shard_update;
+  dir = node;
+  tree_parse_init_shard(&parser, node, stamp != 0);
+  tree_fetch_begin();
+  ret = wget_meta(wget_encode(url_path, shard), NULL, meta_line, &parser);
+  nb = tree_parse_end(&parser, ret != WGET_META_FAIL);
+  tree_write_begin();
+  /* the node may be gone or changed meanwhile */
+  node = tree_search(name);
+  if (node == dir)
+    __atomic_store_n(&(node->shard_loading), 0, __ATOMIC_RELEASE);
+  if ((node == NULL)||(node->shard == NULL)||(strcmp(node->shard, shard) != 0)||
+      (node->shard_update != stamp)||(cur < node->shard_next)) {
+    shard_end(&parser);
+    return(1);
+  }
+  if (nb < 0) {
+    mylogl(MYLOG_WARN, "load_shard: failed to load '%s'\n", shard);
+    node->shard_next = cur + intv_dl/SHARD_RETRY;
+    shard_end(&parser);
+    return(-1);
+  }
+  node->shard_next = cur + intv_dl;
+  /* not newer: unchanged */
+  if (parser.status == TP_RUN) {
+    tree_parse_commit(&parser, node);
+    /* cache data may point to old content */
+    delta_changed(node->fullname);
+    update_nbent = tree_count();
+  }
+  shard_end(&parser);
   return(1);
 }
 
 /* this function:
   - checks if we dl metadata file for too long
-  - if yes, re-download metadata file
-  - if ok, check for timestamp in it
-  - if more recent than current tree, update it
+  - if a delta file is used, get it and apply it (done if ok)
+  - if yes, re-download metadata file, building a new tree if
+    its timestamp is more recent than current tree
 */
 int update_meta_if_needed() {
-  unsigned int cur, act;
-  int nb;
-  FILE *f;
+  unsigned int cur;
+  int nb, ret;
 
 
 mylog("::update_meta_if_meeded()\n");
   cur = (unsigned int)time(NULL);
-  if (cur < last_dl + intv_dl) {
-    set_message(NULL);
-    return(0);  /* too recent */
+  if (cur < last_dl + intv_dl)
+    return(0);  /* too recent (just updated by another thread) */
+
+  /* with a delta file, no need to get the full metadata file
+     unless the delta can't be used */
+  if (deltaurl[0] != '\0') {
+    nb = load_delta();
+    if (nb >= 0) {
+      __atomic_store_n(&last_dl, cur, __ATOMIC_RELAXED);
+      return(nb > 0);
+    }
+mylogl(MYLOG_INFO, "update_meta_if_needed: delta failed: full reload\n");
   }
 
   /* re-get the file */
-  if (!load_metadata()) {
+  ret = load_metadata(1);
+  if (!ret) {
     /* eeek! */
     return(0);  /* how to tell to user? */
     /* done with /.status */
   }
   /* update dl time */
-  last_dl = cur;
-  
-  /* check for timestamp in it */
-  f = fopen(tpl, "r");
-  if (f == NULL) {
-    update_ok = UP_INT;
-    set_message("Failed to open local metadata file (check /tmp).");
-    return(0);
-  }
-  if (fscanf(f, "%u", &act) < 1) {
-    fclose(f);
-    update_ok = UP_INT;
-    set_message("Failed to find timestamp in metadata file (bad format?).");
-    return(0);
-  }
-  fclose(f);
-  
-  /* if older or same, do nothing */
-  if (act <= update) {
-    set_message(NULL);
+  __atomic_store_n(&last_dl, cur, __ATOMIC_RELAXED);
+  /* not modified on server, or not newer */
+  if (ret == WGET_META_SAME)
     return(0);
-  }
-  
-  /* ok, so it is newer. we need to rebuild the FS tree.
-     but before we need to destroy the cache data that
-     should point to current node elements
-  */
 
-mylog("::update_meta_if_meeded: timestamp newer: updating tree\n");
-  cache_destroy_all();
-  
-  /* re-load tree */
-  f = fopen(tpl, "r");
-  if (f == NULL) {
-    update_ok = UP_INT;
-    set_message("Failed to open local metadata file (check /tmp).");
-    return(0);
-  }
-  /* destroy & recreate */
-  tree_free();
-  nb = tree_create(f);
-  if (nb <= 0) {
-    /* this is a very bad error */
-    update_ok = UP_TREE;
-    set_message("Failed to read metadata file (bad format?).");
-    return(0);
-  }
-  update_ok = UP_OK;
-  update_nbent = nb;
-  fclose(f);
-  set_message(NULL);
+mylogl(MYLOG_INFO, "update_meta_if_needed: tree updated (%d entries)\n", update_nbent);
 
   return(1);
 }
 
 
+/* update_meta_if_needed for a callback (shared lock held, dropped
+   while downloading) */
+static void update_meta_locked() {
+  /* too recent: no need to lock (set by the thread updating) */
+  if ((unsigned int)time(NULL) < __atomic_load_n(&last_dl, __ATOMIC_RELAXED) + intv_dl)
+    return;
+  /* one update at a time: others go on with the current tree */
+  if (pthread_mutex_trylock(&update_lock) != 0)
+    return;
+  update_meta_if_needed();
+  pthread_mutex_unlock(&update_lock);
+}
+
+/* get the node corresponding to path, or NULL. Content of sharded
+   dirs on the way is loaded (or refreshed) if needed */
+static Node* get_node_path(const char* path) {
+    char buffer[MAX_NAME], *c;
+    Node *node, *shard;
+    int ret = 1;
+
+    do {
+        node = tree_search(path);
+        if (node != NULL) {
+            shard = tree_shard_of(node);
+        } else {
+            /* the nearest existing dir may be a sharded dir (or
+               inside one) not loaded yet */
+            if (strlen(path) >= MAX_NAME)
+                return(NULL);
+            strcpy(buffer, path);
+            while(node == NULL) {
+                c = strrchr(buffer, '/');
+                if (c == NULL)
+                    return(NULL);
+                c[(c == buffer)?1:0] = '\0';
+                node = tree_search(buffer);
+            }
+            if (node->file)
+                return(NULL);
+            shard = (node->shard != NULL)?node:tree_shard_of(node);
+            node = NULL;
+        }
+        /* failed to load: with the content we have */
+        if ((shard == NULL)||(ret < 0))
+            return(node);
+    } while((ret = load_shard(shard)) != 0);
+    return(node);
+}
+
+
 /* copy/compute data for 'struct stat' from given node */
 static int getattr_from_node(Node *node, struct stat *st_data) {
     /* fill the answer */
@@ -292,7 +506,7 @@ mylog("::getattr(%s)\n", path);
         return(-ENOENT);
     }
     
-    stat_stat++;
+    stats_add(SC_STAT, 1);
     
 mylog(":::find node %p [%s]\n", node, node->name!=NULL?node->name:"<null>");
     /* fill the answer */
@@ -311,7 +525,7 @@ mylog("::readlink(%s)\n", path);
         return(-ENOENT);
     }
 
-    stat_stat++;
+    stats_add(SC_STAT, 1);
 
     /* not a symlink */
     if (node->symlink == NULL) {
@@ -350,6 +564,14 @@ mylog("::readdir(%s)\n", path);
     if (node == NULL) {
         return(-ENOENT);
     }
+    /* sharded dir: its content is needed now. The lock may have been
+       dropped meanwhile: the node may be gone */
+    if ((offset == 0)&&(node->shard != NULL)&&(load_shard(node) != 0)) {
+        node = get_node_path(path);
+        if (node == NULL) {
+            return(-ENOENT);
+        }
+    }
 
     /* check offset */
     if (offset-2 >= node->nb_entries) {
@@ -358,7 +580,7 @@ mylog(":::EINVAL: '%s', offset=%d\n", path, (int)offset);
 	return(0);
     }
 
-    stat_dir++;
+    stats_add(SC_DIR, 1);
 
     /* Note: here I suppose that we *always* able to store '.' & '..'
              in the buffer. If not, this may failed/crash/whatever */
@@ -478,8 +700,37 @@ static int callback_utime(const char *path, struct utimbuf *buf) {
     return(-EROFS);
 }
 
+/* name of a file for the backend (encoded URL), computed at its first
+   open and kept in its node. Tree is read locked: concurrent opens may
+   both compute it, only one is kept. NULL if failed */
+static const char *node_target(Node *node, const char *path, unsigned int *lng) {
+    char *target, *none = NULL;
+    unsigned int n;
+
+    target = __atomic_load_n(&(node->target), __ATOMIC_ACQUIRE);
+    if (target == NULL) {
+        target = cache_target(path, &n);
+        if (target == NULL)
+            return(NULL);
+        __atomic_store_n(&(node->target_lng), n, __ATOMIC_RELAXED);
+        if (!__atomic_compare_exchange_n(&(node->target), &none, target, 0,
+                                         __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+            free(target);
+            target = none;
+        }
+    }
+    *lng = __atomic_load_n(&(node->target_lng), __ATOMIC_RELAXED);
+    return(target);
+}
+
 static int callback_open(const char *path, struct fuse_file_info *finfo) {
     Node *node;
+    Cache *cache;
+    Range ranges[CACHE_MAX_RANGE];
+    const char *target;
+    char name[MAX_NAME], *tgt=NULL;
+    unsigned int lng=0, size, stamp;
+    int nb, err;
 
 
 mylog("::open(%s)\n", path);
@@ -500,14 +751,43 @@ mylog("::open(%s)\n", path);
     if ((node->file)&&(!node->special)) {  /* only handle cache for files */
         /* do not create cache for empty files */
 	if (node->size > 0) {
-            if (cache_create(path, node->size) == NULL) {
-		/* something goes wrong. Refuse open */
-		return(-EBUSY);
+            /* failed a moment ago: don't ask the server again */
+            err = tree_failed(node, (unsigned int)time(NULL));
+            if (err != 0) {
+                stats_add(SC_NEGATIVE, 1);
+                return(-err);
+            }
+            /* the server is asked without the tree lock (an update may
+               replace the node meanwhile): what is needed is copied */
+            target = node_target(node, path, &lng);
+            if ((target != NULL)&&((tgt = malloc(lng+1)) != NULL))
+                memcpy(tgt, target, lng+1);
+            snprintf(name, sizeof(name), "%s", node->fullname);
+            size = node->size;
+            stamp = node->stamp;
+            pthread_rwlock_unlock(&tree_lock);
+            cache = cache_create(path, tgt, lng, size);
+            err = errno;
+            free(tgt);
+            pthread_rwlock_rdlock(&tree_lock);
+            if (cache == NULL) {
+		/* something goes wrong. Refuse open. Only answers of the
+		   server are kept (not a refusal while it is down, or a
+		   lack of memory), for the version asked */
+                node = tree_search(path);
+                if ((opt_negttl > 0)&&((err == ENOENT)||(err == EIO))&&
+                    (node != NULL)&&(node->stamp == stamp))
+                    tree_set_failed(node, (unsigned int)time(NULL)+opt_negttl, err);
+		return(-err);
 	    }
+	    /* known access profile for this version? prefetch it */
+	    nb = profile_search(name, stamp, ranges);
+	    if (nb > 0)
+	        cache_prefetch(path, ranges, nb);
 	}
     }
-    stat_open++;
-    stat_used++;
+    stats_add(SC_OPEN, 1);
+    stats_gauge(SG_USED, 1);
 
     /* ok */
     return(0);
@@ -520,6 +800,7 @@ static int callback_read(const char *path, char *buf, size_t size, off_t offset,
     int res;
     Node *node;
     time_t ttmp;
+    unsigned int fsize;
     unsigned int totread;
     unsigned int curoffset;
     unsigned int cursize;
@@ -533,7 +814,7 @@ mylog("::read(%s, %p, %u, %u, -)\n", path, buf, (unsigned int)size,
         return(-ENOENT);
     }
     
-    stat_read++;
+    stats_add(SC_READ, 1);
     
     /* special treatment for "special" files */
     if (node->special) {
@@ -545,12 +826,9 @@ mylog(":::this node is special! (type=%d)\n", node->special);
 	        return(0);
 	    /* return current time */
 	    ttmp = time(NULL);
-	    tmp = ctime(&ttmp);
-	    if (tmp == NULL) {
+	    if (ctime_r(&ttmp, buffer) == NULL) {
 	        return(-EBUSY);
 	    }
-	    buffer[0] = '\0';
-	    strcat(buffer, tmp);
 	    lng = strlen(buffer);
 	    strncpy(buf, buffer, MIN(size,lng));
 	    return(MIN(size,lng));
@@ -561,7 +839,8 @@ mylog(":::this node is special! (type=%d)\n", node->special);
 	        return(0);
     	    if (update_ok == UP_OK) {
 	        sprintf(buffer, "Update ok (last update at %u)\n"
-		        "%d entries in FS tree.\n", last_dl, update_nbent);
+		        "%d entries in FS tree.\n",
+		        __atomic_load_n(&last_dl, __ATOMIC_RELAXED), update_nbent);
 	    } else {
 	        sprintf(buffer, "Error: %s\n", update_str[update_ok]);
 	    }
@@ -573,10 +852,15 @@ mylog(":::this node is special! (type=%d)\n", node->special);
 	    /* if offset > 0, do nothing: this is a one-shot read */
 	    if (offset > 0)
 	        return(0);
-	    sprintf(buffer, "Base URL: %s\nMetadata: %s\n"
+	    lng = snprintf(buffer, sizeof(buffer), "Base URL: %s\nMetadata: %s\n"
 	            "Update interval: %u\n"
-		    "# chunks / size: %u / %u\n", url_path, metaurl, intv_dl,
-		    cache_chunks, cache_chunksize);
+		    "# chunks / size: %u / %u (adaptive: %u-%u)\n", url_path,
+		    metaurl, intv_dl, cache_chunks, cache_chunksize,
+		    cache_chunksize_min, cache_chunksize_max);
+	    if (lng < (int)sizeof(buffer))
+	        lng += mirror_print(buffer+lng, sizeof(buffer)-lng);
+	    if (lng < (int)sizeof(buffer))
+	        lng += sched_print(buffer+lng, sizeof(buffer)-lng);
 	    lng = strlen(buffer);
 	    strncpy(buf, buffer, MIN(size,lng));
 	    return(MIN(size,lng));
@@ -591,22 +875,22 @@ mylog(":::this node is special! (type=%d)\n", node->special);
 	    strncpy(buf, buffer, MIN(size,lng));
 	    return(MIN(size,lng));
 	    
-	} else if (node->special == 5) { /* stats data */
-	    /* if offset > 0, do nothing: this is a one-shot read */
-	    if (offset > 0)
+	} else if ((node->special == 5)||(node->special == 6)) {
+	    /* stats data (6: machine-readable). generated at each read,
+	       so a read at an offset may see newer values */
+	    tmp = malloc(STATS_SIZE);
+	    if (tmp == NULL)
+	        return(-ENOMEM);
+	    lng = stats_print(tmp, STATS_SIZE,
+	                      (node->special == 6)?STATS_PROM:STATS_TEXT);
+	    if (offset >= lng) {
+	        free(tmp);
 	        return(0);
-	    sprintf(buffer, "Access statistics:\n"
-	         "Current opened files: %d\n"
-		 "Total number of [fl]stat, access...: %llu\n"
-		 "Total number of dir access: %llu\n"
-		 "Total number of open: %llu\n"
-		 "Total number of read: %llu\n"
-		 "Total number of bytes read: %llu\n",
-		 stat_used, stat_stat, stat_dir, stat_open, stat_read,
-		 stat_data);
-	    lng = strlen(buffer);
-	    strncpy(buf, buffer, MIN(size,lng));
-	    return(MIN(size,lng));
+	    }
+	    lng = MIN(size, lng-offset);
+	    memcpy(buf, tmp+offset, lng);
+	    free(tmp);
+	    return(lng);
 	    
 	} else {
             return(-EOPNOTSUPP);
@@ -617,6 +901,9 @@ mylog(":::this node is special! (type=%d)\n", node->special);
     if (node->size == 0) {
         return(0);
     }
+    /* no tree access from here: updates can run during transfers */
+    fsize = node->size;
+    pthread_rwlock_unlock(&tree_lock);
     
     /* loop on read until we reach the requested size */
     totread = 0;
@@ -625,7 +912,7 @@ mylog(":::this node is special! (type=%d)\n", node->special);
     while(1) {
     
       /* call the cache system to get data from file */
-      res = cache_read(node->size, path, curoffset, cursize, buf+totread);
+      res = cache_read(fsize, path, curoffset, cursize, buf+totread);
       /* just give the result */
       mylog("::read(%s, %u, %u, %p) = %d\n", path, curoffset,
                cursize, buf+totread, res);
@@ -645,8 +932,8 @@ mylog(":::this node is special! (type=%d)\n", node->special);
       curoffset += res;
       cursize -= res;
     }
-    if (totread >= 0)
-      stat_data += totread;
+    pthread_rwlock_rdlock(&tree_lock);
+    stats_add(SC_DATA, totread);
     return(totread);
 }
 
@@ -669,25 +956,32 @@ static int callback_statfs(const char *path, struct statvfs *st_buf) {
     st_buf->f_flag = ST_RDONLY | ST_NOSUID; /* to be sure */
     st_buf->f_namemax = MAX_NAME;  /* internal name representation */
 
-    stat_stat++;
+    stats_add(SC_STAT, 1);
 
     return(0);
 }
 
 static int callback_release(const char *path, struct fuse_file_info *finfo) {
+    Node *node;
+    Range ranges[CACHE_MAX_RANGE];
+    int nb;
+
     (void) path;
     (void) finfo;
     mylog("::release(%s, -)\n", path);
+    /* keep the access profile of this file */
+    node = get_node_path(path);
+    nb = cache_ranges(path, ranges);
+    if ((node != NULL)&&(nb > 0))
+        profile_store(node->fullname, node->stamp, ranges, nb);
     /* close the cache entry if any. just don't check if it is a file
        or if it is opened. */
     cache_destroy(path);
     
-    stat_used--;
-    if (stat_used < 0)
-      stat_used = 0;
+    stats_gauge(SG_USED, -1);
     
     /* call update-meta to check for new stuff */
-    update_meta_if_needed();
+    update_meta_locked();
     
     return(0);
 }
@@ -780,10 +1074,145 @@ static int callback_removexattr(const char *path, const char *name) {
     return(-EROFS);
 }
 
+/* FUSE is running (after daemon fork): start threads */
+static void *callback_init(struct fuse_conn_info *conn) {
+    (void)conn;
+    if (!mylog_start())
+        fprintf(stderr, "Failed to start logger thread. Logs are lost.\n");
+    if (!sched_start())
+        mylogl(MYLOG_ERROR, "Failed to start transfer workers. No readahead/prefetch.\n");
+    if ((opt_warmup)&&(!fget_is_local(url_path))&&
+        (wget_warmup(url_path) == 0))
+        mylogl(MYLOG_WARN, "Failed to reach servers at start.\n");
+    mylogl(MYLOG_INFO, "webfs started on %s\n", url_path);
+    return(NULL);
+}
+
+/* FUSE is stopping */
+static void callback_destroy(void *data) {
+    (void)data;
+    mylogl(MYLOG_INFO, "webfs stopped\n");
+    sched_fini();
+    record_fini();
+    mylog_stop();
+}
+
+/* hooks around callbacks: latency stats, trace probes (<op>_entry
+   with path, <op>_return with path and result) and access trace */
+
+/* callback reading the tree, for a client process */
+static void hook_enter() {
+    sched_client(fuse_get_context()->pid);
+    pthread_rwlock_rdlock(&tree_lock);
+}
+
+static void hook_leave() {
+    pthread_rwlock_unlock(&tree_lock);
+}
+
+static int hook_getattr(const char *path, struct stat *st_data) {
+    unsigned long long start = stats_now();
+    int ret;
+    PROBE1(getattr_entry, path);
+    hook_enter();
+    ret = callback_getattr(path, st_data);
+    hook_leave();
+    PROBE2(getattr_return, path, ret);
+    record_op(REC_GETATTR, path, 0, 0, ret, start);
+    stats_since(ST_GETATTR, start);
+    return(ret);
+}
+
+static int hook_readlink(const char *path, char *buf, size_t size) {
+    unsigned long long start = stats_now();
+    int ret;
+    PROBE1(readlink_entry, path);
+    hook_enter();
+    ret = callback_readlink(path, buf, size);
+    hook_leave();
+    PROBE2(readlink_return, path, ret);
+    record_op(REC_READLINK, path, 0, size, ret, start);
+    return(ret);
+}
+
+static int hook_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    unsigned long long start = stats_now();
+    int ret;
+    PROBE2(readdir_entry, path, offset);
+    hook_enter();
+    ret = callback_readdir(path, buf, filler, offset, fi);
+    hook_leave();
+    PROBE2(readdir_return, path, ret);
+    record_op(REC_READDIR, path, offset, 0, ret, start);
+    stats_since(ST_READDIR, start);
+    return(ret);
+}
+
+static int hook_open(const char *path, struct fuse_file_info *finfo) {
+    unsigned long long start = stats_now();
+    int ret;
+    PROBE2(open_entry, path, finfo->flags);
+    hook_enter();
+    ret = callback_open(path, finfo);
+    hook_leave();
+    PROBE2(open_return, path, ret);
+    record_op(REC_OPEN, path, 0, finfo->flags, ret, start);
+    stats_since(ST_OPEN, start);
+    return(ret);
+}
+
+static int hook_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *finfo) {
+    unsigned long long start = stats_now();
+    int ret;
+    PROBE3(read_entry, path, offset, size);
+    hook_enter();
+    ret = callback_read(path, buf, size, offset, finfo);
+    hook_leave();
+    PROBE4(read_return, path, offset, size, ret);
+    record_op(REC_READ, path, offset, size, ret, start);
+    stats_since(ST_READ, start);
+    return(ret);
+}
+
+static int hook_statfs(const char *path, struct statvfs *st_buf) {
+    unsigned long long start = stats_now();
+    int ret;
+    PROBE1(statfs_entry, path);
+    ret = callback_statfs(path, st_buf);
+    PROBE2(statfs_return, path, ret);
+    record_op(REC_STATFS, path, 0, 0, ret, start);
+    return(ret);
+}
+
+static int hook_release(const char *path, struct fuse_file_info *finfo) {
+    unsigned long long start = stats_now();
+    int ret;
+    PROBE1(release_entry, path);
+    hook_enter();
+    ret = callback_release(path, finfo);
+    hook_leave();
+    PROBE2(release_return, path, ret);
+    record_op(REC_RELEASE, path, 0, 0, ret, start);
+    stats_since(ST_RELEASE, start);
+    return(ret);
+}
+
+static int hook_access(const char *path, int mode) {
+    unsigned long long start = stats_now();
+    int ret;
+    PROBE2(access_entry, path, mode);
+    hook_enter();
+    ret = callback_access(path, mode);
+    hook_leave();
+    PROBE2(access_return, path, ret);
+    record_op(REC_ACCESS, path, 0, mode, ret, start);
+    return(ret);
+}
+
 struct fuse_operations callback_oper = {
-    .getattr	= callback_getattr,
-    .readlink	= callback_readlink,
-    .readdir	= callback_readdir,
+    .getattr	= hook_getattr,
+    .readlink	= hook_readlink,
+    .readdir	= hook_readdir,
     .mknod		= callback_mknod,
     .mkdir		= callback_mkdir,
     .symlink	= callback_symlink,
@@ -795,13 +1224,15 @@ struct fuse_operations callback_oper = {
     .chown		= callback_chown,
     .truncate	= callback_truncate,
     .utime		= callback_utime,
-    .open		= callback_open,
-    .read		= callback_read,
+    .open		= hook_open,
+    .read		= hook_read,
     .write		= callback_write,
-    .statfs		= callback_statfs,
-    .release	= callback_release,
+    .statfs		= hook_statfs,
+    .release	= hook_release,
     .fsync		= callback_fsync,
-    .access		= callback_access,
+    .access		= hook_access,
+    .init		= callback_init,
+    .destroy	= callback_destroy,
 
     /* Extended attributes support for userland interaction */
     .setxattr	= callback_setxattr,
@@ -827,12 +1258,49 @@ static void usage(const char* progname)
 "   -V  --version       print version\n"
 "specific options:\n"
 "   --url <URL>         URL to mount\n"
+"   --mirrors <URL,...> other servers with the same content as URL\n"
 "   --metadata <file>   filename on webserver with metadata\n"
+"   --delta <file>      filename on webserver with metadata changes\n"
 "   --chunks <N>        set number (max) of chunks per cache\n"
-"   --chunksize <size>  set size (int byte) of chunks\n"
-"   --metafile <file>   local filename for metadata (dl or generated)\n"
-"   --readahead         not implemented yet\n"
+"   --chunksize <size>  set initial size (int byte) of chunks\n"
+"   --chunksize_min <size> / --chunksize_max <size>\n"
+"                       bounds for the adaptive size of chunks\n"
+"   --metafile <file>   local filename for metadata (generated by updater)\n"
+"   --readahead         load next chunks of sequential reads in background\n"
+"                       (uses all chunks but one, needs --chunks >= 2)\n"
 "   --execfiles         force all files to be executable\n"
+"   --profiles <file>   keep files access profiles (prefetch at open)\n"
+"   --loglevel <level>  error, warn (default), info or debug\n"
+"   --logfile <file>    log file (default: /tmp/webfs.log)\n"
+"   --syslog            send logs to syslog instead of log file\n"
+"   --trace <file>      record all operations in file (see replay)\n"
+"   --latency <us>      add a delay to each request (simulated network)\n"
+"   --bandwidth <B/s>   limit bandwidth of requests (simulated network)\n"
+"   --retries <N>       retries of a failed request (default 2)\n"
+"   --backoff <ms>      delay before first retry, doubled for next ones\n"
+"                       (default 100)\n"
+"   --timeout <ms>      max duration of a request (default: none)\n"
+"   --deadline <ms>     max duration of a read, retries included\n"
+"                       (default: none)\n"
+"   --hedge             duplicate requests slower than 95%% of recent ones\n"
+"   --maxrate <B/s>     limit bandwidth of all transfers (reads first)\n"
+"   --maxreqs <N>       limit requests per second\n"
+"   --workers <N>       threads for readahead and prefetch (default 2)\n"
+"   --slots <N>         max reads from the server at once (default 4),\n"
+"                       shared fairly by processes\n"
+"   --weights <name:N,...>  share of processes by name (default 4)\n"
+"   --keepalive <s>     keep idle connections open (default 60, 0: close\n"
+"                       after each request)\n"
+"   --warmup            resolve servers and open TLS sessions at mount\n"
+"   --http1             don't use HTTP/2 on HTTPS\n"
+"   --cacert <file>     CA certificates of servers (default: system ones)\n"
+"   --insecure          don't check server certificates\n"
+"   --negttl <s>        opens of a file missing or failing on server fail\n"
+"                       at once for that long (default 10, 0: never)\n"
+"   --memory <MB>       max memory of all caches (default 0: no limit)\n"
+"   --hugepages         use huge pages for caches\n"
+"   --compress <MB>     keep dropped chunks compressed in memory, up to\n"
+"                       <MB> (default 0: no)\n"
 "\n", progname);
 }
 
@@ -843,15 +1311,47 @@ typedef struct {
   int chunks;      /* number of chunks per cache */
   int chunksize;   /* size (in byte) of a chunk */
   char *metafile;  /* filename for local metadata file */
+  char *profiles;  /* filename for access profiles */
+  int chunksize_min; /* bounds for adaptive chunk size */
+  int chunksize_max;
+  char *delta;     /* name of delta file in URL */
+  char *loglevel;  /* name of log level */
+  char *logfile;   /* log file */
+  int syslog;      /* logs to syslog */
+  char *trace;     /* access trace file */
+  int latency;     /* simulated network: delay per request (us) */
+  int bandwidth;   /* simulated network: bytes/s */
+  int retries;     /* request policy (see webget.h) */
+  int backoff;
+  int timeout;
+  int deadline;
+  char *mirrors;   /* other base URLs (comma separated) */
+  int maxrate;     /* transfer scheduler (see sched.h) */
+  int maxreqs;
+  int workers;
+  int slots;
+  char *weights;   /* weights of processes (name:weight,...) */
+  int keepalive;   /* connections (see webget.h) */
+  char *cacert;
+  int negttl;      /* negative cache of opens */
+  int memory;      /* memory budget of caches (MB) */
+  int compress;    /* memory for compressed chunks (MB) */
 }MyOptions;
 
-MyOptions mo = { NULL, NULL, 0, 0, 0, NULL };
+MyOptions mo = { NULL, NULL, 0, 0, 0, NULL, NULL, 0, 0, NULL, NULL, NULL, 0, NULL, 0, 0,
+                 -1, -1, 0, 0, NULL, 0, 0, -1, -1, NULL, -1, NULL, -1, 0, 0 };
 
 
 #define OPTK_READAHEAD 2
 #define OPTK_METADATA  3
 #define OPTK_URL       4
 #define OPTK_EXEC      5
+#define OPTK_SYSLOG    6
+#define OPTK_HEDGE     7
+#define OPTK_HTTP1     8
+#define OPTK_INSECURE  9
+#define OPTK_HUGE     10
+#define OPTK_WARMUP   11
 
 static int rofs_parse_opt(void *data, const char *arg, int key,
         struct fuse_args *outargs) {
@@ -875,6 +1375,24 @@ static int rofs_parse_opt(void *data, const char *arg, int key,
         case OPTK_EXEC:
             opt_exec_files = 1;
             return(0);
+        case OPTK_SYSLOG:
+            mo.syslog = 1;
+            return(0);
+        case OPTK_HEDGE:
+            wget_hedge = 1;
+            return(0);
+        case OPTK_HTTP1:
+            wget_http2 = 0;
+            return(0);
+        case OPTK_INSECURE:
+            wget_insecure = 1;
+            return(0);
+        case OPTK_HUGE:
+            pool_huge = 1;
+            return(0);
+        case OPTK_WARMUP:
+            opt_warmup = 1;
+            return(0);
         default:
             fprintf(stderr, "see `%s -h' for usage (arg=%s, key=%d)\n", outargs->argv[0], arg, key);
             exit(1);
@@ -891,24 +1409,87 @@ static struct fuse_opt rofs_opts[] = {
     FUSE_OPT_KEY("readahead", OPTK_READAHEAD),
     FUSE_OPT_KEY("--execfiles", OPTK_EXEC),
     FUSE_OPT_KEY("execfiles", OPTK_EXEC),
+    FUSE_OPT_KEY("--syslog", OPTK_SYSLOG),
+    FUSE_OPT_KEY("syslog", OPTK_SYSLOG),
+    FUSE_OPT_KEY("--hedge", OPTK_HEDGE),
+    FUSE_OPT_KEY("hedge", OPTK_HEDGE),
+    FUSE_OPT_KEY("--http1", OPTK_HTTP1),
+    FUSE_OPT_KEY("http1", OPTK_HTTP1),
+    FUSE_OPT_KEY("--insecure", OPTK_INSECURE),
+    FUSE_OPT_KEY("insecure", OPTK_INSECURE),
+    FUSE_OPT_KEY("--hugepages", OPTK_HUGE),
+    FUSE_OPT_KEY("hugepages", OPTK_HUGE),
+    FUSE_OPT_KEY("--warmup", OPTK_WARMUP),
+    FUSE_OPT_KEY("warmup", OPTK_WARMUP),
     {"--metadata=%s", offsetof(MyOptions, metadata), -1},
     {"metadata=%s", offsetof(MyOptions, metadata), -1},
+    {"--delta=%s", offsetof(MyOptions, delta), -1},
+    {"delta=%s", offsetof(MyOptions, delta), -1},
     {"--url=%s", offsetof(MyOptions, path), -1},
     {"url=%s", offsetof(MyOptions, path), -1},
+    {"--mirrors=%s", offsetof(MyOptions, mirrors), -1},
+    {"mirrors=%s", offsetof(MyOptions, mirrors), -1},
     {"--chunks=%d", offsetof(MyOptions, chunks), -1},
     {"chunks=%d", offsetof(MyOptions, chunks), -1},
+    {"--chunksize=%d", offsetof(MyOptions, chunksize), -1},
+    {"chunksize=%d", offsetof(MyOptions, chunksize), -1},
+    /* old (misspelled) names, kept for compatibility */
     {"--chunksise=%d", offsetof(MyOptions, chunksize), -1},
     {"chunksise=%d", offsetof(MyOptions, chunksize), -1},
+    {"--chunksize_min=%d", offsetof(MyOptions, chunksize_min), -1},
+    {"chunksize_min=%d", offsetof(MyOptions, chunksize_min), -1},
+    {"--chunksize_max=%d", offsetof(MyOptions, chunksize_max), -1},
+    {"chunksize_max=%d", offsetof(MyOptions, chunksize_max), -1},
     {"--metafile=%s", offsetof(MyOptions, metafile), -1},
     {"metafile=%s", offsetof(MyOptions, metafile), -1},
+    {"--profiles=%s", offsetof(MyOptions, profiles), -1},
+    {"profiles=%s", offsetof(MyOptions, profiles), -1},
+    {"--loglevel=%s", offsetof(MyOptions, loglevel), -1},
+    {"loglevel=%s", offsetof(MyOptions, loglevel), -1},
+    {"--logfile=%s", offsetof(MyOptions, logfile), -1},
+    {"logfile=%s", offsetof(MyOptions, logfile), -1},
+    {"--trace=%s", offsetof(MyOptions, trace), -1},
+    {"trace=%s", offsetof(MyOptions, trace), -1},
+    {"--latency=%d", offsetof(MyOptions, latency), -1},
+    {"latency=%d", offsetof(MyOptions, latency), -1},
+    {"--bandwidth=%d", offsetof(MyOptions, bandwidth), -1},
+    {"bandwidth=%d", offsetof(MyOptions, bandwidth), -1},
+    {"--retries=%d", offsetof(MyOptions, retries), -1},
+    {"retries=%d", offsetof(MyOptions, retries), -1},
+    {"--backoff=%d", offsetof(MyOptions, backoff), -1},
+    {"backoff=%d", offsetof(MyOptions, backoff), -1},
+    {"--timeout=%d", offsetof(MyOptions, timeout), -1},
+    {"timeout=%d", offsetof(MyOptions, timeout), -1},
+    {"--deadline=%d", offsetof(MyOptions, deadline), -1},
+    {"deadline=%d", offsetof(MyOptions, deadline), -1},
+    {"--maxrate=%d", offsetof(MyOptions, maxrate), -1},
+    {"maxrate=%d", offsetof(MyOptions, maxrate), -1},
+    {"--maxreqs=%d", offsetof(MyOptions, maxreqs), -1},
+    {"maxreqs=%d", offsetof(MyOptions, maxreqs), -1},
+    {"--workers=%d", offsetof(MyOptions, workers), -1},
+    {"workers=%d", offsetof(MyOptions, workers), -1},
+    {"--slots=%d", offsetof(MyOptions, slots), -1},
+    {"slots=%d", offsetof(MyOptions, slots), -1},
+    {"--weights=%s", offsetof(MyOptions, weights), -1},
+    {"weights=%s", offsetof(MyOptions, weights), -1},
+    {"--keepalive=%d", offsetof(MyOptions, keepalive), -1},
+    {"keepalive=%d", offsetof(MyOptions, keepalive), -1},
+    {"--cacert=%s", offsetof(MyOptions, cacert), -1},
+    {"cacert=%s", offsetof(MyOptions, cacert), -1},
+    {"--negttl=%d", offsetof(MyOptions, negttl), -1},
+    {"negttl=%d", offsetof(MyOptions, negttl), -1},
+    {"--memory=%d", offsetof(MyOptions, memory), -1},
+    {"memory=%d", offsetof(MyOptions, memory), -1},
+    {"--compress=%d", offsetof(MyOptions, compress), -1},
+    {"compress=%d", offsetof(MyOptions, compress), -1},
     FUSE_OPT_END
 };
 
 int main(int argc, char *argv[])
 {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-    int res, nb, fd;
-    FILE *f;
+    pthread_rwlockattr_t rwattr;
+    int res;
 
 
     /* initialise cache system */
@@ -929,6 +1510,18 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    /* logs */
+    res = MYLOG_WARN;
+    if ((mo.loglevel != NULL)&&((res = mylog_level_name(mo.loglevel)) < 0)) {
+        fprintf(stderr, "Invalid log level '%s' (error, warn, info or debug).\n",
+                mo.loglevel);
+        exit(1);
+    }
+    if (!mylog_init(res, mo.logfile, mo.syslog)) {
+        fprintf(stderr, "Failed to initialize logs. Abort.\n");
+        exit(3);
+    }
+
     /* copy args in local */
     if (mo.path == NULL) {
         fprintf(stderr, "Missing URL. See -h for help.\n");
@@ -939,11 +1532,24 @@ int main(int argc, char *argv[])
     url_path = strdup(mo.path);
     if (mo.metadata != NULL)
       url_metadata = strdup(mo.metadata);
-    if ((url_path == NULL)||(url_metadata == NULL)) {
+    if (mo.delta != NULL)
+      url_delta = strdup(mo.delta);
+    if ((url_path == NULL)||(url_metadata == NULL)||
+        ((mo.delta != NULL)&&(url_delta == NULL))) {
         fprintf(stderr, "Internal error while copying options. Abort.\n");
         exit(1);
     }
 
+    /* mirrors of URL (HTTP only) */
+    if ((mo.mirrors != NULL)&&(fget_is_local(url_path))) {
+        fprintf(stderr, "Mirrors can't be used with a local URL.\n");
+        exit(1);
+    }
+    if (!mirror_init(url_path, mo.mirrors)) {
+        fprintf(stderr, "Invalid mirrors (max %d URLs).\n", MIRROR_MAX);
+        exit(1);
+    }
+
     if ((mo.chunks > 0)&&(mo.chunks <= CACHE_MAX_CHUNK)) {
       cache_chunks = mo.chunks;
     } else {
@@ -963,6 +1569,94 @@ int main(int argc, char *argv[])
       }
     }
 
+    /* bounds for adaptive chunk size. if not given, they are extended
+       to include the initial size */
+    if (mo.chunksize_min > 0) {
+      if (mo.chunksize_min < 512) {
+        fprintf(stderr, "Min chunk size '%d' too small (min: 512).\n", mo.chunksize_min);
+ 	exit(1);
+      }
+      cache_chunksize_min = mo.chunksize_min;
+    } else {
+      cache_chunksize_min = MIN(cache_chunksize_min, cache_chunksize);
+    }
+    if (mo.chunksize_max > 0) {
+      cache_chunksize_max = mo.chunksize_max;
+    } else {
+      if (cache_chunksize_max < cache_chunksize)
+        cache_chunksize_max = cache_chunksize;
+    }
+    if ((cache_chunksize < cache_chunksize_min)||(cache_chunksize > cache_chunksize_max)) {
+      fprintf(stderr, "Chunk size '%d' not in min/max bounds (%d-%d).\n",
+              cache_chunksize, cache_chunksize_min, cache_chunksize_max);
+      exit(1);
+    }
+    /* memory budget: at least a firstblock and a chunk of a file */
+    pool_budget = (unsigned long long)mo.memory*1024*1024;
+    if ((mo.memory < 0)||
+        ((pool_budget > 0)&&(pool_budget < 3ULL*cache_chunksize_max))) {
+      fprintf(stderr, "Invalid memory budget '%d' (min: %d MB).\n", mo.memory,
+              (int)((3ULL*cache_chunksize_max+1024*1024-1)/(1024*1024)));
+      exit(1);
+    }
+    if (mo.compress < 0) {
+      fprintf(stderr, "Invalid memory for compressed chunks '%d'.\n", mo.compress);
+      exit(1);
+    }
+    ztier_budget = (unsigned long long)mo.compress*1024*1024;
+
+    /* simulated network */
+    if ((mo.latency < 0)||(mo.bandwidth < 0)) {
+      fprintf(stderr, "Invalid latency or bandwidth.\n");
+      exit(1);
+    }
+    cache_latency = mo.latency;
+    cache_bandwidth = mo.bandwidth;
+
+    /* request policy */
+    if ((mo.timeout < 0)||(mo.deadline < 0)) {
+      fprintf(stderr, "Invalid timeout or deadline.\n");
+      exit(1);
+    }
+    if (mo.retries >= 0)
+      wget_retries = mo.retries;
+    if (mo.backoff >= 0)
+      wget_backoff = mo.backoff;
+    wget_timeout = mo.timeout;
+    wget_deadline = mo.deadline;
+
+    /* connections */
+    if (mo.keepalive >= 0)
+      wget_keepalive = mo.keepalive;
+    if (mo.negttl >= 0)
+      opt_negttl = mo.negttl;
+    wget_cacert = mo.cacert;
+
+    /* transfer scheduler */
+    if ((mo.maxrate < 0)||(mo.maxreqs < 0)) {
+      fprintf(stderr, "Invalid max rate or max requests.\n");
+      exit(1);
+    }
+    sched_rate = mo.maxrate;
+    sched_reqrate = mo.maxreqs;
+    if (mo.workers >= 0)
+      sched_workers = mo.workers;
+    if (mo.slots >= 0)
+      sched_slots = mo.slots;
+    if (!sched_weights(mo.weights)) {
+      fprintf(stderr, "Invalid weights '%s' (name:weight,... weight 1-1000).\n",
+              mo.weights);
+      exit(1);
+    }
+    if (mo.readahead)
+      cache_readahead = cache_chunks-1;
+
+    /* access profiles */
+    if (!profile_init(mo.profiles)) {
+      fprintf(stderr, "Failed to initialize access profiles. Abort.\n");
+      exit(3);
+    }
+
     /* check: if using a updater program for metadata file,
        this one must be set with --metafile */
     if ((url_metadata[0] == '@')&&(mo.metafile == NULL)) {
@@ -973,22 +1667,14 @@ int main(int argc, char *argv[])
       exit(8);
     }
 
-    /* temp file to get the metadata for filesystem */
-    /* does user gives a metafile name? */
+    /* local file for the metadata (only for updater program:
+       downloaded metadata is parsed on the fly) */
     tpl[0] = '\0';
-    if (mo.metafile != NULL) {
+    if (mo.metafile != NULL)
       strcat(tpl, mo.metafile);
-    } else {
-      strcat(tpl, "/tmp/webfsdesc.XXXXXX");
-      fd = mkstemp(tpl);
-      if (fd < 0) {
-	fprintf(stderr, "Failed to create temporaty file.\n");
-	exit(5);
-      }
-      close(fd); /* we use a FILE, not a fd */
-    }
     
     /* build URL of metadata */
+    wget_meta_reset(&meta_state);
     metaurl[0] = '\0';
     /* special case: if url_metadata starts by @ it is the
        name of the program to use to update the code */
@@ -997,30 +1683,38 @@ int main(int argc, char *argv[])
     } else {
       strcat(metaurl, wget_encode(url_path, url_metadata));
     }
-    if (!load_metadata()) {
-      fprintf(stderr, "Failed to download metadata file.\n");
-      exit(5);
-    }
-
-    /* load metadata to create FS tree */
-    f = fopen(tpl, "r");
-    if (f == NULL) {
-        fprintf(stderr, "Failed to open description file. Abort.\n");
-	exit(9);
-    }
-    nb = tree_create(f);
-    if (nb <= 0) {
-        /* this is an error */
-	fprintf(stderr, "Error while loading filesystem description. Abort.\n");
-	exit(1);
+    /* same for delta (not used with an updater program) */
+    wget_meta_reset(&delta_state);
+    deltaurl[0] = '\0';
+    if ((url_delta != NULL)&&(url_metadata[0] != '@'))
+      strcat(deltaurl, wget_encode(url_path, url_delta));
+
+    /* tree updates go before new readers */
+    pthread_rwlockattr_init(&rwattr);
+    pthread_rwlockattr_setkind_np(&rwattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&tree_lock, &rwattr);
+    pthread_rwlockattr_destroy(&rwattr);
+
+    /* get metadata to create FS tree (as a callback: shared lock) */
+    pthread_rwlock_rdlock(&tree_lock);
+    res = load_metadata(0);
+    pthread_rwlock_unlock(&tree_lock);
+    if (res != 1) {
+        fprintf(stderr, "Error while loading filesystem description: %s Abort.\n",
+                update_msg);
+	exit(5);
     }
-    printf("%d entries added in FS tree.\n", nb);
+    printf("%d entries added in FS tree.\n", update_nbent);
     tree_print();
-    fclose(f);
-    update_ok = UP_OK;
-    update_nbent = nb;
 
-    printf("Info: chunksize: %d, #chunks: %d\n", cache_chunksize, cache_chunks);
+    printf("Info: chunksize: %d (%d-%d), #chunks: %d\n", cache_chunksize,
+           cache_chunksize_min, cache_chunksize_max, cache_chunks);
+
+    /* access trace. opened now as FUSE may change current dir */
+    if ((mo.trace != NULL)&&(!record_init(mo.trace))) {
+        fprintf(stderr, "Failed to create trace file '%s'. Abort.\n", mo.trace);
+        exit(3);
+    }
 
     /* only for fuse 26. else remove the final NULL */
     fuse_main(args.argc, args.argv, &callback_oper, NULL);
@@ -1029,11 +1723,11 @@ int main(int argc, char *argv[])
     /* terminate everythings */
     tree_free();
     cache_fini();
+    profile_fini();
     wget_fini();
-    
-    /* remove temp file */
-    if (url_metadata[0] != '@') /* do not remove in this case */
-      unlink((const char *)tpl);
+    mirror_fini();
+    record_fini();
+    mylog_stop();
     
     return(0);
 }
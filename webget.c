@@ -1,62 +1,335 @@
+#include <pthread.h>
+
 #include "webget.h"
 #include "tools.h"
 #include "cache.h"
+#include "stats.h"
+#include "probe.h"
+#include "mirror.h"
+
+
+/* CURL handlers, one set per thread (created at first use, removed
+   at thread exit). The multi handler of a thread runs all its
+   transfers, so that they use the same connection pool */
+static __thread CURL *wget_handler = NULL;
+static __thread CURL *wget_hedger = NULL;   /* for duplicates of slow requests */
+static __thread CURLM *wget_multi = NULL;   /* runs a request and its duplicate */
+static __thread unsigned int wget_seed = 0; /* jitter of retries (rand_r) */
+static pthread_key_t wget_key;
+
+/* flag stopping the transfers of this thread (see wget_set_cancel) */
+static __thread int *wget_cancel = NULL;
+
+/* DNS cache and TLS sessions, shared by all threads (a new connection
+   to a known server skips name resolution and resumes TLS session).
+   Connections are not shared: CURL does not support using a connection
+   pool from several threads, each thread keeps its own */
+static CURLSH *wget_share = NULL;
+static pthread_mutex_t wget_share_lock[CURL_LOCK_DATA_LAST];
+
+/* max connections kept open by a thread */
+#define WGET_CONNS 16
+
+/* connection settings */
+int wget_keepalive = 60;   /* idle connections kept open (s, 0: no reuse) */
+int wget_http2 = 1;        /* HTTP/2 on HTTPS (several requests at once
+                              on one connection) */
+char *wget_cacert = NULL;  /* CA certificates file (NULL: system ones) */
+int wget_insecure = 0;     /* don't check server certificates */
+
+/* request policy: retries of failed reads with exponential backoff,
+   max duration of an attempt and of a whole read (retries included),
+   and hedging (duplicate request when an attempt takes longer than
+   the 95th percentile of recent reads, the first answer wins) */
+int wget_retries = 2;              /* retries after a failed attempt */
+unsigned int wget_backoff = 100;   /* delay before first retry (ms) */
+unsigned int wget_timeout = 0;     /* max duration of an attempt (ms, 0: none) */
+unsigned int wget_deadline = 0;    /* max duration of a read (ms, 0: none) */
+int wget_hedge = 0;                /* send duplicates of slow requests */
+
+/* latencies of last successful reads (us), for the hedging delay */
+#define WGET_LAT     64
+#define WGET_LAT_MIN 20  /* no hedging before that many reads */
+unsigned int wget_lat[WGET_LAT];
+unsigned int wget_nlat = 0;
+static pthread_mutex_t wget_lat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* results of an attempt */
+#define WGET_OK    0
+#define WGET_RETRY 1  /* failed, may work next time */
+#define WGET_FATAL 2  /* failed, no need to try again */
+
+
+/* locking of shared data (DNS, TLS sessions) */
+static void wget_share_get(CURL *hdl, curl_lock_data data,
+                           curl_lock_access access, void *unused) {
+  (void)hdl; (void)access; (void)unused;
+  pthread_mutex_lock(&(wget_share_lock[data]));
+}
 
+static void wget_share_put(CURL *hdl, curl_lock_data data, void *unused) {
+  (void)hdl; (void)unused;
+  pthread_mutex_unlock(&(wget_share_lock[data]));
+}
 
-CURL *wget_handler = NULL;
-
+/* set options common to all handlers */
+static void wget_setup(CURL *hdl) {
+  long idle = MAX(wget_keepalive/2, 1);
+
+  curl_easy_setopt(hdl, CURLOPT_USERAGENT, "libcurl-WebFS/1.0");
+  if (wget_share != NULL)
+    curl_easy_setopt(hdl, CURLOPT_SHARE, wget_share);
+  /* keep connections alive between requests (TCP keepalive probes
+     so that idle ones are not dropped by NATs/firewalls) */
+  if (wget_keepalive > 0) {
+    curl_easy_setopt(hdl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(hdl, CURLOPT_TCP_KEEPIDLE, idle);
+    curl_easy_setopt(hdl, CURLOPT_TCP_KEEPINTVL, idle);
+    curl_easy_setopt(hdl, CURLOPT_MAXAGE_CONN, (long)wget_keepalive);
+  } else {
+    curl_easy_setopt(hdl, CURLOPT_FORBID_REUSE, 1L);
+  }
+  /* HTTP/2 if server supports it (ALPN), waiting for a connection being
+     opened to the same server instead of opening another one */
+  if (wget_http2) {
+    curl_easy_setopt(hdl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(hdl, CURLOPT_PIPEWAIT, 1L);
+  } else {
+    curl_easy_setopt(hdl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_1_1);
+  }
+  if (wget_cacert != NULL)
+    curl_easy_setopt(hdl, CURLOPT_CAINFO, wget_cacert);
+  if (wget_insecure) {
+    curl_easy_setopt(hdl, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(hdl, CURLOPT_SSL_VERIFYHOST, 0L);
+  }
+}
 
-/* initialise CURL stuff */
-int wget_init() {
+/* remove CURL handlers of the thread */
+static void wget_thread_end(void *unused) {
+  (void)unused;
+  if (wget_multi != NULL)
+    curl_multi_cleanup(wget_multi);
+  if (wget_hedger != NULL)
+    curl_easy_cleanup(wget_hedger);
+  if (wget_handler != NULL)
+    curl_easy_cleanup(wget_handler);
+  wget_multi = NULL;
+  wget_hedger = wget_handler = NULL;
+}
 
-  curl_global_init(CURL_GLOBAL_ALL);
+/* create CURL handlers of the thread if needed */
+static int wget_thread() {
+  if (wget_handler != NULL)
+    return(1);
   wget_handler = curl_easy_init();
+  wget_hedger = curl_easy_init();
+  wget_multi = curl_multi_init();
   
-  if (wget_handler == NULL)
+  if ((wget_handler == NULL)||(wget_hedger == NULL)||(wget_multi == NULL)) {
+    wget_thread_end(NULL);
     return(0);
+  }
   
   /* init */
-  curl_easy_setopt(wget_handler, CURLOPT_USERAGENT, "libcurl-WebFS/1.0");
-  curl_easy_setopt(wget_handler, CURLOPT_URL, NULL);
-  curl_easy_setopt(wget_handler, CURLOPT_RANGE, NULL);
-  curl_easy_setopt(wget_handler, CURLOPT_WRITEFUNCTION, NULL);
-  curl_easy_setopt(wget_handler, CURLOPT_WRITEDATA, NULL);
+  wget_setup(wget_handler);
+  wget_setup(wget_hedger);
+  wget_seed = (unsigned int)stats_now() ^ (unsigned int)pthread_self();
+  curl_multi_setopt(wget_multi, CURLMOPT_MAXCONNECTS, (long)WGET_CONNS);
+  if (wget_http2)
+    curl_multi_setopt(wget_multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+  /* to be called at thread exit */
+  pthread_setspecific(wget_key, wget_handler);
   
   return(1);
 }
 
-/* terminate CURL stuff */
+/* initialise CURL stuff. Handlers are created at first use, after
+   settings are read */
+int wget_init() {
+  int i;
+
+  curl_global_init(CURL_GLOBAL_ALL);
+  if (pthread_key_create(&wget_key, wget_thread_end) != 0)
+    return(0);
+  wget_share = curl_share_init();
+  if (wget_share != NULL) {
+    for(i=0; i<CURL_LOCK_DATA_LAST; i++)
+      pthread_mutex_init(&(wget_share_lock[i]), NULL);
+    curl_share_setopt(wget_share, CURLSHOPT_LOCKFUNC, wget_share_get);
+    curl_share_setopt(wget_share, CURLSHOPT_UNLOCKFUNC, wget_share_put);
+    curl_share_setopt(wget_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(wget_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  }
+  return(1);
+}
+
+/* terminate CURL stuff (other threads must be done) */
 int wget_fini() {
-  curl_easy_cleanup(wget_handler);
+  wget_thread_end(NULL);
+  pthread_setspecific(wget_key, NULL);
+  if (wget_share != NULL)
+    curl_share_cleanup(wget_share);
+  wget_share = NULL;
   
   return(1);
 }
 
+/* run one transfer on the multi handler of the thread (to use its
+   connections), as curl_easy_perform. returns result of the transfer */
+static CURLcode wget_perform(CURL *hdl) {
+  CURLcode r=CURLE_FAILED_INIT;
+  CURLMsg *msg;
+  int running=1, left;
+
+  if (!wget_thread())
+    return(r);
+  if (curl_multi_add_handle(wget_multi, hdl) != CURLM_OK)
+    return(r);
+  while(running) {
+    if (curl_multi_perform(wget_multi, &running) != CURLM_OK)
+      break;
+    if (running)
+      curl_multi_wait(wget_multi, NULL, 0, 1000, NULL);
+  }
+  while((msg = curl_multi_info_read(wget_multi, &left)) != NULL)
+    if ((msg->msg == CURLMSG_DONE)&&(msg->easy_handle == hdl))
+      r = msg->data.result;
+  curl_multi_remove_handle(wget_multi, hdl);
+  return(r);
+}
+
+/* transfers of this thread stop when '*flag' is set (NULL: never) */
+void wget_set_cancel(int *flag) {
+  wget_cancel = flag;
+}
+
+/* true if transfers of this thread must stop */
+static int wget_cancelled() {
+  return((wget_cancel != NULL)&&(__atomic_load_n(wget_cancel, __ATOMIC_RELAXED)));
+}
+
+/* add stats for a finished transfer (time from CURL) */
+void wget_stats(CURL *hdl, int ok, unsigned int size) {
+  curl_off_t us=0;
+
+  curl_easy_getinfo(hdl, CURLINFO_TOTAL_TIME_T, &us);
+  stats_time(ST_FETCH, (unsigned long long)us);
+  if (ok)
+    stats_add(SC_FETCH_DATA, size);
+  else
+    stats_add(SC_FETCH_ERR, 1);
+}
+
+
+/* count connections opened by a finished transfer, and time spent to
+   open them (name resolution, TCP and TLS handshakes) */
+static void wget_connect_stats(CURL *hdl) {
+  curl_off_t us=0;
+  long nb=0;
+
+  curl_easy_getinfo(hdl, CURLINFO_NUM_CONNECTS, &nb);
+  if (nb <= 0)
+    return;  /* re-used a connection */
+  curl_easy_getinfo(hdl, CURLINFO_APPCONNECT_TIME_T, &us);
+  if (us == 0)  /* not TLS */
+    curl_easy_getinfo(hdl, CURLINFO_CONNECT_TIME_T, &us);
+  stats_add(SC_CONNECT, nb);
+  stats_add(SC_CONNECT_US, (unsigned long long)us);
+}
+
+/* give the result of a finished (or cancelled) transfer to its mirror */
+static void wget_mirror_done(CURL *hdl, int m, int result, unsigned int bytes) {
+  curl_off_t ttfb=0, total=0;
+
+  wget_connect_stats(hdl);
+  curl_easy_getinfo(hdl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+  curl_easy_getinfo(hdl, CURLINFO_TOTAL_TIME_T, &total);
+  mirror_done(m, result, (unsigned long long)ttfb, (unsigned long long)total, bytes);
+}
+
+
+/* destination of one transfer: data is written straight where it is
+   wanted (chunk of a cache, first block, buffer of the application),
+   never after the size expected. The body of an error reply is not
+   stored */
+typedef struct {
+  CURL *handler;        /* transfer (to check its reply) */
+  char *dest;           /* where to put data */
+  unsigned int size;    /* size expected */
+  unsigned int offset;  /* size received */
+  int checked;          /* reply code checked */
+  int error;            /* error reply (body dropped) */
+  int overflow;         /* more data than expected (transfer aborted) */
+}WgetSink;
+
+/* set a sink for 'size' bytes in 'dest', for transfer 'hdl' */
+static void wget_sink_init(WgetSink *sink, CURL *hdl, char *dest,
+                           unsigned int size) {
+  sink->handler = hdl;
+  sink->dest = dest;
+  sink->size = size;
+  sink->offset = 0;
+  sink->checked = sink->error = sink->overflow = 0;
+}
+
 /* the "data-copy" function */
-size_t wget_push_data(void *ptr, size_t size, size_t nmemb, void *data) {
-  static unsigned int offset = 0;
-  mylog("wget_push_data: asked to copy %u*%u=%u bytes from WEB link\n",
-        (unsigned int)size, (unsigned int)nmemb, (unsigned int)(size*nmemb));
-
-  /* special: reset offset */
-  if ((ptr == NULL)&&(data == NULL)) {
-    offset = 0;
+size_t wget_push_sink(void *ptr, size_t size, size_t nmemb, void *data) {
+  WgetSink *sink = (WgetSink*)data;
+  long reply = 0;
+
+  /* transfer no more needed */
+  if (wget_cancelled())
     return(0);
+  if (!sink->checked) {
+    sink->checked = 1;
+    curl_easy_getinfo(sink->handler, CURLINFO_RESPONSE_CODE, &reply);
+    sink->error = (reply >= 300);
   }
-
-  if (data == NULL) {
-    /* just ignore write */
-    mylog("wget_push_data: data is NULL. Skip.\n");
-    offset = 0;
+  if (sink->error)
     return(size*nmemb);
+  /* never write after the expected size (range not supported?) */
+  if (sink->offset+size*nmemb > sink->size) {
+    sink->overflow = 1;
+    return(0);  /* abort this transfer */
   }
-  mylog("wget_push_data: memcpy(%p+%u=%p, %p, %u)\n", data, offset, data+offset, ptr,
-         (unsigned int)size*nmemb);
-  memcpy(data+offset, ptr, size*nmemb);
-  offset += size*nmemb;
+  memcpy(sink->dest+sink->offset, ptr, size*nmemb);
+  sink->offset += size*nmemb;
   return(size*nmemb);
 }
 
+/* true if a transfer got all data expected by its sink, else log why */
+static int wget_sink_full(WgetSink *sink, CURLcode r) {
+  char *url = "";
+
+  curl_easy_getinfo(sink->handler, CURLINFO_EFFECTIVE_URL, &url);
+  if (sink->overflow)
+    mylogl(MYLOG_WARN, "'%s': body longer than %u bytes (range ignored?)\n",
+           url, sink->size);
+  else if ((r == CURLE_OK)&&(!sink->error)&&(sink->offset != sink->size))
+    mylogl(MYLOG_WARN, "'%s': short body (%u/%u bytes)\n", url,
+           sink->offset, sink->size);
+  return((r == CURLE_OK)&&(!sink->error)&&(sink->offset == sink->size));
+}
+
+/* result for the mirror (MIRROR_*) of a finished transfer that gave
+   'ret' (WGET_*): only network errors, timeouts and server errors
+   count against the mirror */
+static int wget_health(CURL *hdl, CURLcode r, WgetSink *rng, int ret) {
+  long reply=0;
+
+  if (ret == WGET_OK)
+    return(MIRROR_OK);
+  if (wget_cancelled())
+    return(MIRROR_CANCEL);
+  if (rng->overflow)
+    return(MIRROR_ERROR);
+  curl_easy_getinfo(hdl, CURLINFO_RESPONSE_CODE, &reply);
+  if ((r == CURLE_OK)&&(reply >= 300)&&(reply < 500)&&
+      (reply != 408)&&(reply != 429))
+    return(MIRROR_ERROR);
+  return(MIRROR_FAIL);
+}
 
 /* create a CURL handler for the given URL.
    CURL must be previously initialised.
@@ -64,49 +337,80 @@ size_t wget_push_data(void *ptr, size_t size, size_t nmemb, void *data) {
 int wget_connect(char *url, Connection *cnx, char *fistblock, unsigned int size) {
   CURLcode r;
   long reply;
-  char buffer[64];
+  char buffer[64], murl[MIRROR_URL];
+  WgetSink sink;
+  int m=-1, i, ok;
 
   mylog("wget_connect(%s, %p)\n", url, cnx);
+  if (!wget_thread()) {
+    errno = ENOMEM;
+    return(0);
+  }
+  if (!mirror_allow()) {
+    errno = EAGAIN;
+    return(0);
+  }
   mylog("wget_connect: handler = %p\n", wget_handler);
 
   /* check that file exists */
-  curl_easy_setopt(wget_handler, CURLOPT_URL, url);
   /* we need nothing, just testing the connection */
   curl_easy_setopt(wget_handler, CURLOPT_HEADER, 0L);
-  curl_easy_setopt(wget_handler, CURLOPT_WRITEFUNCTION, wget_push_data);
+  curl_easy_setopt(wget_handler, CURLOPT_WRITEFUNCTION, wget_push_sink);
+  curl_easy_setopt(wget_handler, CURLOPT_WRITEDATA, &sink);
   /* if 'fistblock' is NULL, to not request for file content, else
      set options for that */
   if (fistblock == NULL) {
-    curl_easy_setopt(wget_handler, CURLOPT_WRITEDATA, NULL);
     curl_easy_setopt(wget_handler, CURLOPT_NOBODY, 1L);
   } else {
-    /* reset offset */
-    wget_push_data(NULL, 0, 0, NULL);
-    curl_easy_setopt(wget_handler, CURLOPT_WRITEDATA, fistblock);
     curl_easy_setopt(wget_handler, CURLOPT_NOBODY, 0L);
     sprintf(buffer, "%u-%u", 0, size-1);
     curl_easy_setopt(wget_handler, CURLOPT_RANGE, buffer);
   }
-  /* perform request */
-  mylog("wget_connect: performing request...\n");
-  r = curl_easy_perform(wget_handler);
-  mylog("wget_connect: done\n");
-  if (r != CURLE_OK) {
-    mylog("wget_connect: perform returned %d\n", r);
-    curl_easy_setopt(wget_handler, CURLOPT_NOBODY, 0L);
-    curl_easy_setopt(wget_handler, CURLOPT_HEADER, 0L);
-    curl_easy_setopt(wget_handler, CURLOPT_WRITEDATA, NULL);
-    return(0);
+  /* perform request, on another mirror if a server fails */
+  for(i=0; ; i++) {
+    m = mirror_pick((fistblock == NULL)?0:size, m);
+    curl_easy_setopt(wget_handler, CURLOPT_URL, mirror_url(m, url, murl));
+    wget_sink_init(&sink, wget_handler, fistblock, (fistblock == NULL)?0:size);
+    mylog("wget_connect: performing request on '%s'...\n", murl);
+    stats_gauge(SG_INFLIGHT, 1);
+    r = wget_perform(wget_handler);
+    stats_gauge(SG_INFLIGHT, -1);
+    reply = 0;
+    curl_easy_getinfo(wget_handler, CURLINFO_RESPONSE_CODE , &reply);
+    ok = (r == CURLE_OK)&&(reply < 500);
+    /* the first block must be complete, as the cache uses it */
+    if ((fistblock != NULL)&&(reply < 300))
+      ok = wget_sink_full(&sink, r)&&(ok);
+    if (fistblock != NULL)
+      wget_stats(wget_handler, ok, size);
+    wget_mirror_done(wget_handler, m,
+                     ok?MIRROR_OK:wget_health(wget_handler, r, &sink, WGET_RETRY),
+                     sink.offset);
+    if ((ok)||(i+1 >= mirror_count())||(i >= wget_retries))
+      break;
+    stats_add(SC_RETRY, 1);
   }
+  mylog("wget_connect: done\n");
   curl_easy_setopt(wget_handler, CURLOPT_NOBODY, 0L);
   curl_easy_setopt(wget_handler, CURLOPT_HEADER, 0L);
+  curl_easy_setopt(wget_handler, CURLOPT_RANGE, NULL);
+  curl_easy_setopt(wget_handler, CURLOPT_WRITEFUNCTION, NULL);
   curl_easy_setopt(wget_handler, CURLOPT_WRITEDATA, NULL);
+  if (!ok) {
+    mylog("wget_connect: perform returned %d\n", r);
+    errno = EIO;
+    return(0);
+  }
 
   /* check return value */
   mylog("wget_connect: checking status...\n");
-  curl_easy_getinfo(wget_handler, CURLINFO_RESPONSE_CODE , &reply);
-  if (reply == 404)
-    return(0);  /* does not exists */
+  if ((reply == 404)||(reply == 410))
+    return(-1);  /* does not exists */
+  /* no first block in an error reply */
+  if ((fistblock != NULL)&&(reply >= 300)) {
+    errno = EIO;
+    return(0);
+  }
   
   return(1);
 }
@@ -118,82 +422,451 @@ int wget_disconnect(Connection *cnx) {
 }
 
 
-/* perform affective read from existing handler */
-int wget_read(Connection *cnx, unsigned int offset, unsigned int size,
-              char *dest) {
+/* set a handler to get a range of 'url' in 'rng'. 'timeout' in ms
+   (0: none) */
+static void wget_range_setup(CURL *hdl, char *url, unsigned int offset,
+                             WgetSink *rng, long timeout) {
   char buffer[64];
-  CURLcode r;
 
-  /* set data */
-  curl_easy_setopt(wget_handler, CURLOPT_URL, cnx->target);
-  sprintf(buffer, "%u-%u", offset, offset+size-1);
-  curl_easy_setopt(wget_handler, CURLOPT_RANGE, buffer);
-  mylog("wget_read: set options to '%s' [%s]\n", cnx->target, buffer);
-  /* our output function */
-  curl_easy_setopt(wget_handler, CURLOPT_WRITEFUNCTION, wget_push_data);
-  curl_easy_setopt(wget_handler, CURLOPT_WRITEDATA, dest);
-  curl_easy_setopt(wget_handler, CURLOPT_HEADER, 0L);
-  /* initialise local offset */
-  wget_push_data(NULL, 0, 0, NULL);
+  curl_easy_setopt(hdl, CURLOPT_URL, url);
+  sprintf(buffer, "%u-%u", offset, offset+rng->size-1);
+  curl_easy_setopt(hdl, CURLOPT_RANGE, buffer);
+  curl_easy_setopt(hdl, CURLOPT_WRITEFUNCTION, wget_push_sink);
+  curl_easy_setopt(hdl, CURLOPT_WRITEDATA, rng);
+  curl_easy_setopt(hdl, CURLOPT_HEADER, 0L);
+  curl_easy_setopt(hdl, CURLOPT_TIMEOUT_MS, timeout);
+}
+
+/* result (WGET_*) of a finished transfer of a range */
+static int wget_check(CURL *hdl, CURLcode r, WgetSink *rng) {
+  long reply=0;
+
+  curl_easy_getinfo(hdl, CURLINFO_RESPONSE_CODE, &reply);
+  mylog("wget_check: result %d, reply %ld, %u/%u bytes\n", r, reply,
+        rng->offset, rng->size);
+  /* more data than asked (range not supported?), or cancelled */
+  if ((rng->overflow)||(r == CURLE_WRITE_ERROR)) {
+    wget_sink_full(rng, r);
+    return(WGET_FATAL);
+  }
+  /* client errors (except timeout/too many requests) won't change */
+  if ((reply >= 400)&&(reply < 500)&&(reply != 408)&&(reply != 429))
+    return(WGET_FATAL);
+  if ((reply < 300)&&(wget_sink_full(rng, r)))
+    return(WGET_OK);
+  return(WGET_RETRY);
+}
+
+static int wget_cmp_lat(const void *a, const void *b) {
+  unsigned int x=*(unsigned int*)a, y=*(unsigned int*)b;
+  return((x > y) - (x < y));
+}
 
-  /* perform read */
-  r = curl_easy_perform(wget_handler);
+/* delay (us) after which a request is duplicated: 95th percentile of
+   recent reads. 0 if not enough reads yet */
+static unsigned long long wget_hedge_delay() {
+  unsigned int lat[WGET_LAT], nb;
 
+  pthread_mutex_lock(&wget_lat_lock);
+  nb = MIN(wget_nlat, WGET_LAT);
+  memcpy(lat, wget_lat, nb*sizeof(unsigned int));
+  pthread_mutex_unlock(&wget_lat_lock);
+  if (nb < WGET_LAT_MIN)
+    return(0);
+  qsort(lat, nb, sizeof(unsigned int), wget_cmp_lat);
+  return(lat[(nb*95)/100]);
+}
+
+/* one attempt to read a range (see wget_read), with a duplicate
+   request if hedging is on and the first one is slow (the duplicate
+   writes in a temporary buffer, copied if it answers first).
+   'deadline' is the date (from stats_now) to give up (0: none).
+   The mirror of the first request is put in 'used', and is not
+   'avoid' if possible. returns one of WGET_* */
+static int wget_attempt(Connection *cnx, unsigned int offset, unsigned int size,
+                        char *dest, unsigned long long deadline,
+                        int avoid, int *used) {
+  CURL *hdl[2];
+  char url[2][MIRROR_URL];
+  int mir[2] = { -1, -1 };
+  WgetSink rng[2];
+  unsigned long long start, hedge=0, now;
+  long timeout=wget_timeout;
+  int active[2] = { 0, 0 };
+  int i, running, left, wait, ret=WGET_RETRY, winner=-1;
+  char *tmp=NULL;
+  CURLMsg *msg;
+
+  if (!wget_thread())
+    return(WGET_RETRY);
+  if (!mirror_allow())
+    return(WGET_FATAL);  /* server down: don't wait for it */
+  hdl[0] = wget_handler;
+  hdl[1] = wget_hedger;
+  start = stats_now();
+  if (deadline > 0) {
+    if (deadline <= start)
+      return(WGET_RETRY);
+    if ((timeout == 0)||(timeout > (long)((deadline-start)/1000)))
+      timeout = (long)((deadline-start)/1000)+1;
+  }
+  if (wget_hedge)
+    hedge = wget_hedge_delay();
+
+  /* first request */
+  wget_sink_init(&(rng[0]), hdl[0], dest, size);
+  mir[0] = mirror_pick(size, avoid);
+  *used = mir[0];
+  wget_range_setup(hdl[0], mirror_url(mir[0], cnx->target, url[0]), offset,
+                   &(rng[0]), timeout);
+  mylog("wget_attempt: '%s' [%u+%u] timeout %ld ms, hedge after %llu us\n",
+        url[0], offset, size, timeout, hedge);
+  PROBE3(fetch_start, cnx->target, offset, size);
+  stats_gauge(SG_INFLIGHT, 1);
+  curl_multi_add_handle(wget_multi, hdl[0]);
+  active[0] = 1;
+
+  while(active[0] || active[1]) {
+    if (curl_multi_perform(wget_multi, &running) != CURLM_OK)
+      break;
+    /* finished transfers */
+    while((msg = curl_multi_info_read(wget_multi, &left)) != NULL) {
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+      i = (msg->easy_handle == hdl[0])?0:1;
+      ret = wget_check(hdl[i], msg->data.result, &(rng[i]));
+      wget_stats(hdl[i], ret == WGET_OK, size);
+      wget_mirror_done(hdl[i], mir[i],
+                       wget_health(hdl[i], msg->data.result, &(rng[i]), ret),
+                       rng[i].offset);
+      PROBE4(fetch_done, cnx->target, offset, rng[i].offset, msg->data.result);
+      curl_multi_remove_handle(wget_multi, hdl[i]);
+      stats_gauge(SG_INFLIGHT, -1);
+      active[i] = 0;
+      if (ret == WGET_OK) {
+        winner = i;
+        break;
+      }
+    }
+    /* a failed request ends the attempt only if the other one is not
+       running */
+    if ((winner >= 0)||(!(active[0] || active[1])))
+      break;
+    if (wget_cancelled()) {
+      ret = WGET_FATAL;
+      break;
+    }
+    /* time to send a duplicate? (only while first is running) */
+    now = stats_now();
+    if ((hedge > 0)&&(active[0])&&(now-start >= hedge)) {
+      hedge = 0;
+      tmp = malloc(size);
+      if (tmp != NULL) {
+        wget_sink_init(&(rng[1]), hdl[1], tmp, size);
+        /* on another mirror if any */
+        mir[1] = mirror_pick(size, mir[0]);
+        wget_range_setup(hdl[1], mirror_url(mir[1], cnx->target, url[1]), offset,
+                         &(rng[1]), timeout);
+        mylog("wget_attempt: slow request, sending a duplicate\n");
+        stats_add(SC_HEDGE, 1);
+        PROBE3(fetch_start, cnx->target, offset, size);
+        stats_gauge(SG_INFLIGHT, 1);
+        curl_multi_add_handle(wget_multi, hdl[1]);
+        active[1] = 1;
+        continue;
+      }
+    }
+    if (!(active[0] || active[1]))
+      break;
+    wait = 1000;
+    if ((hedge > 0)&&(active[0]))
+      wait = (int)MIN((start+hedge-now)/1000+1, 1000);
+    curl_multi_wait(wget_multi, NULL, 0, wait, NULL);
+  }
+
+  /* cancel the other request */
+  for(i=0; i<2; i++) {
+    if (!active[i])
+      continue;
+    mirror_done(mir[i], MIRROR_CANCEL, 0, stats_now()-start, 0);
+    curl_multi_remove_handle(wget_multi, hdl[i]);
+    stats_gauge(SG_INFLIGHT, -1);
+  }
+  if (winner == 1) {
+    memcpy(dest, tmp, size);
+    stats_add(SC_HEDGE_WIN, 1);
+  }
+  if (tmp != NULL)
+    free(tmp);
   /* remove options */
-  curl_easy_setopt(wget_handler, CURLOPT_RANGE, NULL);
-  curl_easy_setopt(wget_handler, CURLOPT_WRITEFUNCTION, NULL);
-  curl_easy_setopt(wget_handler, CURLOPT_WRITEDATA, NULL);
-  curl_easy_setopt(wget_handler, CURLOPT_HEADER, 1L);
+  for(i=0; i<2; i++) {
+    curl_easy_setopt(hdl[i], CURLOPT_RANGE, NULL);
+    curl_easy_setopt(hdl[i], CURLOPT_WRITEFUNCTION, NULL);
+    curl_easy_setopt(hdl[i], CURLOPT_WRITEDATA, NULL);
+    curl_easy_setopt(hdl[i], CURLOPT_TIMEOUT_MS, 0L);
+  }
 
-  /* error? */
-  if (r != CURLE_OK)
-    return(-ENOTCONN);
-  
-  return((int)(size));
+  if (winner < 0)
+    return((ret == WGET_OK)?WGET_RETRY:ret);
+  pthread_mutex_lock(&wget_lat_lock);
+  wget_lat[wget_nlat % WGET_LAT] = (unsigned int)(stats_now()-start);
+  wget_nlat++;
+  pthread_mutex_unlock(&wget_lat_lock);
+  return(WGET_OK);
+}
+
+/* perform affective read from existing handler. failed attempts are
+   tried again (wget_retries times at most, after a growing delay,
+   on another mirror if any) until wget_deadline */
+int wget_read(Connection *cnx, unsigned int offset, unsigned int size,
+              char *dest) {
+  unsigned long long deadline=0, delay, wait;
+  int ret, retry, m=-1;
+
+  if (wget_deadline > 0)
+    deadline = stats_now()+wget_deadline*1000ULL;
+  delay = wget_backoff*1000ULL;
+  for(retry=0; ; retry++) {
+    ret = wget_attempt(cnx, offset, size, dest, deadline, m, &m);
+    if (ret == WGET_OK)
+      return((int)(size));
+    if ((ret == WGET_FATAL)||(retry >= wget_retries)||(wget_cancelled()))
+      break;
+    /* exponential backoff, with jitter (half to full delay) */
+    wait = delay/2 + (unsigned long long)rand_r(&wget_seed)%(delay/2+1);
+    if ((deadline > 0)&&(stats_now()+wait >= deadline))
+      break;
+    mylogl(MYLOG_INFO, "wget_read: '%s' [%u+%u] failed, retry in %llu ms\n",
+           cnx->target, offset, size, wait/1000);
+    stats_add(SC_RETRY, 1);
+    usleep(wait);
+    delay *= 2;
+  }
+  mylogl(MYLOG_WARN, "wget_read: '%s' [%u+%u] failed (%d attempts)\n",
+         cnx->target, offset, size, retry+1);
+  return(-ENOTCONN);
+}
+
+/* resolve the name of each server (base URL 'base' and its mirrors)
+   and open a TLS session with it, with a HEAD request, so that first
+   reads don't wait for name resolution nor a full TLS handshake (names
+   and TLS sessions are shared by all threads). Connections are not:
+   the one opened stays in the pool of this thread, and other threads
+   still open theirs.
+   returns the number of servers that answered */
+int wget_warmup(const char *base) {
+  CURL *hdl[MIRROR_MAX];
+  char url[MIRROR_URL];
+  CURLMsg *msg;
+  int nm, i, n=0, running, left, ok=0;
+
+  if (!wget_thread())
+    return(0);
+  nm = MAX(mirror_count(), 1);
+  for(i=0; i<nm; i++) {
+    hdl[n] = curl_easy_init();
+    if (hdl[n] == NULL)
+      continue;
+    wget_setup(hdl[n]);
+    mirror_url(i, base, url);
+    strncat(url, "/", MIRROR_URL-strlen(url)-1);
+    curl_easy_setopt(hdl[n], CURLOPT_URL, url);
+    curl_easy_setopt(hdl[n], CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(hdl[n], CURLOPT_TIMEOUT_MS, (long)wget_timeout);
+    curl_multi_add_handle(wget_multi, hdl[n]);
+    n++;
+  }
+  do {
+    if (curl_multi_perform(wget_multi, &running) != CURLM_OK)
+      break;
+    if (running)
+      curl_multi_wait(wget_multi, NULL, 0, 1000, NULL);
+  } while(running);
+  /* any answer (even an error page) means a known server */
+  while((msg = curl_multi_info_read(wget_multi, &left)) != NULL) {
+    if ((msg->msg == CURLMSG_DONE)&&(msg->data.result == CURLE_OK)) {
+      wget_connect_stats(msg->easy_handle);
+      ok++;
+    }
+  }
+  for(i=0; i<n; i++) {
+    curl_multi_remove_handle(wget_multi, hdl[i]);
+    curl_easy_cleanup(hdl[i]);
+  }
+  mylogl(MYLOG_INFO, "wget_warmup: %d/%d servers answered\n", ok, n);
+  return(ok);
+}
+
+/* initialise a MetaState (no previous download) */
+void wget_meta_reset(MetaState *state) {
+  state->etag[0] = '\0';
+  state->filetime = -1;
 }
 
-/* get the FS description file in local */
-int wget_meta(char *url, FILE *f) {
+/* header function for wget_meta: catch the ETag */
+size_t wget_meta_header(char *ptr, size_t size, size_t nmemb, void *data) {
+  char *etag = (char*)data;
+  size_t lng = size*nmemb, i;
+
+  if ((lng > 5)&&(strncasecmp(ptr, "ETag:", 5) == 0)) {
+    /* skip spaces, and remove final \r\n */
+    for(i=5; (i<lng)&&(ptr[i]==' '); i++);
+    while((lng > i)&&((ptr[lng-1]=='\r')||(ptr[lng-1]=='\n')))
+      lng--;
+    if (lng-i < 256) {
+      memcpy(etag, ptr+i, lng-i);
+      etag[lng-i] = '\0';
+    }
+  }
+  return(size*nmemb);
+}
+
+/* state of a metadata download: line being received */
+typedef struct {
+  CURL *handler;
+  WgetLine func;
+  void *data;
+  char line[WGET_LINE];
+  unsigned int lng;
+  int checked;  /* reply code checked */
+  int stopped;  /* stopped by func */
+  int error;    /* stopped by an error reply */
+}WgetLines;
+
+/* the "data-copy" function for metadata: cut data in lines */
+size_t wget_push_lines(void *ptr, size_t size, size_t nmemb, void *data) {
+  WgetLines *wl = (WgetLines*)data;
+  char *cur = (char*)ptr, *eol;
+  size_t left = size*nmemb, lng, cpy;
+  long reply = 0;
+
+  /* an error page is not metadata */
+  if (!wl->checked) {
+    wl->checked = 1;
+    curl_easy_getinfo(wl->handler, CURLINFO_RESPONSE_CODE, &reply);
+    if (reply >= 400) {
+      wl->error = 1;
+      return(0);
+    }
+  }
+  while(left > 0) {
+    eol = memchr(cur, '\n', left);
+    lng = (eol == NULL)?left:(size_t)(eol-cur);
+    /* append to current line (truncated if too long) */
+    cpy = MIN(lng, WGET_LINE-1-wl->lng);
+    memcpy(wl->line+wl->lng, cur, cpy);
+    wl->lng += cpy;
+    if (eol == NULL)
+      break;
+    /* complete line */
+    wl->line[wl->lng] = '\0';
+    wl->lng = 0;
+    if (!wl->func(wl->line, wl->data)) {
+      wl->stopped = 1;
+      return(0);  /* abort transfer */
+    }
+    cur = eol+1;
+    left -= lng+1;
+  }
+  return(size*nmemb);
+}
+
+/* get the FS description file, giving each line to 'func' as soon
+   as received. If 'state' is not NULL the request is conditional, and
+   'state' is updated on success.
+   returns one of WGET_META_* */
+int wget_meta(char *url, MetaState *state, WgetLine func, void *data) {
   CURL *tmp;
   CURLcode r;
+  struct curl_slist *headers=NULL;
+  char buffer[256+32], etag[256];
+  long reply=0, ftime=-1, unmet=0;
+  WgetLines *wl;
 
   tmp = curl_easy_init();
   if (tmp == NULL)
-    return(0);
+    return(WGET_META_FAIL);
+  wl = malloc(sizeof(WgetLines));
+  if (wl == NULL) {
+    curl_easy_cleanup(tmp);
+    return(WGET_META_FAIL);
+  }
+  wget_setup(tmp);
+  wl->handler = tmp;
+  wl->func = func;
+  wl->data = data;
+  wl->lng = 0;
+  wl->checked = wl->stopped = wl->error = 0;
 
   /* set data */
   /* url *must* be pre-encoded */
   curl_easy_setopt(tmp, CURLOPT_URL, url);
-  curl_easy_setopt(tmp, CURLOPT_WRITEFUNCTION, NULL);
-  curl_easy_setopt(tmp, CURLOPT_WRITEDATA, f);
+  curl_easy_setopt(tmp, CURLOPT_WRITEFUNCTION, wget_push_lines);
+  curl_easy_setopt(tmp, CURLOPT_WRITEDATA, wl);
   curl_easy_setopt(tmp, CURLOPT_HEADER, 0L);
-
-  r = curl_easy_perform(tmp);
-  if (r != CURLE_OK) {
-    return(0);
+  /* accept any compression supported by CURL (gzip, deflate...) */
+  curl_easy_setopt(tmp, CURLOPT_ACCEPT_ENCODING, "");
+  /* conditional request, from previous download */
+  etag[0] = '\0';
+  curl_easy_setopt(tmp, CURLOPT_HEADERFUNCTION, wget_meta_header);
+  curl_easy_setopt(tmp, CURLOPT_HEADERDATA, etag);
+  curl_easy_setopt(tmp, CURLOPT_FILETIME, 1L);
+  if (state != NULL) {
+    if (state->etag[0] != '\0') {
+      sprintf(buffer, "If-None-Match: %s", state->etag);
+      headers = curl_slist_append(headers, buffer);
+      curl_easy_setopt(tmp, CURLOPT_HTTPHEADER, headers);
+    }
+    if (state->filetime > 0) {
+      curl_easy_setopt(tmp, CURLOPT_TIMECONDITION, (long)CURL_TIMECOND_IFMODSINCE);
+      curl_easy_setopt(tmp, CURLOPT_TIMEVALUE, state->filetime);
+    }
   }
 
+  r = wget_perform(tmp);
+  wget_connect_stats(tmp);
+  curl_easy_getinfo(tmp, CURLINFO_RESPONSE_CODE, &reply);
+  curl_easy_getinfo(tmp, CURLINFO_FILETIME, &ftime);
+  curl_easy_getinfo(tmp, CURLINFO_CONDITION_UNMET, &unmet);
   curl_easy_cleanup(tmp);
+  if (headers != NULL)
+    curl_slist_free_all(headers);
+
+  mylog("wget_meta(%s): result %d, reply %ld, etag '%s', time %ld\n", url,
+        r, reply, etag, ftime);
+  /* not modified (304 for HTTP, unmet condition for file://) */
+  if ((r == CURLE_OK)&&((reply == 304)||(unmet))) {
+    free(wl);
+    return(WGET_META_SAME);
+  }
+  /* error page is not metadata. An empty one is not seen by
+     wget_push_lines: for HTTP only a 200 reply is metadata (file://
+     has no reply code) */
+  if (((r != CURLE_OK)&&(!wl->stopped))||
+      ((reply != 200)&&(strncasecmp(url, "http", 4) == 0))) {
+    free(wl);
+    if (state != NULL)
+      wget_meta_reset(state);
+    return(WGET_META_FAIL);
+  }
+  /* last line, if not ended by \n */
+  if ((!wl->stopped)&&(wl->lng > 0)) {
+    wl->line[wl->lng] = '\0';
+    if (!func(wl->line, data))
+      wl->stopped = 1;
+  }
 
-  return(1);
-}
-
+  /* keep validators for next time */
+  if (state != NULL) {
+    strcpy(state->etag, etag);
+    state->filetime = ftime;
+  }
 
-void push_converted_char(const char c, char *buffer) {
-  char tmp[16];
-  
-  tmp[0] = '%';
-  sprintf(tmp+1, "%X", (int)c);
-  strcat(buffer, tmp);
+  r = wl->stopped?WGET_META_STOP:WGET_META_OK;
+  free(wl);
+  return(r);
 }
 
-void push_normal_char(const char c, char *buffer) {
-  char tmp[4];
-  
-  tmp[0] = c;
-  tmp[1] = '\0';
-  strcat(buffer, tmp);
-}
 
 int char_need_convert(const char c) {
   if ((c >= 'a')&&(c <= 'z'))
@@ -207,19 +880,47 @@ int char_need_convert(const char c) {
   return(1);
 }
 
-char *wget_encode(const char *base, const char *url) {
-  static char buffer[8192];
-  int i;
-  
-  buffer[0] = '\0';
-  strcat(buffer, base);
+/* append 'n' bytes to an encoded URL of length 'lng', complete up to
+   'end' (see wget_encode_to) */
+static void wget_put(char *dest, int size, int *lng, int *end,
+                     const char *str, int n) {
+  if ((*end == *lng)&&(*lng+n < size)) {
+    memcpy(dest+*lng, str, n);
+    *end = *lng+n;
+  }
+  *lng += n;
+}
+
+/* URL-encode base+file in 'dest' (max 'size' bytes, truncated if
+   needed). returns length of the full result (as snprintf) */
+int wget_encode_to(char *dest, int size, const char *base, const char *url) {
+  static const char hex[] = "0123456789ABCDEF";
+  const unsigned char *cur;
+  char tmp[3];
+  int lng=0, end=0;
+
+  wget_put(dest, size, &lng, &end, base, strlen(base));
   if (url[0] != '/')
-    strcat(buffer, "/");
-  for(i=0; i<strlen(url); i++) {
-    if (char_need_convert(url[i]))
-      push_converted_char(url[i], buffer);
-    else
-      push_normal_char(url[i], buffer);
+    wget_put(dest, size, &lng, &end, "/", 1);
+  for(cur=(const unsigned char*)url; *cur != '\0'; cur++) {
+    if (char_need_convert(*cur)) {
+      tmp[0] = '%';
+      tmp[1] = hex[*cur >> 4];
+      tmp[2] = hex[*cur & 15];
+      wget_put(dest, size, &lng, &end, tmp, 3);
+    } else {
+      wget_put(dest, size, &lng, &end, (const char*)cur, 1);
+    }
   }
+  if (size > 0)
+    dest[end] = '\0';
+  return(lng);
+}
+
+/* URL-encode base+file. static return (one per thread) */
+char *wget_encode(const char *base, const char *url) {
+  static __thread char buffer[8192];
+
+  wget_encode_to(buffer, sizeof(buffer), base, url);
   return(buffer);
 }
@@ -5,12 +5,47 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include <curl/curl.h>
 
 #include "cache.h"
 
 
+/* state kept between downloads of a metadata file, used to
+   perform conditional requests (If-None-Match/If-Modified-Since) */
+typedef struct {
+  char etag[256];  /* last ETag received ("" if none) */
+  long filetime;   /* last Last-Modified received (-1 if none) */
+}MetaState;
+
+/* return values of wget_meta */
+#define WGET_META_FAIL 0  /* failed to get the file */
+#define WGET_META_OK   1  /* file downloaded */
+#define WGET_META_SAME 2  /* not modified since last download */
+#define WGET_META_STOP 3  /* stopped by the line function */
+
+/* function called for each line of a metadata file while it is
+   downloaded (line without final \n). returns 0 to stop download */
+typedef int (*WgetLine)(char *line, void *data);
+
+/* max length of a line of metadata (longer lines are truncated) */
+#define WGET_LINE 4096
+
+/* request policy for reads (see webget.c) */
+extern int wget_retries;            /* retries after a failed attempt */
+extern unsigned int wget_backoff;   /* delay before first retry (ms) */
+extern unsigned int wget_timeout;   /* max duration of an attempt (ms) */
+extern unsigned int wget_deadline;  /* max duration of a read (ms) */
+extern int wget_hedge;              /* duplicate slow requests */
+
+/* connection settings (see webget.c) */
+extern int wget_keepalive;  /* idle connections kept open (s, 0: no reuse) */
+extern int wget_http2;      /* HTTP/2 on HTTPS */
+extern char *wget_cacert;   /* CA certificates file (NULL: system ones) */
+extern int wget_insecure;   /* don't check server certificates */
+
+
 /* initialise CURL stuff */
 int wget_init();
 
@@ -19,23 +54,44 @@ int wget_fini();
 
 /* create a CURL handler for the given URL.
    CURL must be previously initialised.
-   get an anonymous pointer to store  */
+   get an anonymous pointer to store. If 'fistblock' is not NULL, it
+   receives the first 'size' bytes of the file (failed if shorter).
+   returns 1 if ok, 0 if failed (errno EIO: server error, EAGAIN: server
+   down, not asked), -1 if the file does not exist */
 int wget_connect(char *url, Connection *cnx, char *fistblock, unsigned int size);
 
 /* remove a CURL handler from CURL */
 int wget_disconnect(Connection *cnx);
 
-/* the "data-copy" function */
-size_t wget_push_data(void *ptr, size_t size, size_t nmemb, void *data);
-
-/* perform affective read from existing handler */
+/* perform affective read from existing handler, with retries and
+   hedging (see above). returns size or -ENOTCONN */
 int wget_read(Connection *cnx, unsigned int offset, unsigned int size, char *dest);
 
 
-/* get the FS description file in local */
-int wget_meta(char *url, FILE *f);
+/* transfers of this thread stop (and fail) when '*flag' is set
+   (NULL: never) */
+void wget_set_cancel(int *flag);
+
+
+/* resolve the names of servers (base URL 'base' and its mirrors) and
+   open their TLS sessions before first reads. returns the number of
+   servers that answered */
+int wget_warmup(const char *base);
+
+/* initialise a MetaState (no previous download) */
+void wget_meta_reset(MetaState *state);
+
+/* get the FS description file, giving each line to 'func' as soon
+   as received. If 'state' is not NULL the request is conditional, and
+   'state' is updated on success.
+   returns one of WGET_META_* */
+int wget_meta(char *url, MetaState *state, WgetLine func, void *data);
+
+/* URL-encode base+file in 'dest' (max 'size' bytes, truncated if
+   needed). returns length of the full result (as snprintf) */
+int wget_encode_to(char *dest, int size, const char *base, const char *url);
 
-/* URL-encode base+file. static return */
+/* URL-encode base+file. static return (one per thread) */
 char *wget_encode(const char *base, const char *url);
 
 
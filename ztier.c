@@ -0,0 +1,218 @@
+#include <zlib.h>
+#include <pthread.h>
+
+#include "ztier.h"
+#include "tools.h"
+#include "stats.h"
+
+
+/* a chunk is kept if compressed to at most 7/8 of its size. A sample
+   at its start is compressed first: data that does not compress (media,
+   archives) costs only the sample */
+#define ZTIER_SAMPLE 8192
+#define ZTIER_KEEP(size, csize) ((csize) <= (size)-(size)/8)
+
+/* settings */
+unsigned long long ztier_budget = 0;
+int ztier_level = 1;
+
+/* all compressed chunks, oldest first */
+static ZChunk *ztier_first = NULL, *ztier_last = NULL;
+/* bytes used by all chunks (linked or not), updated without lock */
+static unsigned long long ztier_mem = 0;
+/* zlib streams, set up once (an init costs as much as a small chunk),
+   each one with its lock. Output of compression in ztier_buf */
+static z_stream ztier_def, ztier_inf;
+static int ztier_def_ready = 0, ztier_inf_ready = 0;
+static char *ztier_buf = NULL;
+static unsigned long ztier_bufsize = 0;
+static pthread_mutex_t ztier_def_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t ztier_inf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* remove a chunk from lists (not freed) */
+static void ztier_unlink(ZChunk *z) {
+  if (z->prev != NULL)
+    z->prev->next = z->next;
+  else
+    *(z->head) = z->next;
+  if (z->next != NULL)
+    z->next->prev = z->prev;
+  z->head = NULL;
+  if (z->lprev != NULL)
+    z->lprev->lnext = z->lnext;
+  else
+    ztier_first = z->lnext;
+  if (z->lnext != NULL)
+    z->lnext->lprev = z->lprev;
+  else
+    ztier_last = z->lprev;
+}
+
+/* free a chunk (not in lists) */
+void ztier_discard(ZChunk *z) {
+  __atomic_sub_fetch(&ztier_mem, sizeof(ZChunk)+z->csize, __ATOMIC_RELAXED);
+  stats_gauge(SG_ZIP_MEM, -(long long)(sizeof(ZChunk)+z->csize));
+  free(z);
+}
+
+/* put back a taken chunk */
+void ztier_back(ZChunk **head, ZChunk *z) {
+  z->head = head;
+  z->prev = NULL;
+  z->next = *head;
+  if (*head != NULL)
+    (*head)->prev = z;
+  *head = z;
+  z->lprev = ztier_last;
+  z->lnext = NULL;
+  if (ztier_last != NULL)
+    ztier_last->lnext = z;
+  else
+    ztier_first = z;
+  ztier_last = z;
+}
+
+/* compress 'size' bytes of 'data' in ztier_buf (raw deflate, with
+   ztier_def_lock held).
+   returns compressed size, 0 if failed */
+static unsigned long ztier_deflate(const char *data, unsigned int size) {
+  if (!ztier_def_ready) {
+    memset(&ztier_def, 0, sizeof(z_stream));
+    if (deflateInit2(&ztier_def, ztier_level, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      return(0);
+    ztier_def_ready = 1;
+  }
+  deflateReset(&ztier_def);
+  ztier_def.next_in = (Bytef*)data;
+  ztier_def.avail_in = size;
+  ztier_def.next_out = (Bytef*)ztier_buf;
+  ztier_def.avail_out = ztier_bufsize;
+  if (deflate(&ztier_def, Z_FINISH) != Z_STREAM_END)
+    return(0);
+  return(ztier_def.total_out);
+}
+
+/* compress a copy of data */
+ZChunk *ztier_zip(unsigned int offset, const char *data, unsigned int size) {
+  unsigned long long start = stats_now();
+  unsigned long need, csize;
+  ZChunk *z=NULL;
+  int ok;
+
+  if ((ztier_budget == 0)||(size == 0))
+    return(NULL);
+  pthread_mutex_lock(&ztier_def_lock);
+  need = deflateBound(NULL, size);
+  if (need > ztier_bufsize) {
+    free(ztier_buf);
+    ztier_buf = malloc(need);
+    ztier_bufsize = (ztier_buf == NULL)?0:need;
+  }
+  /* not worth it? */
+  ok = (ztier_buf != NULL);
+  if ((ok)&&(size > 2*ZTIER_SAMPLE)) {
+    csize = ztier_deflate(data, ZTIER_SAMPLE);
+    ok = (csize > 0)&&(ZTIER_KEEP(ZTIER_SAMPLE, csize));
+  }
+  csize = (ok)?ztier_deflate(data, size):0;
+  if ((csize > 0)&&(ZTIER_KEEP(size, csize))&&
+      (sizeof(ZChunk)+csize <= ztier_budget)&&
+      ((z = malloc(sizeof(ZChunk)+csize)) != NULL))
+    memcpy(z->data, ztier_buf, csize);
+  pthread_mutex_unlock(&ztier_def_lock);
+  stats_add(SC_ZIP_US, stats_now()-start);
+  if (z == NULL) {
+    stats_add(SC_ZIP_SKIP, 1);
+    return(NULL);
+  }
+  z->off_start = offset;
+  z->size = size;
+  z->csize = csize;
+  z->head = NULL;
+  __atomic_add_fetch(&ztier_mem, sizeof(ZChunk)+csize, __ATOMIC_RELAXED);
+  stats_gauge(SG_ZIP_MEM, sizeof(ZChunk)+csize);
+  return(z);
+}
+
+/* keep a compressed chunk in a list */
+int ztier_link(ZChunk **head, ZChunk *z) {
+  ZChunk *old;
+
+  /* drop the oldest ones of all caches */
+  while((ztier_first != NULL)&&
+        (__atomic_load_n(&ztier_mem, __ATOMIC_RELAXED) > ztier_budget)) {
+    old = ztier_first;
+    ztier_unlink(old);
+    ztier_discard(old);
+    stats_add(SC_ZIP_EVICT, 1);
+  }
+  if (__atomic_load_n(&ztier_mem, __ATOMIC_RELAXED) > ztier_budget) {
+    ztier_discard(z);  /* taken ones use it */
+    return(0);
+  }
+  ztier_back(head, z);
+  stats_add(SC_ZIP, 1);
+  stats_add(SC_ZIP_IN, z->size);
+  stats_add(SC_ZIP_OUT, z->csize);
+  mylog("ztier_link: %u+%u -> %u\n", z->off_start, z->size, z->csize);
+  return(1);
+}
+
+/* take the compressed chunk containing 'offset' */
+ZChunk *ztier_take(ZChunk **head, unsigned int offset) {
+  ZChunk *z;
+
+  for(z=*head; z!=NULL; z=z->next)
+    if ((offset >= z->off_start)&&(offset-z->off_start < z->size)) {
+      ztier_unlink(z);
+      return(z);
+    }
+  return(NULL);
+}
+
+/* uncompress a taken chunk, and free it */
+int ztier_unzip(ZChunk *z, char *dest) {
+  unsigned long long start = stats_now();
+  unsigned long size=0;
+  int ret=Z_MEM_ERROR;
+
+  pthread_mutex_lock(&ztier_inf_lock);
+  if (!ztier_inf_ready) {
+    memset(&ztier_inf, 0, sizeof(z_stream));
+    ztier_inf_ready = (inflateInit2(&ztier_inf, -15) == Z_OK);
+  }
+  if (ztier_inf_ready) {
+    inflateReset(&ztier_inf);
+    ztier_inf.next_in = (Bytef*)z->data;
+    ztier_inf.avail_in = z->csize;
+    ztier_inf.next_out = (Bytef*)dest;
+    ztier_inf.avail_out = z->size;
+    ret = inflate(&ztier_inf, Z_FINISH);
+    size = ztier_inf.total_out;
+  }
+  pthread_mutex_unlock(&ztier_inf_lock);
+  stats_add(SC_UNZIP_US, stats_now()-start);
+  if ((ret != Z_STREAM_END)||(size != z->size)) {
+    mylogl(MYLOG_ERROR, "ztier_unzip: %u+%u failed (%d)\n", z->off_start,
+           z->size, ret);
+    ztier_discard(z);
+    return(0);
+  }
+  stats_add(SC_UNZIP, 1);
+  stats_add(SC_UNZIP_DATA, size);
+  ztier_discard(z);
+  return(1);
+}
+
+/* drop all compressed chunks of a list */
+void ztier_drop(ZChunk **head) {
+  ZChunk *z;
+
+  while(*head != NULL) {
+    z = *head;
+    ztier_unlink(z);
+    ztier_discard(z);
+  }
+}
@@ -0,0 +1,63 @@
+#ifndef __ztier_h_
+#define __ztier_h_
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* compressed tier: chunks dropped from a cache (re-used or evicted for
+   the memory budget) are kept compressed (zlib, fast level) if their
+   data compresses well, and put back in a chunk when read again instead
+   of being loaded from the server. Each cache has its list of
+   compressed chunks, the least recently stored ones of all caches are
+   dropped to stay in ztier_budget. Lists are not thread-safe (used
+   with cache_lock held), compression and decompression are (run
+   without it) */
+
+/* settings */
+extern unsigned long long ztier_budget;  /* max bytes of compressed data
+                                            (0: no compressed tier) */
+extern int ztier_level;                  /* zlib level (1: fastest) */
+
+/* a compressed chunk */
+typedef struct ZChunk {
+  unsigned int off_start;      /* offset of its data in file */
+  unsigned int size;           /* size of data */
+  unsigned int csize;          /* size compressed */
+  struct ZChunk **head;        /* list of its cache (NULL: taken) */
+  struct ZChunk *prev, *next;  /* in list of its cache */
+  struct ZChunk *lprev, *lnext;  /* in list of all (oldest first) */
+  char data[];
+}ZChunk;
+
+
+/* compress a copy of 'size' bytes of data at 'offset' (no lock needed).
+   returns it (see ztier_link/ztier_discard), or NULL if not kept (no
+   tier, or data not compressible) */
+ZChunk *ztier_zip(unsigned int offset, const char *data, unsigned int size);
+
+/* keep a compressed chunk in list 'head', dropping the oldest ones of
+   all lists to stay in the budget. returns false if not kept (freed) */
+int ztier_link(ZChunk **head, ZChunk *z);
+
+/* take from list 'head' the compressed chunk containing 'offset'.
+   returns it (owned by caller, see ztier_back/ztier_unzip), or NULL */
+ZChunk *ztier_take(ZChunk **head, unsigned int offset);
+
+/* put back a taken chunk in list 'head' */
+void ztier_back(ZChunk **head, ZChunk *z);
+
+/* uncompress a taken chunk in 'dest' (z->size bytes) and free it (no
+   lock needed). returns false if failed */
+int ztier_unzip(ZChunk *z, char *dest);
+
+/* free a taken chunk, or one not linked (no lock needed) */
+void ztier_discard(ZChunk *z);
+
+/* drop all compressed chunks of list 'head' */
+void ztier_drop(ZChunk **head);
+
+
+#endif /* __ztier_h_ */